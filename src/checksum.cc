@@ -0,0 +1,141 @@
+#include "checksum.hh"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace maf::checksum {
+
+// Folds a 64-bit one's complement sum into a 16-bit sum.
+static U16 Fold64(U64 sum) {
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  return Fold(sum);
+}
+
+// Sums the bytes that don't fill a whole vector.
+static U64 SumTail(const U8 *p, Size size) {
+  U64 sum = 0;
+  while (size >= 4) {
+    U32 word;
+    memcpy(&word, p, 4);
+    sum += word;
+    p += 4;
+    size -= 4;
+  }
+  if (size >= 2) {
+    U16 word;
+    memcpy(&word, p, 2);
+    sum += word;
+    p += 2;
+    size -= 2;
+  }
+  if (size) {
+    // The last byte is padded with zero (in network byte order).
+    U16 word = 0;
+    memcpy(&word, p, 1);
+    sum += word;
+  }
+  return sum;
+}
+
+static U16 SumPortable(const void *data, Size size) {
+  const U8 *p = (const U8 *)data;
+  U64 sum = 0;
+  // 64-bit words with end-around carry.
+  while (size >= 8) {
+    U64 word;
+    memcpy(&word, p, 8);
+    sum += word;
+    sum += sum < word;
+    p += 8;
+    size -= 8;
+  }
+  return Fold64(Fold64(sum) + SumTail(p, size));
+}
+
+#if defined(__x86_64__)
+
+// Vector kernels zero-extend the 32-bit words to 64 bits before adding them.
+// The 64-bit lanes can't overflow for any realistic buffer size.
+
+static U16 SumSSE2(const void *data, Size size) {
+  const U8 *p = (const U8 *)data;
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc0 = zero, acc1 = zero;
+  for (; size >= 32; p += 32, size -= 32) {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+  }
+  U64 lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+  return Fold64(lanes[0] + lanes[1] + SumTail(p, size));
+}
+
+__attribute__((target("avx2"))) static U16 SumAVX2(const void *data,
+                                                   Size size) {
+  const U8 *p = (const U8 *)data;
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc0 = zero, acc1 = zero;
+  for (; size >= 64; p += 64, size -= 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+  }
+  U64 lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+  return Fold64(lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+                SumTail(p, size));
+}
+
+#elif defined(__ARM_NEON)
+
+static U16 SumNEON(const void *data, Size size) {
+  const U8 *p = (const U8 *)data;
+  uint64x2_t acc0 = vdupq_n_u64(0), acc1 = vdupq_n_u64(0);
+  for (; size >= 32; p += 32, size -= 32) {
+    // Pairwise add of the 32-bit words, accumulated into 64-bit lanes.
+    // Byte loads don't require the buffer to be aligned.
+    acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p)));
+    acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+  }
+  uint64x2_t acc = vaddq_u64(acc0, acc1);
+  return Fold64(vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) +
+                SumTail(p, size));
+}
+
+#endif
+
+Vec<Kernel> Kernels() {
+  Vec<Kernel> kernels;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.push_back({"AVX2", SumAVX2});
+  }
+  // SSE2 is a part of the x86-64 baseline.
+  kernels.push_back({"SSE2", SumSSE2});
+#elif defined(__ARM_NEON)
+  kernels.push_back({"NEON", SumNEON});
+#endif
+  kernels.push_back({"Portable", SumPortable});
+  return kernels;
+}
+
+// Selected once, at startup.
+static U16 (*const best_sum)(const void *, Size) = Kernels().front().sum;
+
+U16 Sum(const void *data, Size size) { return best_sum(data, size); }
+
+} // namespace maf::checksum
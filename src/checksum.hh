@@ -0,0 +1,63 @@
+#pragma once
+
+// Internet checksum (RFC 1071) used by the IP, TCP & UDP headers.
+
+#include "int.hh"
+#include "vec.hh"
+
+namespace maf::checksum {
+
+// Returns the one's complement sum of `data`, folded to 16 bits.
+//
+// The words are summed in the host byte order. Byte swapping commutes with
+// one's complement addition (RFC 1071) so once stored in memory, the result is
+// the sum of the network order words. Sums of other data (like the
+// pseudo-header) can be added to it & folded again.
+//
+// Uses the fastest kernel supported by the CPU.
+U16 Sum(const void *data, Size size);
+
+// Implementation of `Sum`, specialized for some instruction set.
+struct Kernel {
+  const char *name;
+  U16 (*sum)(const void *data, Size size);
+};
+
+// Kernels supported by this CPU, fastest first. The first one is used by
+// `Sum`.
+Vec<Kernel> Kernels();
+
+// Folds the carries of a 32-bit one's complement sum into a 16-bit sum.
+constexpr U16 Fold(U32 sum) {
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
+
+// Updates the `checksum` after a 32-bit word of the checksummed data changed
+// from `old_value` to `new_value`. Equation 3 from RFC 1624:
+//
+//   HC' = ~(~HC + ~m + m')
+//
+// One's complement sum doesn't depend on byte order so the checksum & the
+// values can be passed in their network byte order.
+constexpr void Adjust(U16 &checksum, U32 old_value, U32 new_value) {
+  U32 sum = (U16)~checksum;
+  sum += (U16)~old_value + (U16)~(old_value >> 16);
+  sum += (U16)new_value + (U16)(new_value >> 16);
+  checksum = ~Fold(sum);
+}
+
+// Same as `Adjust` but for UDP, where checksum 0 means that it was not computed
+// (and stays that way). A computed checksum of 0 is sent as 0xffff instead.
+constexpr void AdjustUDP(U16 &checksum, U32 old_value, U32 new_value) {
+  if (checksum == 0) {
+    return;
+  }
+  Adjust(checksum, old_value, new_value);
+  if (checksum == 0) {
+    checksum = 0xffff;
+  }
+}
+
+} // namespace maf::checksum
@@ -0,0 +1,64 @@
+// Benchmark of the internet checksum kernels.
+//
+// Reports the throughput of every kernel supported by this CPU, for buffers of
+// typical packet sizes. Build in release mode & run with
+// `./run checksum_bench`.
+
+#pragma maf main
+
+#include <chrono>
+
+#include "checksum.hh"
+#include "format.hh"
+#include "log.hh"
+#include "vec.hh"
+
+using namespace maf;
+
+// Amount of data checksummed for each measurement.
+static constexpr Size kTotalBytes = 1ull << 30;
+
+// The scalar loop that was used before the kernels were introduced.
+static U16 Sum16(const void *data, Size size) {
+  const U8 *p = (const U8 *)data;
+  U32 sum = 0;
+  for (Size i = 0; i + 1 < size; i += 2) {
+    sum += p[i] << 8 | p[i + 1];
+  }
+  if (size % 2) {
+    sum += p[size - 1] << 8;
+  }
+  return checksum::Fold(sum);
+}
+
+int main() {
+  Vec<checksum::Kernel> kernels = checksum::Kernels();
+  kernels.push_back({"16-bit loop", Sum16});
+
+  Vec<> buffer(64 * 1024);
+  for (Size i = 0; i < buffer.size(); ++i) {
+    buffer[i] = i * 2654435761u >> 24;
+  }
+
+  LOG << "Kernel used by checksum::Sum: " << kernels.front().name;
+  for (Size size : {64, 1500, 64 * 1024}) {
+    Str line = f("%6zu B:", size);
+    for (auto &kernel : kernels) {
+      Size iterations = kTotalBytes / size;
+      U16 sink = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (Size i = 0; i < iterations; ++i) {
+        // Prevents the compiler from hoisting the call out of the loop.
+        asm volatile("" : : "r"(buffer.data()) : "memory");
+        sink ^= kernel.sum(buffer.data(), size);
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      line += f("  %s %.2f GB/s", kernel.name,
+                iterations * size / elapsed.count() / 1e9);
+      asm volatile("" : : "r"(sink));
+    }
+    LOG << line;
+  }
+  return 0;
+}
@@ -0,0 +1,228 @@
+// Test of the internet checksum.
+//
+// First compares every kernel of `checksum::Sum` supported by this CPU (SSE2 &
+// AVX2 on x86, NEON on ARM) with the portable kernel, for random lengths &
+// alignments.
+//
+// Then tests the incremental checksum updates (RFC 1624).
+// Rewrites the addresses of random TCP & UDP packets with the NAT code of the
+// firewall and compares the results with the checksums recomputed from
+// scratch. UDP packets without a checksum (0), packets whose new checksum
+// computes to 0 (sent as 0xffff) & packets whose checksum wasn't computed yet
+// (CHECKSUM_PARTIAL) are covered too. Exits with a non-zero status on any
+// mismatch. Run with `./run checksum_test`.
+
+#pragma maf main
+
+#include <cstring>
+
+#include "checksum.hh"
+#include "firewall.hh"
+#include "format.hh"
+#include "log.hh"
+#include "random.hh"
+#include "vec.hh"
+
+using namespace maf;
+using namespace gatekeeper;
+
+static constexpr Size kPackets = 1'000'000;
+static constexpr Size kKernelChecks = 100'000;
+
+static constexpr U8 kTCP = 6;
+static constexpr U8 kUDP = 17;
+
+// Offsets of the IPv4 header fields.
+static constexpr Size kProtocolOffset = 9;
+static constexpr Size kIPChecksumOffset = 10;
+static constexpr Size kSourceOffset = 12;
+static constexpr Size kDestinationOffset = 16;
+static constexpr Size kIPHeaderSize = 20;
+
+// Offsets of the checksums in the TCP & UDP headers.
+static constexpr Size kTCPChecksumOffset = 16;
+static constexpr Size kUDPChecksumOffset = 6;
+
+enum class Kind {
+  TCP,
+  UDP,
+  // UDP packet sent without a checksum.
+  UDPWithoutChecksum,
+  // UDP packet whose checksum computes to 0 after the rewrite.
+  UDPComputedZero,
+  // Packets whose TCP/UDP checksum field holds garbage, because the kernel
+  // hasn't computed it yet.
+  TCPPartial,
+  UDPPartial,
+  kCount,
+};
+
+static const char *ToStr(Kind kind) {
+  switch (kind) {
+  case Kind::TCP:
+    return "TCP";
+  case Kind::UDP:
+    return "UDP";
+  case Kind::UDPWithoutChecksum:
+    return "UDP without checksum";
+  case Kind::UDPComputedZero:
+    return "UDP with computed 0";
+  case Kind::TCPPartial:
+    return "TCP with partial checksum";
+  case Kind::UDPPartial:
+    return "UDP with partial checksum";
+  case Kind::kCount:
+    break;
+  }
+  return "?";
+}
+
+template <typename T> static T Load(const Vec<> &packet, Size offset) {
+  T value;
+  memcpy(&value, packet.data() + offset, sizeof(value));
+  return value;
+}
+
+template <typename T> static void Store(Vec<> &packet, Size offset, T value) {
+  memcpy(packet.data() + offset, &value, sizeof(value));
+}
+
+static Vec<> RandomPacket(Kind kind) {
+  bool tcp = kind == Kind::TCP || kind == Kind::TCPPartial;
+  Size l4_header_size = tcp ? 20 : 8;
+  // Odd sizes check the padding of the last byte. UDP packets need at least
+  // 2 bytes of payload for `MakeChecksumZero`.
+  Size payload_size = 4 + random<U16>() % 1476;
+  Vec<> packet(kIPHeaderSize + l4_header_size + payload_size);
+  for (char &c : packet) {
+    c = random<U8>();
+  }
+  packet[0] = 0x45; // IPv4, no options
+  Store<U16>(packet, 2, Big<U16>(packet.size()).big_endian);
+  packet[kProtocolOffset] = tcp ? kTCP : kUDP;
+  if (tcp) {
+    packet[kIPHeaderSize + 12] = 5 << 4; // data offset
+  } else {
+    Store<U16>(packet, kIPHeaderSize + 4,
+               Big<U16>(l4_header_size + payload_size).big_endian);
+  }
+  return packet;
+}
+
+static Size L4ChecksumOffset(const Vec<> &packet) {
+  return kIPHeaderSize +
+         (packet[kProtocolOffset] == kTCP ? kTCPChecksumOffset
+                                          : kUDPChecksumOffset);
+}
+
+// Picks the last 2 bytes of the UDP header & payload, so that the checksum of
+// the packet computes to 0 (and is sent as 0xffff).
+static void MakeChecksumZero(Vec<> &packet) {
+  Size word = packet.size() - 2 - packet.size() % 2;
+  Store<U16>(packet, word, 0);
+  firewall::RecomputeChecksums(packet);
+  // Adding the one's complement of the sum makes it 0xffff.
+  Store<U16>(packet, word, Load<U16>(packet, L4ChecksumOffset(packet)));
+  firewall::RecomputeChecksums(packet);
+}
+
+// Returns the number of mismatches.
+static Size CheckKernels() {
+  Vec<checksum::Kernel> kernels = checksum::Kernels();
+  const checksum::Kernel &portable = kernels.back();
+  Vec<> buffer(64 * 1024 + 64);
+  for (char &c : buffer) {
+    c = random<U8>();
+  }
+  Size failures = 0;
+  for (Size i = 0; i < kKernelChecks; ++i) {
+    // Mostly packet sizes, sometimes up to 64 KiB.
+    Size size = random<U8>() ? random<U16>() % 2048 : random<U16>();
+    const char *data = buffer.data() + random<U8>() % 64;
+    U16 expected = portable.sum(data, size);
+    for (auto &kernel : kernels) {
+      U16 sum = kernel.sum(data, size);
+      if (sum != expected && ++failures <= 10) {
+        ERROR << kernel.name << " kernel: " << f("%04hx", sum) << " (expected "
+              << f("%04hx", expected) << ") for " << size << " bytes at offset "
+              << (data - buffer.data());
+      }
+    }
+  }
+  Str names;
+  for (auto &kernel : kernels) {
+    names += names.empty() ? "" : ", ";
+    names += kernel.name;
+  }
+  if (failures == 0) {
+    LOG << "Checked " << kKernelChecks << " buffers with kernels: " << names
+        << ". All sums match.";
+  }
+  return failures;
+}
+
+int main() {
+  if (Size failures = CheckKernels()) {
+    ERROR << failures << " kernel sums didn't match the portable kernel";
+    return 1;
+  }
+  Size failures = 0;
+  Size computed_zeros = 0;
+  for (Size i = 0; i < kPackets; ++i) {
+    Kind kind = (Kind)(i % (Size)Kind::kCount);
+    bool partial = kind == Kind::TCPPartial || kind == Kind::UDPPartial;
+    Vec<> packet = RandomPacket(kind);
+    Size address_offset = random<U8>() % 2 ? kSourceOffset : kDestinationOffset;
+    U32 new_address = random<U32>();
+    Size l4_checksum_offset = L4ChecksumOffset(packet);
+
+    // The expected checksums are computed for the rewritten packet.
+    Vec<> expected = packet;
+    Store<U32>(expected, address_offset, new_address);
+    if (kind == Kind::UDPComputedZero) {
+      MakeChecksumZero(expected);
+      memcpy(packet.data() + kIPHeaderSize, expected.data() + kIPHeaderSize,
+             packet.size() - kIPHeaderSize);
+    } else {
+      firewall::RecomputeChecksums(expected);
+    }
+    firewall::RecomputeChecksums(packet);
+    if (kind == Kind::UDPWithoutChecksum) {
+      Store<U16>(packet, l4_checksum_offset, 0);
+      Store<U16>(expected, l4_checksum_offset, 0);
+    }
+    if (partial) {
+      Store<U16>(packet, l4_checksum_offset, random<U16>());
+    }
+
+    firewall::RewritePacketAddress(packet, address_offset == kSourceOffset,
+                                   IP(new_address), partial);
+    U16 ip_checksum = Load<U16>(packet, kIPChecksumOffset);
+    U16 l4_checksum = Load<U16>(packet, l4_checksum_offset);
+
+    U16 expected_l4_checksum = Load<U16>(expected, l4_checksum_offset);
+    if (kind == Kind::UDPComputedZero) {
+      if (expected_l4_checksum != 0xffff) {
+        ERROR << "Couldn't build a UDP packet with a checksum of 0";
+        return 1;
+      }
+      ++computed_zeros;
+    }
+    if (packet != expected) {
+      if (++failures <= 10) {
+        ERROR << ToStr(kind) << " packet " << i << ": IP checksum "
+              << f("%04hx", ip_checksum) << " (expected "
+              << f("%04hx", Load<U16>(expected, kIPChecksumOffset))
+              << "), L4 checksum " << f("%04hx", l4_checksum) << " (expected "
+              << f("%04hx", expected_l4_checksum) << ")";
+      }
+    }
+  }
+  if (failures) {
+    ERROR << failures << " of " << kPackets << " packets had wrong checksums";
+    return 1;
+  }
+  LOG << "Checked " << kPackets << " packets (" << computed_zeros
+      << " with a computed UDP checksum of 0). All checksums match.";
+  return 0;
+}
@@ -5,6 +5,27 @@ using namespace maf;
 // Domain used to access hosts in the local network. Hardcoded to "lan".
 const std::string kLocalDomain = "lan";
 
+const char *kKnownEnvironmentVariables[] = {
+    "LAN",
+    "WAN",
+    "NO_AUTO_UPDATE",
+    "WIFI_PASSWORD",
+    "WIFI_NAME",
+    "FIREWALL_THREADS",
+    "FIREWALL_QUEUE_LENGTH",
+    "FIREWALL_FAIL_OPEN",
+    "DNS_CACHE_SIZE",
+    "DNS_THREADS",
+    "DNS_BLOCKLIST",
+    "DNS_AAAA",
+    "DNS_HTTPS",
+    "DNS_NEGATIVE_TTL_MIN",
+    "DNS_NEGATIVE_TTL_MAX",
+    "DNS_SERVFAIL_TTL",
+    "DNS_UPSTREAM",
+    nullptr,
+};
+
 // Default values will be overwritten during startup.
 Interface lan = {.name = "eth0", .index = 0};
 IP lan_ip = {192, 168, 1, 1};
@@ -8,6 +8,11 @@
 
 extern const std::string kLocalDomain;
 
+// Environment variables that configure Gatekeeper. Null-terminated.
+//
+// Their values are persisted when Gatekeeper installs itself as a service.
+extern const char *kKnownEnvironmentVariables[];
+
 // Those values could actually be fetched from the kernel each time they're
 // needed. This might be useful if the network configuration changes while the
 // program is running. If this ever becomes a problem, just remove those
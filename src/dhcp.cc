@@ -7,6 +7,7 @@
 #include "arp.hh"
 #include "big_endian.hh"
 #include "config.hh"
+#include "dns_local_zone.hh"
 #include "etc.hh"
 #include "expirable.hh"
 #include "format.hh"
@@ -772,6 +773,7 @@ Server::Entry::Entry(Server &server, IP ip, MAC mac, Str hostname)
       hostname(hostname) {
   server.entries_by_ip.insert(this);
   server.entries_by_mac.insert(this);
+  dns::AddLeaseHost(hostname, ip);
 }
 
 Server::Entry::Entry(Server &server, IP ip, MAC mac, Str hostname,
@@ -779,6 +781,7 @@ Server::Entry::Entry(Server &server, IP ip, MAC mac, Str hostname,
     : Expirable(ttl), ip(ip), mac(mac), hostname(hostname) {
   server.entries_by_ip.insert(this);
   server.entries_by_mac.insert(this);
+  dns::AddLeaseHost(hostname, ip);
 }
 
 void Server::Entry::UpdateMAC(MAC new_mac) {
@@ -789,13 +792,26 @@ void Server::Entry::UpdateMAC(MAC new_mac) {
 
 void Server::Entry::UpdateIP(IP new_ip) {
   server.entries_by_ip.erase(this);
+  dns::RemoveLeaseHost(hostname, ip);
   ip = new_ip;
   server.entries_by_ip.insert(this);
+  dns::AddLeaseHost(hostname, ip);
+}
+
+void Server::Entry::UpdateHostname(Str new_hostname) {
+  if (new_hostname != hostname) {
+    dns::RemoveLeaseHost(hostname, ip);
+    hostname = new_hostname;
+  }
+  // Adding is a no-op when the name is already in the zone. Otherwise it
+  // restores the name removed by an entry that was merged into this one.
+  dns::AddLeaseHost(hostname, ip);
 }
 
 Server::Entry::~Entry() {
   server.entries_by_ip.erase(this);
   server.entries_by_mac.erase(this);
+  dns::RemoveLeaseHost(hostname, ip);
 }
 
 void Server::Init() {
@@ -1046,7 +1062,7 @@ void Server::HandleRequest(string_view buf, IP source_ip, U16 port) {
     }
     auto now = steady_clock::now();
     // Update the entry.
-    entry->hostname = hostname;
+    entry->UpdateHostname(hostname);
     entry->last_activity = now;
     auto new_expiration = now + kRetentionTime;
     if (entry->expiration.has_value() && entry->expiration < new_expiration) {
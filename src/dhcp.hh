@@ -34,8 +34,10 @@ struct Server : epoll::UDPListener {
 
     void UpdateMAC(MAC new_mac);
     void UpdateIP(IP new_mac);
+    void UpdateHostname(Str new_hostname);
 
-    // Automatically removes `this` from the lookup tables of the DHCP server.
+    // Automatically removes `this` from the lookup tables of the DHCP server
+    // & its hostname from the local DNS zone.
     ~Entry();
   };
 
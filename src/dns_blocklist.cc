@@ -0,0 +1,468 @@
+#include "dns_blocklist.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "dns_utils.hh"
+#include "format.hh"
+#include "log.hh"
+#include "optional.hh"
+#include "path.hh"
+#include "timer.hh"
+#include "vec.hh"
+#include "virtual_fs.hh"
+
+namespace maf::dns {
+
+using namespace std;
+
+// Period (in seconds) of the checks for the changes of the list.
+static constexpr double kCheckInterval = 60;
+
+static constexpr char kMagic[8] = {'G', 'K', 'B', 'L', 'v', '1', '\n', '\0'};
+
+// Numbers are stored in the native byte order. The trie is only used on the
+// machine that compiled it.
+struct BlocklistHeader {
+  char magic[8];
+  U32 size;
+  U32 domains;
+  U32 root;
+  U32 labels;
+};
+
+static char Lower(char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+// First 4 bytes of a (lowercase) label, big-endian & padded with zeros. They
+// order the labels like `sort`, so most comparisons don't read the labels.
+static U32 LabelPrefix(StrView label) {
+  U32 prefix = 0;
+  for (Size i = 0; i < 4; ++i) {
+    prefix = prefix << 8 | (i < label.size() ? (U8)Lower(label[i]) : 0);
+  }
+  return prefix;
+}
+
+// Edge from a node to one of its children.
+struct BlocklistEdge {
+  U32 label;
+  U32 node;
+};
+
+static bool IsAddress(StrView token) {
+  return token.find(':') != StrView::npos ||
+         all_of(token.begin(), token.end(),
+                [](char c) { return (c >= '0' && c <= '9') || c == '.'; });
+}
+
+// Converts "Ads.Example.com." into "com\0example\0ads".
+//
+// Returns false for invalid names & for names that shouldn't be blocked, like
+// "localhost" or top-level domains.
+static bool ReversedKey(StrView domain, Str &key) {
+  if (domain.ends_with('.')) {
+    domain.remove_suffix(1);
+  }
+  if (domain.empty() || domain.size() > kMaxDomainNameLength ||
+      domain.find('.') == StrView::npos || domain == "localhost.localdomain" ||
+      IsAddress(domain)) {
+    return false;
+  }
+  key.clear();
+  Size end = domain.size();
+  while (true) {
+    Size dot = domain.rfind('.', end - 1);
+    Size start = dot == StrView::npos ? 0 : dot + 1;
+    if (start == end || end - start > 63) {
+      return false;
+    }
+    if (!key.empty()) {
+      key += '\0';
+    }
+    for (Size i = start; i < end; ++i) {
+      char c = Lower(domain[i]);
+      if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' ||
+            c == '_')) {
+        return false;
+      }
+      key += c;
+    }
+    if (dot == StrView::npos) {
+      return true;
+    }
+    end = dot;
+  }
+}
+
+// Writes the trie in post-order, so that the offsets of the children are known
+// when their parent is written.
+struct TrieBuilder {
+  const Vec<Str> &keys;
+  Str nodes;
+  Str labels;
+  unordered_map<Str, U32> label_offsets;
+
+  TrieBuilder(const Vec<Str> &keys) : keys(keys) {}
+
+  static StrView NextLabel(const Str &key, Size prefix) {
+    Size end = key.find('\0', prefix);
+    return StrView(key).substr(prefix, end == Str::npos ? end : end - prefix);
+  }
+
+  U32 Label(StrView label) {
+    auto [it, inserted] = label_offsets.try_emplace(Str(label), labels.size());
+    if (inserted) {
+      labels += (char)label.size();
+      labels += label;
+    }
+    return it->second;
+  }
+
+  void Append(U32 word) { nodes.append((const char *)&word, sizeof(word)); }
+
+  // Writes the node of the `keys` in [begin, end). Their first `prefix` bytes
+  // (whole labels) are equal. Returns the offset of the node.
+  U32 Write(Size begin, Size end, Size prefix) {
+    // Sorting puts the key that ends at this node first. Its subdomains are
+    // blocked as well so they don't need their own nodes.
+    bool blocked = keys[begin].size() + 1 == prefix;
+    Vec<pair<U32, BlocklistEdge>> children;
+    for (Size i = begin; !blocked && i < end;) {
+      StrView label = NextLabel(keys[i], prefix);
+      Size j = i + 1;
+      while (j < end && NextLabel(keys[j], prefix) == label) {
+        ++j;
+      }
+      U32 child = Write(i, j, prefix + label.size() + 1);
+      children.push_back({LabelPrefix(label), {Label(label), child}});
+      i = j;
+    }
+    U32 offset = nodes.size();
+    Append(children.size() << 1 | blocked);
+    for (auto &[label_prefix, edge] : children) {
+      Append(label_prefix);
+    }
+    for (auto &[label_prefix, edge] : children) {
+      Append(edge.label);
+      Append(edge.node);
+    }
+    return offset;
+  }
+};
+
+Str CompileBlocklist(StrView list) {
+  Vec<Str> keys;
+  Str key;
+  Size line_start = 0;
+  while (line_start < list.size()) {
+    Size line_end = list.find('\n', line_start);
+    if (line_end == StrView::npos) {
+      line_end = list.size();
+    }
+    StrView line = list.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+    line = line.substr(0, line.find('#'));
+    // Lines of hosts files start with an address, followed by any number of
+    // domains. Domain lists have one domain per line.
+    bool first = true;
+    Size pos = 0;
+    while (true) {
+      pos = line.find_first_not_of(" \t\r", pos);
+      if (pos == StrView::npos) {
+        break;
+      }
+      Size token_end = min(line.find_first_of(" \t\r", pos), line.size());
+      StrView token = line.substr(pos, token_end - pos);
+      pos = token_end;
+      if (first && IsAddress(token)) {
+        first = false;
+        continue;
+      }
+      if (ReversedKey(token, key)) {
+        keys.push_back(key);
+      }
+      if (first) {
+        break;
+      }
+    }
+  }
+  sort(keys.begin(), keys.end());
+  keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+  TrieBuilder builder(keys);
+  builder.nodes.resize(sizeof(BlocklistHeader));
+  BlocklistHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  if (keys.empty()) {
+    header.root = builder.nodes.size();
+    builder.Append(0);
+  } else {
+    header.root = builder.Write(0, keys.size(), 0);
+  }
+  header.labels = builder.nodes.size();
+  header.size = header.labels + builder.labels.size();
+  header.domains = keys.size();
+  Str trie = std::move(builder.nodes);
+  trie += builder.labels;
+  memcpy(trie.data(), &header, sizeof(header));
+  return trie;
+}
+
+bool Blocklist::Valid() const {
+  if (trie.size() < sizeof(BlocklistHeader)) {
+    return false;
+  }
+  auto &header = *(const BlocklistHeader *)trie.data();
+  return memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+         header.size == trie.size() && header.labels <= header.size &&
+         header.root % 4 == 0 && header.root + 4 <= header.labels;
+}
+
+U32 Blocklist::Domains() const {
+  return ((const BlocklistHeader *)trie.data())->domains;
+}
+
+bool Blocklist::Contains(StrView domain) const {
+  auto &header = *(const BlocklistHeader *)trie.data();
+  if (domain.ends_with('.')) {
+    domain.remove_suffix(1);
+  }
+  U32 node = header.root;
+  Size end = domain.size();
+  while (true) {
+    U32 word = *(const U32 *)(trie.data() + node);
+    if (word & 1) {
+      return true;
+    }
+    if (end == 0) {
+      return false;
+    }
+    Size dot = domain.rfind('.', end - 1);
+    Size start = dot == StrView::npos ? 0 : dot + 1;
+    StrView label = domain.substr(start, end - start);
+    end = dot == StrView::npos ? 0 : dot;
+
+    Size count = word >> 1;
+    if (node + 4 + count * (4 + sizeof(BlocklistEdge)) > header.labels) {
+      return false; // corrupted trie
+    }
+    auto *prefixes = (const U32 *)(trie.data() + node + 4);
+    auto *edges = (const BlocklistEdge *)(prefixes + count);
+    U32 prefix = LabelPrefix(label);
+
+    // Branchless binary search for the first child with a prefix that isn't
+    // smaller than the `prefix`. Both of the next probes are prefetched, so the
+    // cache misses of large nodes overlap.
+    const U32 *first = prefixes;
+    for (Size n = count; n > 1;) {
+      Size half = n / 2;
+      __builtin_prefetch(first + half / 2 - 1);
+      __builtin_prefetch(first + half + half / 2 - 1);
+      first = first[half - 1] < prefix ? first + half : first;
+      n -= half;
+    }
+    first += first < prefixes + count && *first < prefix;
+
+    // Labels with the same prefix are sorted by their remaining bytes.
+    Optional<U32> child;
+    for (Size i = first - prefixes; i < count && prefixes[i] == prefix; ++i) {
+      const BlocklistEdge *edge = edges + i;
+      if (label.size() < 4) {
+        // Short labels are entirely in the prefix.
+        child = edge->node;
+        break;
+      }
+      Size label_offset = (Size)header.labels + edge->label;
+      if (label_offset >= header.size ||
+          label_offset + 1 + (U8)trie[label_offset] > header.size) {
+        return false; // corrupted trie
+      }
+      U8 length = trie[label_offset];
+      const char *bytes = trie.data() + label_offset + 1;
+      int cmp = 0;
+      for (Size j = 4; j < min<Size>(length, label.size()) && cmp == 0; ++j) {
+        cmp = (int)(U8)bytes[j] - (int)(U8)Lower(label[j]);
+      }
+      if (cmp == 0) {
+        cmp = (int)length - (int)label.size();
+      }
+      if (cmp == 0) {
+        child = edge->node;
+        break;
+      } else if (cmp > 0) {
+        break;
+      }
+    }
+    if (!child || *child % 4 || (Size)*child + 4 > header.labels) {
+      return false;
+    }
+    node = *child;
+  }
+}
+
+BlocklistStats blocklist_stats;
+
+// Path of the list. Empty when there is no blocklist.
+static Path list_path;
+static Path trie_path;
+
+static shared_mutex blocklist_mutex;
+// Mapping of the trie at `trie_path`, guarded by `blocklist_mutex`.
+static Blocklist blocklist;
+
+static Optional<Timer> check_timer;
+static thread compiler;
+static atomic<bool> compiling = false;
+
+bool IsBlocked(StrView domain) {
+  if (list_path.str.empty()) {
+    return false;
+  }
+  shared_lock lock(blocklist_mutex);
+  if (blocklist.trie.empty() || !blocklist.Contains(domain)) {
+    return false;
+  }
+  blocklist_stats.blocked_queries.fetch_add(1, memory_order_relaxed);
+  return true;
+}
+
+// Replaces the current mapping with `mapping`. Empty `mapping` unmaps the
+// current trie.
+static void Swap(StrView mapping) {
+  StrView old;
+  {
+    lock_guard lock(blocklist_mutex);
+    old = blocklist.trie;
+    blocklist.trie = mapping;
+    blocklist_stats.domains = mapping.empty() ? 0 : blocklist.Domains();
+  }
+  if (!old.empty()) {
+    munmap((void *)old.data(), old.size());
+  }
+}
+
+static void MapTrie(Status &status) {
+  int fd = open(trie_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    AppendErrorMessage(status) += "Couldn't open " + trie_path.str;
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    AppendErrorMessage(status) += "Couldn't fstat " + trie_path.str;
+    close(fd);
+    return;
+  }
+  void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    AppendErrorMessage(status) += "Couldn't mmap " + trie_path.str;
+    return;
+  }
+  Blocklist mapped = {.trie = StrView((const char *)ptr, st.st_size)};
+  if (!mapped.Valid()) {
+    munmap(ptr, st.st_size);
+    status() += trie_path.str + " is not a valid blocklist";
+    return;
+  }
+  Swap(mapped.trie);
+}
+
+// Runs on the `compiler` thread.
+static void Compile() {
+  Status status;
+  Str trie;
+  fs::real.Map(
+      list_path, [&](StrView list) { trie = CompileBlocklist(list); }, status);
+  Path tmp_path = trie_path.str + ".tmp";
+  if (OK(status)) {
+    fs::real.Write(tmp_path, trie, status);
+  }
+  if (OK(status)) {
+    tmp_path.Rename(trie_path, status);
+  }
+  if (OK(status)) {
+    MapTrie(status);
+  }
+  if (OK(status)) {
+    LOG << "DNS blocklist " << list_path.str << " loaded ("
+        << blocklist_stats.domains << " domains).";
+  } else {
+    AppendErrorMessage(status) += "Couldn't compile the DNS blocklist";
+    ERROR << status;
+  }
+  compiling = false;
+}
+
+// Whether the trie is missing or older than the list.
+static bool TrieOutdated() {
+  struct stat list_stat, trie_stat;
+  if (stat(list_path, &list_stat) != 0) {
+    errno = 0;
+    return false;
+  }
+  if (stat(trie_path, &trie_stat) != 0) {
+    errno = 0;
+    return true;
+  }
+  auto &a = list_stat.st_mtim, &b = trie_stat.st_mtim;
+  return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+static void CheckForChanges() {
+  if (compiling || !TrieOutdated()) {
+    return;
+  }
+  if (compiler.joinable()) {
+    compiler.join();
+  }
+  compiling = true;
+  compiler = thread(Compile);
+}
+
+void StartBlocklist(Status &status) {
+  char *env = getenv("DNS_BLOCKLIST");
+  if (env == nullptr) {
+    return;
+  }
+  list_path = env;
+  trie_path = list_path.str + ".trie";
+  if (access(list_path, R_OK) != 0) {
+    AppendErrorMessage(status) += "Couldn't read DNS_BLOCKLIST " + list_path.str;
+    list_path = "";
+    return;
+  }
+  if (!TrieOutdated()) {
+    Status map_status;
+    MapTrie(map_status);
+    if (!OK(map_status)) {
+      ERROR << map_status << ". Compiling it again.";
+      Status ignored;
+      trie_path.Unlink(ignored, true);
+    }
+  }
+  CheckForChanges();
+  check_timer.emplace();
+  check_timer->handler = CheckForChanges;
+  check_timer->Arm(kCheckInterval, kCheckInterval);
+}
+
+void StopBlocklist() {
+  check_timer.reset();
+  if (compiler.joinable()) {
+    compiler.join();
+  }
+  Swap({});
+  list_path = "";
+}
+
+} // namespace maf::dns
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+
+#include "int.hh"
+#include "status.hh"
+#include "str.hh"
+
+// Domains that the DNS server refuses to resolve (ads, malware, ...).
+//
+// The list is a hosts file ("0.0.0.0 ads.example.com") or a list of domains,
+// one per line. Its path is taken from the DNS_BLOCKLIST environment variable.
+// Blocking a domain also blocks its subdomains.
+//
+// The list is compiled into a trie of reversed labels ("com" -> "example" ->
+// "ads"), saved next to it as "<list>.trie" & memory-mapped. Startup only maps
+// the trie, so it takes the same time for any list size & the trie pages are
+// loaded on demand. The list is checked for changes every minute. Changed lists
+// are compiled on a separate thread & the new trie replaces the old mapping.
+namespace maf::dns {
+
+// Read-only view of a compiled blocklist.
+//
+// The trie starts with a header, followed by the nodes & the labels. Offsets
+// are 32-bit & nodes are 4-byte aligned. Each node is a word with the number
+// of children (shifted left by one) & a flag telling whether the domain is
+// blocked. It's followed by the first 4 bytes of each child label (big-endian,
+// padded with zeros) & then the (label offset, node offset) pairs of the
+// children. Children are sorted by label. Labels start with their length.
+struct Blocklist {
+  StrView trie;
+
+  // Checks the header. Nodes are checked during the lookups.
+  bool Valid() const;
+
+  // Number of domains in the list.
+  U32 Domains() const;
+
+  // Whether the `domain` or one of its parent domains is blocked.
+  //
+  // Doesn't allocate. Case-insensitive.
+  bool Contains(StrView domain) const;
+};
+
+// Compiles the `list` into the trie format of `Blocklist`.
+Str CompileBlocklist(StrView list);
+
+struct BlocklistStats {
+  std::atomic<U64> blocked_queries = 0;
+  std::atomic<U32> domains = 0;
+};
+
+extern BlocklistStats blocklist_stats;
+
+// Whether the DNS server should refuse to resolve the `domain`. Counts the
+// blocked queries. Can be called from any thread.
+bool IsBlocked(StrView domain);
+
+void StartBlocklist(Status &);
+void StopBlocklist();
+
+} // namespace maf::dns
@@ -0,0 +1,77 @@
+// Benchmark of the DNS lookups that wait for the upstream server.
+//
+// Starts & destroys lookups of a domain that is still being resolved, like the
+// DNS server does with the proxied queries, while the cache holds more & more
+// answers. The cost per query should stay flat. Run with
+// `./run dns_cancel_bench`.
+
+#pragma maf main
+
+#include <chrono>
+#include <cstdlib>
+
+#include "dns_client.hh"
+#include "dns_utils.hh"
+#include "epoll.hh"
+#include "etc.hh"
+#include "format.hh"
+#include "log.hh"
+
+using namespace maf;
+using namespace maf::dns;
+using namespace std::chrono_literals;
+
+static constexpr Size kCacheSizes[] = {1'000, 10'000, 100'000};
+static constexpr Size kQueries = 1'000'000;
+
+struct ProxyLookup : LookupBase {
+  void OnStartupFailure(Status &status) override {
+    ERROR << status;
+    exit(1);
+  }
+  void OnAnswer(const Message &, StrView) override {}
+  void OnExpired() override {}
+};
+
+static void CacheDomain(Size i) {
+  Str domain = f("host%zu.example.com", i);
+  Message msg = {
+      .header = {.reply = true,
+                 .recursion_available = true,
+                 .question_count = 1,
+                 .answer_count = 1},
+      .questions = {Question{.domain_name = domain}},
+      .answers = {Record{Question{.domain_name = domain},
+                         std::chrono::steady_clock::now() + 1h, 4,
+                         "\x5d\xb8\xd8\x22"}}};
+  Cache(msg);
+}
+
+int main() {
+  // Keep all of the entries.
+  setenv("DNS_CACHE_SIZE", "1073741824", 1);
+  epoll::Init();
+  // Queries go to the local machine & stay unanswered.
+  etc::resolv = {IP(127, 0, 0, 1)};
+
+  // The first lookup stays in progress for the whole benchmark.
+  ProxyLookup first;
+  first.Start("pending.example.com", (U16)Type::A);
+
+  Size cached = 0;
+  for (Size cache_size : kCacheSizes) {
+    while (cached < cache_size) {
+      CacheDomain(cached++);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (Size i = 0; i < kQueries; ++i) {
+      ProxyLookup lookup;
+      lookup.Start("pending.example.com", (U16)Type::A);
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    LOG << f("%7zu cached entries: %6.1f ns/query", Entry::cache.size(),
+             elapsed.count() / kQueries);
+  }
+  return 0;
+}
@@ -1,10 +1,18 @@
 #include "dns_client.hh"
 
+#include <algorithm>
+#include <bit>
 #include <chrono>
+#include <cstdlib>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
+#include <tuple>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "big_endian.hh"
+#include "dns_local_zone.hh"
 #include "dns_utils.hh"
 #include "epoll_udp.hh"
 #include "etc.hh"
@@ -13,21 +21,68 @@
 #include "log.hh"
 #include "optional.hh"
 #include "random.hh"
+#include "tcp.hh"
+#include "timer.hh"
+#include "tls.hh"
+#include "unique_ptr.hh"
 
 namespace maf::dns {
 
 using namespace std;
 
-static int server_i = 0;
-
 // Use privileged port for DNS client - to reduce the chance of NAT collision.
 static constexpr U16 kClientPort = 22339;
 
+// Entries used at least this many times are refreshed shortly before they
+// expire, when less than 1/kPrefetchFraction of their TTL is left.
+static constexpr U32 kPrefetchHits = 3;
+static constexpr int kPrefetchFraction = 10;
+
+// Serving stale data (RFC 8767). Expired entries are kept for `kMaxStale`. When
+// one of them is used, the client waits up to `kStaleClientTimeout` for fresh
+// data & then answers with the stale records, with TTL set to `kStaleTTL`.
+// After a failed refresh, the stale records are served right away for
+// `kFailureRecheck`.
+static constexpr chrono::steady_clock::duration kMaxStale = 24h;
+static constexpr chrono::steady_clock::duration kStaleClientTimeout = 1800ms;
+static constexpr chrono::steady_clock::duration kFailureRecheck = 30s;
+static constexpr U32 kStaleTTL = 30;
+
+// Negative caching (RFC 2308). NXDOMAIN & NODATA answers are cached for the
+// TTL of their SOA record, limited to the range set by DNS_NEGATIVE_TTL_MIN &
+// DNS_NEGATIVE_TTL_MAX (in seconds). Answers without an SOA use the minimum.
+// Other errors (SERVFAIL, REFUSED, ...) are cached for DNS_SERVFAIL_TTL seconds
+// & are never served stale.
+static constexpr U32 kDefaultNegativeTTLMin = 30;
+static constexpr U32 kDefaultNegativeTTLMax = 3600;
+static constexpr U32 kDefaultServFailTTL = 5;
+static constexpr U32 kMaxNegativeTTL = 86400;
+
+// Shortest delay (in seconds) of the expire timer. Matches the resolution of
+// `Expirable`. A zero delay would disarm the timer.
+static constexpr double kMinExpireDelay = 0.001;
+
+// Hedged & retried queries (see `Upstream`).
+static constexpr Size kMaxAttempts = 5;
+static constexpr chrono::steady_clock::duration kMinHedgeDelay = 10ms;
+static constexpr U64 kMinP95Samples = 20;
+// Retransmission timeouts (RFC 6298).
+static constexpr chrono::steady_clock::duration kInitialRTO = 1s;
+static constexpr chrono::steady_clock::duration kMinRTO = 50ms;
+static constexpr chrono::steady_clock::duration kMinBackoff = 1s;
+static constexpr chrono::steady_clock::duration kMaxBackoff = 60s;
+
+// Entries with a query in flight, by request ID. Pending entries wait for the
+// first answer & cached entries for their `Refresh`.
+static unordered_map<U16, Entry *> requests;
+
 Big<U16> AllocateRequestId() {
   // Randomize initial request ID
   static Big<U16> request_id = random<U16>();
-  // Subsequent request IDs are incremented by 1
-  request_id.Set(request_id + 1);
+  // Subsequent request IDs are incremented by 1, skipping the ones in flight
+  do {
+    request_id.Set(request_id + 1);
+  } while (requests.contains(request_id));
   return request_id;
 }
 
@@ -57,28 +112,309 @@ struct EqualData {
 
 unordered_multiset<const Record *, HashByData, EqualData> cache_reverse;
 
+CacheStats cache_stats;
+
+// Cached entries that the DNS server threads may read. Modified only by the
+// main thread, which holds `shared_cache_mutex` exclusively while doing so.
+static shared_mutex shared_cache_mutex;
+static unordered_set<Entry *, Entry::QuestionHash, Entry::QuestionEqual>
+    shared_cache;
+
+static constexpr Size kDefaultCacheBudget = 4 * 1024 * 1024;
+
+// Node of a hash table with its cached hash, malloc header & bucket slot.
+static constexpr Size kHashNodeSize = 4 * sizeof(void *);
+
+static Size HeapSize(const Str &s) {
+  const char *obj = (const char *)&s;
+  if (s.data() >= obj && s.data() < obj + sizeof(s)) {
+    return 0; // short string stored inline
+  }
+  return s.capacity() + 1;
+}
+
+static Size HeapSize(const Vec<Record> &records) {
+  Size size = records.capacity() * sizeof(Record);
+  for (const Record &r : records) {
+    size += HeapSize(r.domain_name) + HeapSize(r.data);
+  }
+  return size;
+}
+
+static Size CacheBudget() {
+  if (char *env = getenv("DNS_CACHE_SIZE")) {
+    long long n = atoll(env);
+    if (n >= 64 * 1024 && n <= (1ll << 30)) {
+      return n;
+    }
+    ERROR << "DNS_CACHE_SIZE should be a number of bytes between 65536 and "
+             "1073741824. Got \""
+          << env << "\". Ignoring it.";
+  }
+  return kDefaultCacheBudget;
+}
+
+static U32 SecondsFromEnv(const char *name, U32 default_value) {
+  if (char *env = getenv(name)) {
+    char *end;
+    long long n = strtoll(env, &end, 10);
+    if (*env && *end == 0 && n >= 0 && n <= kMaxNegativeTTL) {
+      return n;
+    }
+    ERROR << name << " should be a number of seconds between 0 and "
+          << kMaxNegativeTTL << ". Got \"" << env << "\". Ignoring it.";
+  }
+  return default_value;
+}
+
+struct NegativeCachingPolicy {
+  chrono::seconds min_ttl;
+  chrono::seconds max_ttl;
+  chrono::seconds servfail_ttl;
+
+  NegativeCachingPolicy() {
+    min_ttl = chrono::seconds(
+        SecondsFromEnv("DNS_NEGATIVE_TTL_MIN", kDefaultNegativeTTLMin));
+    max_ttl = chrono::seconds(
+        SecondsFromEnv("DNS_NEGATIVE_TTL_MAX", kDefaultNegativeTTLMax));
+    if (max_ttl < min_ttl) {
+      ERROR << "DNS_NEGATIVE_TTL_MAX is smaller than DNS_NEGATIVE_TTL_MIN. "
+               "Using "
+            << min_ttl.count() << " seconds for both.";
+      max_ttl = min_ttl;
+    }
+    servfail_ttl = chrono::seconds(
+        SecondsFromEnv("DNS_SERVFAIL_TTL", kDefaultServFailTTL));
+  }
+};
+
+static Vec<Upstream> upstreams;
+
+const Vec<Upstream> &Upstreams() {
+  bool same = upstreams.size() == etc::resolv.size();
+  for (Size i = 0; same && i < upstreams.size(); ++i) {
+    same = upstreams[i].ip == etc::resolv[i];
+  }
+  if (!same) {
+    Vec<Upstream> updated;
+    for (IP ip : etc::resolv) {
+      auto it = find_if(upstreams.begin(), upstreams.end(),
+                        [&](const Upstream &u) { return u.ip == ip; });
+      updated.push_back(it == upstreams.end() ? Upstream{.ip = ip} : *it);
+    }
+    upstreams = std::move(updated);
+  }
+  return upstreams;
+}
+
+static Upstream *FindUpstream(IP ip) {
+  for (auto &upstream : upstreams) {
+    if (upstream.ip == ip) {
+      return &upstream;
+    }
+  }
+  return nullptr;
+}
+
+chrono::steady_clock::duration Upstream::RTO() const {
+  if (answers == 0) {
+    return kInitialRTO;
+  }
+  return clamp<chrono::steady_clock::duration>(srtt + 4 * rttvar, kMinRTO,
+                                               kPendingTTL);
+}
+
+chrono::steady_clock::duration Upstream::P95() const {
+  U64 total = 0;
+  for (U32 count : histogram) {
+    total += count;
+  }
+  if (total < kMinP95Samples) {
+    return RTO();
+  }
+  U64 cumulative = 0;
+  for (int i = 0; i < kRTTBuckets - 1; ++i) {
+    cumulative += histogram[i];
+    if (cumulative * 100 >= total * 95) {
+      return chrono::milliseconds(1 << i);
+    }
+  }
+  return RTO();
+}
+
+bool Upstream::Healthy(chrono::steady_clock::time_point now) const {
+  return now >= backoff_until;
+}
+
+void Upstream::RecordAnswer(chrono::steady_clock::duration rtt) {
+  if (answers == 0) {
+    srtt = rtt;
+    rttvar = rtt / 2;
+  } else {
+    rttvar = (3 * rttvar + (srtt > rtt ? srtt - rtt : rtt - srtt)) / 4;
+    srtt = (7 * srtt + rtt) / 8;
+  }
+  ++answers;
+  loss -= loss / 8;
+  failures = 0;
+  backoff_until = {};
+  U64 ms = chrono::duration_cast<chrono::milliseconds>(rtt).count();
+  ++histogram[min<int>(bit_width(ms), kRTTBuckets - 1)];
+}
+
+void Upstream::RecordTimeout(chrono::steady_clock::time_point now) {
+  ++timeouts;
+  loss += (1 - loss) / 8;
+  ++failures;
+  backoff_until = now + min(kMinBackoff * (1 << min<U32>(failures - 1, 6)),
+                            kMaxBackoff);
+}
+
+// The expire timer of the client is a one-shot timer, armed for the next
+// expiration of the `Expirable` queue (disarmed when the queue is empty).
+// Retries, refreshes & pending queries wake it up earlier when needed, so that
+// hedged queries are sent on time even when no packets arrive. An idle client
+// only wakes up when something actually expires.
+static Optional<chrono::steady_clock::time_point> expire_timer_deadline;
+
+static void ArmExpireTimer();
+static void WakeUpAt(chrono::steady_clock::time_point time);
+
+struct PendingEntry;
+
+// Sends the query again when it expires.
+struct Retry : Expirable {
+  PendingEntry *entry;
+  Retry(PendingEntry *entry, chrono::steady_clock::duration delay)
+      : Expirable(delay), entry(entry) {
+    WakeUpAt(*expiration);
+  }
+  ~Retry() override;
+};
+
 struct PendingEntry : Entry {
+  struct Attempt {
+    IP upstream;
+    chrono::steady_clock::time_point sent;
+  };
   Big<U16> id;
-  Vec<LookupBase *> in_progress;
+  Vec<LookupBase *> waiting;
+  Vec<Attempt> attempts;
+  Optional<IP> answered_by;
+  Retry *retry = nullptr;
+  chrono::steady_clock::duration retry_delay = {};
+  // Set once a truncated answer was repeated over TCP. Truncated answers to
+  // the hedged & retried queries don't repeat it again.
+  bool sent_over_tcp = false;
   PendingEntry(Question question, Big<U16> id, LookupBase *lookup);
   ~PendingEntry() override {
-    for (auto *lookup : in_progress) {
-      lookup->in_progress = false;
+    requests.erase(id);
+    for (auto *lookup : waiting) {
+      lookup->in_progress = nullptr;
       StopClient();
       lookup->OnExpired();
     }
+    if (retry) {
+      retry->entry = nullptr;
+      delete retry;
+    }
+    // Queries that weren't answered in time count as lost.
+    auto now = chrono::steady_clock::now();
+    for (auto &attempt : attempts) {
+      Upstream *upstream = FindUpstream(attempt.upstream);
+      if (upstream == nullptr || attempt.upstream == answered_by) {
+        continue;
+      }
+      if (now - attempt.sent >= upstream->RTO()) {
+        upstream->RecordTimeout(now);
+      }
+    }
+    if (answered_by.has_value()) {
+      for (auto it = attempts.rbegin(); it != attempts.rend(); ++it) {
+        if (it->upstream == *answered_by) {
+          if (Upstream *upstream = FindUpstream(it->upstream)) {
+            upstream->RecordAnswer(now - it->sent);
+          }
+          break;
+        }
+      }
+    }
   }
+
+  // Sends the query to the best upstream & schedules the next attempt.
+  void SendAttempt();
+};
+
+struct CachedEntry;
+
+// Request that refreshes a cached entry, before (prefetch) or after (RFC 8767)
+// it expires.
+struct Refresh : Expirable {
+  CachedEntry &entry;
+  Big<U16> id;
+  IP upstream;
+  chrono::steady_clock::time_point sent;
+  bool answered = false;
+  // See `PendingEntry::sent_over_tcp`.
+  bool sent_over_tcp = false;
+  // Lookups of the expired entry that wait for the fresh data.
+  Vec<LookupBase *> waiting;
+  Refresh(CachedEntry &entry);
+  // Called when the refresh fails or times out. Answers the waiting lookups
+  // with the stale data.
+  ~Refresh() override;
 };
 
 struct CachedEntry : Entry {
   CachedEntry(Message &msg)
-      : Entry(msg.questions.front()), response_code(msg.header.response_code),
-        answers(msg.answers), authority(msg.authority),
-        additional(msg.additional) {
+      : Entry(Kind::Cached, msg.questions.front()),
+        msg{.header =
+                {
+                    .id = 0,
+                    .recursion_desired = true,
+                    .truncated = false,
+                    .authoritative = false,
+                    .opcode = Header::OperationCode::QUERY,
+                    .reply = true,
+                    .response_code = msg.header.response_code,
+                    .reserved = 0,
+                    .recursion_available = true,
+                    .question_count = 1,
+                    .answer_count = msg.answers.size(),
+                    .authority_count = msg.authority.size(),
+                    .additional_count = msg.additional.size(),
+                },
+            .questions = {msg.questions.front()},
+            .answers = msg.answers,
+            .authority = msg.authority,
+            .additional = msg.additional},
+        cached_at(chrono::steady_clock::now()) {
 
+    static const NegativeCachingPolicy negative_caching;
+    auto now = chrono::steady_clock::now();
     Optional<chrono::steady_clock::time_point> new_expiration = nullopt;
-    if (msg.header.response_code != ResponseCode::NO_ERROR) {
-      new_expiration = chrono::steady_clock::now() + 60s;
+    bool name_error = msg.header.response_code == ResponseCode::NAME_ERROR;
+    bool no_data = msg.header.response_code == ResponseCode::NO_ERROR &&
+                   msg.answers.empty();
+    if (name_error || no_data) {
+      chrono::seconds ttl = negative_caching.min_ttl;
+      for (const Record &r : msg.authority) {
+        if (auto soa_ttl = NegativeTTL(r, now)) {
+          ttl = clamp(chrono::seconds(*soa_ttl), negative_caching.min_ttl,
+                      negative_caching.max_ttl);
+          break;
+        }
+      }
+      new_expiration = now + ttl;
+      // Clients may cache the answer for as long as we do.
+      for (auto *records : {&this->msg.authority, &this->msg.additional}) {
+        for (Record &r : *records) {
+          r.expiration = new_expiration;
+        }
+      }
+    } else if (msg.header.response_code != ResponseCode::NO_ERROR) {
+      new_expiration = now + negative_caching.servfail_ttl;
+      serve_stale = false;
     } else {
       msg.ForEachRecord([&](const Record &r) {
         auto record_expiration = r.expiration;
@@ -93,85 +429,231 @@ struct CachedEntry : Entry {
         }
       });
     }
-    if (new_expiration.has_value()) {
+    auto never = chrono::steady_clock::time_point::max();
+    if (new_expiration.has_value() && !serve_stale) {
+      fresh_until = new_expiration;
       UpdateExpiration(*new_expiration);
+    } else if (new_expiration.has_value() &&
+               *new_expiration < never - kMaxStale) {
+      fresh_until = new_expiration;
+      UpdateExpiration(*new_expiration + kMaxStale);
+    } else if (new_expiration.has_value()) {
+      UpdateExpiration(never);
     }
 
-    for (auto &answer : answers) {
+    // Entries in `Entry::cache` & `cache_reverse` are also accounted for.
+    size = kHashNodeSize;
+    for (auto &answer : this->msg.answers) {
       if (answer.type == Type::A) {
         cache_reverse.insert(&answer);
+        size += kHashNodeSize;
       }
     }
+
+    // Serialize the response once. Cache hits only need to refresh its TTLs.
+    this->msg.header.write_to(wire);
+    question.write_to(wire);
+    this->msg.ForEachRecord([&](const Record &r) {
+      r.write_to(wire);
+      // TTL is followed by the data length & the data.
+      ttl_offsets.push_back(wire.size() - r.data.size() - 2 - 4);
+    });
+
+    size += sizeof(*this) + HeapSize(question.domain_name) +
+            this->msg.questions.capacity() * sizeof(Question) +
+            HeapSize(this->msg.questions.front().domain_name) +
+            HeapSize(this->msg.answers) + HeapSize(this->msg.authority) +
+            HeapSize(this->msg.additional) + HeapSize(wire) +
+            ttl_offsets.capacity() * sizeof(U16) + kHashNodeSize;
+    cache_stats.size += size;
+    LinkFront();
+    lock_guard lock(shared_cache_mutex);
+    shared_cache.insert(this);
   }
   ~CachedEntry() override {
-    for (const auto &r : answers) {
+    {
+      lock_guard lock(shared_cache_mutex);
+      shared_cache.erase(this);
+    }
+    if (refresh) {
+      for (auto *lookup : refresh->waiting) {
+        lookup->in_progress = nullptr;
+        StopClient();
+        lookup->OnExpired();
+      }
+      refresh->waiting.clear();
+      delete refresh;
+    }
+    for (const auto &r : msg.answers) {
       if (r.type == Type::A) {
         cache_reverse.erase(&r);
       }
     }
+    Unlink();
+    cache_stats.size -= size;
   }
-  ResponseCode response_code;
-  Vec<Record> answers;
-  Vec<Record> authority;
-  Vec<Record> additional;
 
-  Str ToStr() const {
-    Str r = "CachedEntry(" + Str(dns::ToStr(response_code));
-    for (const Record &a : answers) {
-      r += "  " + a.ToStr();
+  // Response with ID 0, ready to be sent to the clients.
+  Message msg;
+  // `msg` in the wire format. Never modified, so that the DNS server threads
+  // can copy it. TTLs are updated in the copies.
+  Str wire;
+  // Offsets of the TTL fields in `wire`, in the order of `ForEachRecord`.
+  Vec<U16> ttl_offsets;
+  // Approximate number of bytes used by this entry.
+  Size size;
+
+  // Expiration of the first record. Afterwards the entry is stale.
+  Optional<chrono::steady_clock::time_point> fresh_until;
+  // Errors other than NXDOMAIN are dropped as soon as they expire.
+  bool serve_stale = true;
+  chrono::steady_clock::time_point cached_at;
+  // Also counted by the DNS server threads.
+  atomic<U32> hits = 0;
+  // Set by the DNS server threads, which can't reorder the LRU list. Gives the
+  // entry a second chance when it's about to be evicted.
+  atomic<bool> used_by_server_threads = false;
+  Refresh *refresh = nullptr;
+  Optional<chrono::steady_clock::time_point> refresh_failed;
+
+  Optional<chrono::steady_clock::time_point> FreshUntil() const override {
+    return fresh_until;
+  }
+
+  bool Stale(chrono::steady_clock::time_point now) const {
+    return fresh_until.has_value() && now >= *fresh_until;
+  }
+
+  // Whether the entry is popular & about to expire.
+  bool PrefetchDue(chrono::steady_clock::time_point now) const {
+    return hits >= kPrefetchHits && fresh_until.has_value() &&
+           (*fresh_until - now) * kPrefetchFraction < *fresh_until - cached_at;
+  }
+
+  bool ShouldPrefetch(chrono::steady_clock::time_point now) const {
+    return refresh == nullptr && PrefetchDue(now);
+  }
+
+  // Whether an expired entry may be refreshed now.
+  bool ShouldRetry(chrono::steady_clock::time_point now) const {
+    return refresh == nullptr &&
+           (!refresh_failed.has_value() ||
+            now - *refresh_failed >= kFailureRecheck);
+  }
+
+  // Cached entries, from the most to the least recently used.
+  static CachedEntry *lru_head;
+  static CachedEntry *lru_tail;
+  CachedEntry *lru_prev = nullptr;
+  CachedEntry *lru_next = nullptr;
+
+  void LinkFront() {
+    lru_next = lru_head;
+    if (lru_head) {
+      lru_head->lru_prev = this;
+    } else {
+      lru_tail = this;
     }
-    for (const Record &a : authority) {
-      r += "  " + a.ToStr();
+    lru_head = this;
+  }
+
+  void Unlink() {
+    (lru_prev ? lru_prev->lru_next : lru_head) = lru_next;
+    (lru_next ? lru_next->lru_prev : lru_tail) = lru_prev;
+    lru_prev = lru_next = nullptr;
+  }
+
+  void Touch() {
+    if (lru_head != this) {
+      Unlink();
+      LinkFront();
     }
-    for (const Record &a : additional) {
-      r += "  " + a.ToStr();
+  }
+
+  // Updates the TTLs in `out` (a copy of `wire`) to match the time left until
+  // the expiration of each record.
+  void WriteTTLs(char *out, chrono::steady_clock::time_point now) const {
+    bool stale = Stale(now);
+    Size i = 0;
+    for (auto *records : {&msg.answers, &msg.authority, &msg.additional}) {
+      for (const Record &r : *records) {
+        U32 ttl = r.ttl(now);
+        if (stale) {
+          ttl = max(ttl, kStaleTTL);
+        }
+        *(Big<U32> *)(out + ttl_offsets[i++]) = ttl;
+      }
     }
+  }
+
+  void Answer(LookupBase &lookup, chrono::steady_clock::time_point now) {
+    char buffer[wire.size()];
+    memcpy(buffer, wire.data(), wire.size());
+    WriteTTLs(buffer, now);
+    lookup.OnAnswer(msg, StrView(buffer, wire.size()));
+  }
+
+  Str ToStr() const {
+    Str r = "CachedEntry(" + Str(dns::ToStr(msg.header.response_code));
+    msg.ForEachRecord([&](const Record &a) { r += "  " + a.ToStr(); });
     r += ")";
     return r;
   }
   Str to_html() const {
-    string r = "<code>" + string(dns::ToStr(response_code)) + "</code>";
-    for (const Record &a : answers) {
-      r += " " + a.to_html();
-    }
-    for (const Record &a : authority) {
-      r += " " + a.to_html();
-    }
-    for (const Record &a : additional) {
-      r += " " + a.to_html();
-    }
+    string r = "<code>" + string(dns::ToStr(msg.header.response_code)) +
+               "</code>";
+    msg.ForEachRecord([&](const Record &a) { r += " " + a.to_html(); });
     return r;
   }
 };
 
+CachedEntry *CachedEntry::lru_head = nullptr;
+CachedEntry *CachedEntry::lru_tail = nullptr;
+
+// Evicts the least recently used entries until the cache fits in its budget.
+static void Evict(CachedEntry *keep) {
+  static Size budget = CacheBudget();
+  cache_stats.budget = budget;
+  while (cache_stats.size > budget && CachedEntry::lru_tail &&
+         CachedEntry::lru_tail != keep) {
+    CachedEntry *tail = CachedEntry::lru_tail;
+    if (tail->used_by_server_threads.exchange(false,
+                                              memory_order_relaxed)) {
+      tail->Unlink();
+      tail->LinkFront();
+      continue;
+    }
+    delete tail;
+    ++cache_stats.evictions;
+  }
+}
+
 static void CancelLookup(LookupBase *lookup) {
-  if (not lookup->in_progress) {
+  Entry *entry = lookup->in_progress;
+  if (entry == nullptr) {
     return;
   }
-  lookup->in_progress = false;
+  lookup->in_progress = nullptr;
   StopClient();
-  // Remove this from the pending lookups.
-  for (Entry *e : Entry::cache) {
-    PendingEntry *pending = dynamic_cast<PendingEntry *>(e);
-    if (pending == nullptr) {
-      continue;
-    }
-    for (int i = 0; i < pending->in_progress.size(); i++) {
-      if (pending->in_progress[i] == lookup) {
-        pending->in_progress.erase(pending->in_progress.begin() + i);
-        return;
-      }
-    }
+  // Remove this from the waitlist of its entry. Cached entries only have
+  // waiting lookups while they're refreshed.
+  Vec<LookupBase *> &waitlist =
+      entry->kind == Entry::Kind::Pending
+          ? static_cast<PendingEntry *>(entry)->waiting
+          : static_cast<CachedEntry *>(entry)->refresh->waiting;
+  if (auto it = find(waitlist.begin(), waitlist.end(), lookup);
+      it != waitlist.end()) {
+    waitlist.erase(it);
   }
 }
 
-LookupBase::LookupBase() : in_progress(false) {}
+LookupBase::LookupBase() : in_progress(nullptr) {}
 
 LookupBase::~LookupBase() { CancelLookup(this); }
 
 void LookupIPv4::Start(Str domain) { LookupBase::Start(domain, (U16)Type::A); }
 
-void LookupIPv4::OnAnswer(const Message &msg) {
+void LookupIPv4::OnAnswer(const Message &msg, StrView wire) {
   for (auto &answer : msg.answers) {
     if (answer.type != Type::A) {
       continue;
@@ -191,10 +673,18 @@ void LookupIPv4::OnStartupFailure(Status &status) { on_error(); }
 
 void LookupIPv4::OnExpired() { on_error(); }
 
+static void SendQueryOverTCP(const Question &question, Big<U16> id, IP to);
+static bool QueriesOverTLS();
+
 struct Client : epoll::UDPListener {
   U32 refs = 0;
+  Optional<Timer> expire_timer;
 
   void Listen(Status &status) {
+    // Reads DNS_UPSTREAM (and warns about its TLS mode) when the client first
+    // starts, rather than on the first query.
+    QueriesOverTLS();
+
     fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd == -1) {
       AppendErrorMessage(status) += "socket";
@@ -216,9 +706,28 @@ struct Client : epoll::UDPListener {
     }
 
     epoll::Add(this, status);
+    if (!OK(status)) {
+      StopListening();
+      return;
+    }
+
+    // Lookups waiting for stale entries to be refreshed shouldn't depend on
+    // other packets to time out.
+    expire_timer.emplace();
+    expire_timer->handler = [] {
+      Expirable::Expire();
+      ArmExpireTimer();
+    };
+    ArmExpireTimer();
+    if (!OK(expire_timer->status)) {
+      AppendErrorMessage(status) += expire_timer->status.ToStr();
+      StopListening();
+      return;
+    }
   }
 
   void StopListening() {
+    expire_timer.reset();
     Status ignored;
     epoll::Del(this, ignored);
     shutdown(fd, SHUT_RDWR);
@@ -244,9 +753,14 @@ struct Client : epoll::UDPListener {
           << source_port << " (expected port " << kServerPort << ")";
       return;
     }
-    Message msg;
+    HandleResponse(buf, source_ip, false);
+  }
+
+  // Handles a response received over UDP or TCP.
+  void HandleResponse(StrView buf, IP source_ip, bool over_tcp) {
+    MessageView msg;
     Str err;
-    msg.Parse(buf.data(), buf.size(), err);
+    msg.Parse(buf, err);
     if (!err.empty()) {
       ERROR << "DNS client couldn't parse response. " << err;
       return;
@@ -264,42 +778,109 @@ struct Client : epoll::UDPListener {
       return;
     }
 
-    if (msg.questions.size() != 1) {
+    if (msg.header.question_count != 1) {
       LOG << "DNS client expected a packet with one question. Received: "
           << msg.ToStr();
       return;
     }
 
-    auto entry_it = Entry::cache.find(msg.questions.front());
-    if (entry_it == Entry::cache.end()) {
-      LOG << "DNS client received a reply to a question that it didn't ask: "
-          << msg.questions.front().ToStr();
+    QuestionView question = msg.FirstQuestion();
+    DomainNameBuffer name_buffer;
+    StrView domain_name = msg.LoadName(question.name_offset, name_buffer);
+    QuestionKey key = {.domain_name = domain_name,
+                       .type = question.type,
+                       .class_ = question.class_};
+    auto request_it = requests.find(msg.header.id);
+    if (request_it == requests.end() ||
+        !Entry::QuestionEqual()(key, request_it->second)) {
+      auto entry_it = Entry::cache.find(key);
+      if (entry_it == Entry::cache.end()) {
+        LOG << "DNS client received a reply to a question that it didn't ask: "
+            << Question{.domain_name = Str(domain_name),
+                        .type = question.type,
+                        .class_ = question.class_}
+                   .ToStr();
+      } else if ((*entry_it)->kind == Entry::Kind::Pending) {
+        err = "Received an answer with an wrong ID: " +
+              f("0x%04hx", msg.header.id) + " (expected: " +
+              f("0x%04hx", static_cast<PendingEntry *>(*entry_it)->id) + ")";
+      }
+      // Otherwise this is a reply to a question that we asked earlier, but we
+      // already received a reply to it. This is not an error.
       return;
     }
-    Entry *entry = *entry_it;
-    PendingEntry *pending = dynamic_cast<PendingEntry *>(entry);
-    if (pending == nullptr) {
-      // This is a reply to a question that we asked earlier, but we already
-      // received a reply to it. This is not an error.
+    Entry *entry = request_it->second;
+    if (msg.header.truncated && !over_tcp) {
+      // The answer didn't fit in the UDP payload. Ask the same upstream over
+      // TCP, so that the client doesn't have to.
+      bool &sent_over_tcp =
+          entry->kind == Entry::Kind::Cached
+              ? static_cast<CachedEntry *>(entry)->refresh->sent_over_tcp
+              : static_cast<PendingEntry *>(entry)->sent_over_tcp;
+      if (!sent_over_tcp) {
+        sent_over_tcp = true;
+        SendQueryOverTCP(entry->question, msg.header.id, source_ip);
+        ++cache_stats.tcp_fallbacks;
+      }
       return;
     }
-
-    if (pending->id != msg.header.id) {
-      err = "Received an answer with an wrong ID: " +
-            f("0x%04hx", msg.header.id) +
-            " (expected: " + f("0x%04hx", pending->id) + ")";
+    if (entry->kind == Entry::Kind::Cached) {
+      CachedEntry *cached = static_cast<CachedEntry *>(entry);
+      Refresh *refresh = cached->refresh;
+      if (Upstream *upstream = FindUpstream(source_ip);
+          upstream && source_ip == refresh->upstream) {
+        upstream->RecordAnswer(chrono::steady_clock::now() - refresh->sent);
+      }
+      refresh->answered = true;
+      if (msg.header.response_code == ResponseCode::SERVER_FAILURE ||
+          msg.header.response_code == ResponseCode::REFUSED) {
+        // RFC 8767: keep using the stale data.
+        delete refresh;
+        return;
+      }
+      Message response;
+      response.Parse(buf.data(), buf.size(), err);
+      if (!err.empty()) {
+        ERROR << "DNS client couldn't parse response. " << err;
+        delete refresh;
+        return;
+      }
+      Vec<LookupBase *> lookups = std::move(refresh->waiting);
+      refresh->waiting.clear();
+      delete cached;
+      Answer(response, lookups);
       return;
     }
-    for (auto *lookup : pending->in_progress) {
-      lookup->in_progress = false;
-      StopClient();
-      lookup->OnAnswer(msg);
+    PendingEntry *pending = static_cast<PendingEntry *>(entry);
+    // Only the responses that are cached are fully parsed.
+    Message response;
+    response.Parse(buf.data(), buf.size(), err);
+    if (!err.empty()) {
+      ERROR << "DNS client couldn't parse response. " << err;
+      return;
     }
-    pending->in_progress.clear();
+    Vec<LookupBase *> lookups = std::move(pending->waiting);
+    pending->waiting.clear();
+    pending->answered_by = source_ip;
     // Destructors remove the entry from the caches & expiration queue.
     delete pending;
+    Answer(response, lookups);
+  }
+
+  // Caches the `response` & passes it to the waiting `lookups`.
+  void Answer(Message &response, Vec<LookupBase *> &lookups) {
+    // EDNS options apply only to the upstream's message.
+    erase_if(response.additional,
+             [](const Record &r) { return r.type == Type::OPT; });
     // Constructors add the entry to the caches & expiration queue.
-    new CachedEntry(msg);
+    CachedEntry *cached = new CachedEntry(response);
+    Evict(cached);
+    auto now = chrono::steady_clock::now();
+    for (auto *lookup : lookups) {
+      lookup->in_progress = nullptr;
+      StopClient();
+      cached->Answer(*lookup, now);
+    }
   }
 
   void NotifyRead(Status &epoll_status) override {
@@ -312,10 +893,279 @@ struct Client : epoll::UDPListener {
 
 Client client;
 
-void LookupBase::Start(Str domain, U16 type) {
+static void ArmTimerAt(chrono::steady_clock::time_point time) {
+  expire_timer_deadline = time;
+  chrono::duration<double> delay = time - chrono::steady_clock::now();
+  client.expire_timer->Arm(max(delay.count(), kMinExpireDelay));
+}
+
+static void ArmExpireTimer() {
+  if (!client.expire_timer) {
+    return;
+  }
+  if (auto next = Expirable::NextExpiration()) {
+    ArmTimerAt(*next);
+  } else {
+    expire_timer_deadline.reset();
+    client.expire_timer->Disarm();
+  }
+}
+
+static void WakeUpAt(chrono::steady_clock::time_point time) {
+  if (client.expire_timer &&
+      (!expire_timer_deadline || time < *expire_timer_deadline)) {
+    ArmTimerAt(time);
+  }
+}
+
+// Picks the fastest healthy upstream, preferring the ones that weren't `tried`
+// yet. Lost queries are penalized with the upstream's RTO. New upstreams are
+// tried first, to measure their RTT. If all upstreams are failing, picks the one
+// that will be retried first.
+static Upstream *PickUpstream(const Vec<PendingEntry::Attempt> &tried,
+                              chrono::steady_clock::time_point now) {
+  Upstreams();
+  auto Key = [&](const Upstream &u) {
+    bool was_tried = any_of(tried.begin(), tried.end(), [&](auto &attempt) {
+      return attempt.upstream == u.ip;
+    });
+    bool healthy = u.Healthy(now);
+    auto expected_rtt = chrono::duration_cast<chrono::steady_clock::duration>(
+        u.srtt + u.loss * u.RTO());
+    return tuple(!healthy, was_tried,
+                 healthy ? expected_rtt : u.backoff_until - now);
+  };
+  Upstream *best = nullptr;
+  for (auto &upstream : upstreams) {
+    if (best == nullptr || Key(upstream) < Key(*best)) {
+      best = &upstream;
+    }
+  }
+  return best;
+}
+
+static Str QueryMessage(const Question &question, Big<U16> id) {
+  Str buffer;
+  Header{.id = id,
+         .recursion_desired = true,
+         .question_count = 1,
+         .additional_count = 1}
+      .write_to(buffer);
+  question.write_to(buffer);
+  AppendOPT(buffer, kEDNSPayloadSize);
+  return buffer;
+}
+
+// Port of the DNS-over-TLS servers (RFC 7858).
+static constexpr U16 kTLSPort = 853;
+
+// Whether the queries go to the upstreams over TLS instead of UDP. Set with
+// the DNS_UPSTREAM environment variable ("udp" or "tls").
+//
+// This is opportunistic DNS-over-TLS only (RFC 7858, section 4.1).
+// `tls::Connection` doesn't check certificates, so the upstreams aren't
+// authenticated. The queries are hidden from passive observers, but anyone on
+// the path can impersonate the resolver.
+static bool ReadQueriesOverTLS() {
+  if (char *env = getenv("DNS_UPSTREAM")) {
+    StrView value = env;
+    if (value == "tls") {
+      LOG << "Warning: DNS_UPSTREAM=tls encrypts the upstream queries but "
+             "doesn't authenticate the upstream servers (their certificates "
+             "aren't checked).";
+      return true;
+    }
+    if (value == "udp") {
+      return false;
+    }
+    ERROR << "DNS_UPSTREAM should be \"udp\" or \"tls\". Got \"" << value
+          << "\". Ignoring it.";
+  }
+  return false;
+}
+
+static bool QueriesOverTLS() {
+  static const bool over_tls = ReadQueriesOverTLS();
+  return over_tls;
+}
+
+// Messages of the DNS streams (TCP & TLS) are prefixed with their length
+// (RFC 7766). Queries are pipelined & their answers are matched by ID, like
+// the UDP ones.
+static void SendFramed(Stream &stream, StrView message) {
+  Big<U16> length = message.size();
+  stream.outbox.Append(length);
+  stream.outbox.insert(stream.outbox.end(), message.begin(), message.end());
+  stream.Send();
+}
+
+static void ReceiveFramed(Stream &stream, IP upstream) {
+  Vec<> &inbox = stream.inbox;
+  Size offset = 0;
+  while (inbox.size() - offset >= 2) {
+    U16 length = ((Big<U16> *)(inbox.data() + offset))->Get();
+    if (inbox.size() - offset - 2 < length) {
+      break;
+    }
+    client.HandleResponse(StrView(inbox.data() + offset + 2, length), upstream,
+                          true);
+    offset += 2 + length;
+  }
+  inbox.erase(inbox.begin(), inbox.begin() + offset);
+}
+
+// TCP connection to an upstream server. Used when the UDP answers are
+// truncated.
+//
+// Connections stay open after the answer, so that the next large answer
+// doesn't wait for the handshake. Upstreams close them when they're idle & they
+// are reopened when needed.
+struct UpstreamTCP : tcp::Connection {
+  IP remote_ip;
+
+  UpstreamTCP(IP ip) : remote_ip(ip) {
+    Connect({.remote_ip = ip, .remote_port = kServerPort});
+  }
+
+  bool Broken() const { return IsClosed() || !OK(status); }
+
+  void NotifyReceived() override { ReceiveFramed(*this, remote_ip); }
+
+  const char *Name() const override { return "dns::UpstreamTCP"; }
+};
+
+// DNS-over-TLS connection to an upstream server (RFC 7858).
+//
+// Each upstream has one long-lived connection that carries all of its queries.
+// Queries sent during the handshake are queued by the TLS layer.
+struct UpstreamTLS : tls::Connection {
+  IP remote_ip;
+
+  UpstreamTLS(IP ip) : remote_ip(ip) {
+    Connect({tcp::Connection::Config{.remote_ip = ip, .remote_port = kTLSPort},
+             nullopt});
+    ++cache_stats.tls_connections;
+  }
+
+  bool Broken() const {
+    return tcp_connection.IsClosed() || !OK(tcp_connection.status);
+  }
+
+  void NotifyReceived() override { ReceiveFramed(*this, remote_ip); }
+};
+
+template <typename T>
+using ConnectionPool = unordered_map<IP, UniquePtr<T>>;
+
+static ConnectionPool<UpstreamTCP> tcp_connections;
+static ConnectionPool<UpstreamTLS> tls_connections;
+
+// Returns the open connection to the `upstream`, connecting if needed.
+//
+// Closed connections are only replaced here, never from their own callbacks.
+// Queries that were lost with them are retried like the lost UDP queries.
+template <typename T>
+static T &PooledConnection(ConnectionPool<T> &pool, IP upstream) {
+  auto &connection = pool[upstream];
+  if (connection == nullptr || connection->Broken()) {
+    connection.reset(new T(upstream));
+  }
+  return *connection;
+}
+
+static void SendQuery(const Question &question, Big<U16> id, Upstream &to) {
+  if (QueriesOverTLS()) {
+    SendFramed(PooledConnection(tls_connections, to.ip),
+               QueryMessage(question, id));
+  } else {
+    Str err;
+    client.fd.SendTo(to.ip, kServerPort, QueryMessage(question, id), err);
+  }
+  ++to.queries;
+}
+
+static void SendQueryOverTCP(const Question &question, Big<U16> id, IP to) {
+  SendFramed(PooledConnection(tcp_connections, to),
+             QueryMessage(question, id));
+}
+
+void PendingEntry::SendAttempt() {
+  auto now = chrono::steady_clock::now();
+  Upstream *upstream = PickUpstream(attempts, now);
+  if (upstream == nullptr) {
+    return;
+  }
+  SendQuery(question, id, *upstream);
+  attempts.push_back({.upstream = upstream->ip, .sent = now});
+  if (attempts.size() >= kMaxAttempts) {
+    return;
+  }
+  if (attempts.size() == 1) {
+    // Hedge - ask another upstream if this one is slower than usual.
+    retry_delay = max(upstream->P95(), kMinHedgeDelay);
+  } else {
+    retry_delay = max(2 * retry_delay, upstream->RTO());
+  }
+  retry = new Retry(this, retry_delay);
+}
+
+Retry::~Retry() {
+  if (entry) {
+    entry->retry = nullptr;
+    entry->SendAttempt();
+  }
+}
+
+static void StartRefresh(CachedEntry &entry) {
+  Status status;
+  StartClient(status);
+  if (!OK(status)) {
+    ERROR << "Couldn't refresh " << entry.question.ToStr() << ". " << status;
+    entry.refresh_failed = chrono::steady_clock::now();
+    return;
+  }
+  entry.refresh = new Refresh(entry);
+}
+
+Refresh::Refresh(CachedEntry &entry)
+    : Expirable(kPendingTTL), entry(entry), id(AllocateRequestId()),
+      sent(chrono::steady_clock::now()) {
+  WakeUpAt(*expiration);
+  requests[id] = &entry;
+  if (Upstream *to = PickUpstream({}, sent)) {
+    upstream = to->ip;
+    SendQuery(entry.question, id, *to);
+  }
+}
+
+Refresh::~Refresh() {
+  requests.erase(id);
+  entry.refresh = nullptr;
+  auto now = chrono::steady_clock::now();
+  entry.refresh_failed = now;
+  if (Upstream *to = FindUpstream(upstream);
+      to && !answered && now - sent >= to->RTO()) {
+    to->RecordTimeout(now);
+  }
+  for (auto *lookup : waiting) {
+    lookup->in_progress = nullptr;
+    StopClient();
+    ++cache_stats.stale_answers;
+    entry.Answer(*lookup, now);
+  }
+  StopClient();
+}
+
+void LookupBase::Start(StrView domain, U16 type) {
   CancelLookup(this);
-  Question question{.domain_name = domain, .type = (Type)type};
-  auto entry_it = Entry::cache.find(question);
+  auto entry_it =
+      Entry::cache.find(QuestionKey{.domain_name = domain, .type = (Type)type});
+  if (entry_it == Entry::cache.end() ||
+      (*entry_it)->kind == Entry::Kind::Pending) {
+    ++cache_stats.misses;
+  } else {
+    ++cache_stats.hits;
+  }
   if (entry_it == Entry::cache.end()) {
     // We don't have anything in the cache.
     // Send a new request to the upstream DNS server.
@@ -327,11 +1177,11 @@ void LookupBase::Start(Str domain, U16 type) {
       OnStartupFailure(status);
       return;
     }
-    in_progress = true;
 
     Big<U16> id = AllocateRequestId();
-    new PendingEntry(question, id, this);
-  } else if (PendingEntry *pending = dynamic_cast<PendingEntry *>(*entry_it)) {
+    new PendingEntry(Question{.domain_name = Str(domain), .type = (Type)type},
+                     id, this);
+  } else if ((*entry_it)->kind == Entry::Kind::Pending) {
     // We already have a pending request for this domain.
     // Add this to the waitlist.
 
@@ -342,72 +1192,59 @@ void LookupBase::Start(Str domain, U16 type) {
       OnStartupFailure(status);
       return;
     }
-    in_progress = true;
-
-    pending->in_progress.push_back(this);
-  } else if (CachedEntry *cached = dynamic_cast<CachedEntry *>(*entry_it)) {
+    PendingEntry *pending = static_cast<PendingEntry *>(*entry_it);
+    in_progress = pending;
+    pending->waiting.push_back(this);
+  } else {
     // We already have a cached entry for this domain.
+    CachedEntry *cached = static_cast<CachedEntry *>(*entry_it);
+    cached->Touch();
+    ++cached->hits;
+    auto now = chrono::steady_clock::now();
+    if (cached->Stale(now)) {
+      if (cached->ShouldRetry(now)) {
+        StartRefresh(*cached);
+      }
+      Refresh *refresh = cached->refresh;
+      if (refresh && now - refresh->sent < kStaleClientTimeout) {
+        // Wait a moment for the fresh data.
+        Status status;
+        StartClient(status);
+        if (OK(status)) {
+          in_progress = cached;
+          refresh->waiting.push_back(this);
+          refresh->UpdateExpiration(
+              min(*refresh->expiration, refresh->sent + kStaleClientTimeout));
+          WakeUpAt(*refresh->expiration);
+          return;
+        }
+      }
+      // Upstream server is slow or down.
+      ++cache_stats.stale_answers;
+    } else if (cached->ShouldPrefetch(now)) {
+      StartRefresh(*cached);
+      ++cache_stats.prefetches;
+    }
     // Call OnAnswer immediately.
-    in_progress = false;
-    Message msg = {.header =
-                       {
-                           .id = 0,
-                           .recursion_desired = true,
-                           .truncated = false,
-                           .authoritative = true,
-                           .opcode = Header::OperationCode::QUERY,
-                           .reply = true,
-                           .response_code = cached->response_code,
-                           .recursion_available = true,
-                           .question_count = 1,
-                           .answer_count = cached->answers.size(),
-                           .authority_count = cached->authority.size(),
-                           .additional_count = cached->additional.size(),
-                       },
-                   .questions = {question},
-                   .answers = cached->answers,
-                   .authority = cached->authority,
-                   .additional = cached->additional};
-    OnAnswer(msg);
+    in_progress = nullptr;
+    cached->Answer(*this, now);
   }
 }
 
 PendingEntry::PendingEntry(Question question, Big<U16> id, LookupBase *lookup)
-    : Entry(kPendingTTL, question), id(id), in_progress({lookup}) {
-  string buffer;
-  Header{.id = id, .recursion_desired = true, .question_count = 1}.write_to(
-      buffer);
-  question.write_to(buffer);
-  IP upstream_ip =
-      etc::resolv[(++server_i) % etc::resolv.size()]; // Round-robin
-  Str err;
-  client.fd.SendTo(upstream_ip, kServerPort, buffer, err);
+    : Entry(Kind::Pending, kPendingTTL, question), id(id), waiting({lookup}) {
+  WakeUpAt(*expiration);
+  requests[id] = this;
+  lookup->in_progress = this;
+  SendAttempt();
 }
 
-void Override(const Str &domain, IP ip) {
-  // Don't inject if we already have an entry for this domain.
-  if (Entry::cache.find(Question{.domain_name = domain}) !=
-      Entry::cache.end()) {
+void Cache(Message &response) {
+  if (response.questions.size() != 1 ||
+      Entry::cache.find(response.questions.front()) != Entry::cache.end()) {
     return;
   }
-  Str encoded_domain = EncodeDomainName(domain);
-  Message dummy_msg = {
-      .header = {.id = 0,
-                 .recursion_desired = true,
-                 .truncated = false,
-                 .authoritative = true,
-                 .opcode = Header::OperationCode::QUERY,
-                 .reply = true,
-                 .response_code = ResponseCode::NO_ERROR,
-                 .recursion_available = true,
-                 .question_count = 1,
-                 .answer_count = 1},
-      .questions = {Question{.domain_name = domain}},
-      .answers = {Record{Question{.domain_name = domain},
-                         std::chrono::steady_clock::time_point::max(),
-                         (U16)sizeof(ip.addr),
-                         string((char *)&ip.addr, sizeof(ip.addr))}}};
-  new CachedEntry(dummy_msg);
+  Evict(new CachedEntry(response));
 }
 
 void StartClient(Status &status) {
@@ -429,11 +1266,33 @@ void StopClient() {
   }
 }
 
-const Str *LocalReverseLookup(IP ip) {
+bool CopyFreshResponse(const QuestionKey &question, Str &out) {
+  shared_lock lock(shared_cache_mutex);
+  auto it = shared_cache.find(question);
+  if (it == shared_cache.end()) {
+    return false;
+  }
+  CachedEntry *cached = static_cast<CachedEntry *>(*it);
+  auto now = chrono::steady_clock::now();
+  if (cached->Stale(now) || cached->PrefetchDue(now)) {
+    return false;
+  }
+  cached->hits.fetch_add(1, memory_order_relaxed);
+  cached->used_by_server_threads.store(true, memory_order_relaxed);
+  cache_stats.hits.fetch_add(1, memory_order_relaxed);
+  out = cached->wire;
+  cached->WriteTTLs(out.data(), now);
+  return true;
+}
+
+Optional<Str> LocalReverseLookup(IP ip) {
+  if (auto name = LocalHostName(ip)) {
+    return name;
+  }
   if (auto it = cache_reverse.find(ip); it != cache_reverse.end()) {
-    return &(*it)->domain_name;
+    return (*it)->domain_name;
   }
-  return nullptr;
+  return nullopt;
 }
 
 } // namespace maf::dns
\ No newline at end of file
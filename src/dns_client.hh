@@ -6,6 +6,7 @@
 #include "ip.hh"
 #include "status.hh"
 #include "str.hh"
+#include <atomic>
 #include <chrono>
 #include <unordered_set>
 
@@ -13,22 +14,27 @@ namespace maf::dns {
 
 // TODO: try to merge this with CachedEntry
 struct Message;
+struct Entry;
 
 // Abstract base class for DNS lookups.
 struct LookupBase {
-  bool in_progress;
+  // Entry whose answer this lookup is waiting for. Null when the lookup isn't
+  // in progress.
+  Entry *in_progress;
   LookupBase();
   virtual ~LookupBase();
 
   // Call this at the end of the constructor. This will start the lookup.
   // Eventually either `OnAnswer` or `OnExpired` will be called.
-  void Start(Str domain, U16 type);
+  void Start(StrView domain, U16 type);
 
   // Called if the DNS client cannot be started.
   virtual void OnStartupFailure(Status &) = 0;
 
-  // Called when we receive a DNS response. Receives the full DNS response.
-  virtual void OnAnswer(const Message &) = 0;
+  // Called when we receive a DNS response. Receives the full DNS response,
+  // parsed & in the wire format. TTLs in `wire` are up to date but its ID
+  // should be replaced before sending it anywhere.
+  virtual void OnAnswer(const Message &, StrView wire) = 0;
 
   // Called when the lookup expires.
   virtual void OnExpired() = 0;
@@ -42,27 +48,109 @@ struct LookupIPv4 : LookupBase {
   void Start(Str domain);
 
   void OnStartupFailure(Status &) override;
-  void OnAnswer(const Message &) override;
+  void OnAnswer(const Message &, StrView wire) override;
   void OnExpired() override;
 };
 
-const Str *LocalReverseLookup(IP ip);
-void Override(const Str &domain, IP ip);
+// Name of the `ip` for the web UI. LAN hosts get their name from the local
+// zone. Other addresses get the domain of a cached A record.
+Optional<Str> LocalReverseLookup(IP ip);
+
+// Adds the `response` to the cache, unless its question is already there.
+void Cache(Message &response);
+
+// The cache is limited to `DNS_CACHE_SIZE` bytes (4 MiB by default). Least
+// recently used responses are evicted first.
+struct CacheStats {
+  Size size = 0;   // approximate number of bytes used by the cached responses
+  Size budget = 0; // known after the first response is cached
+  std::atomic<U64> hits = 0; // also counted by the DNS server threads
+  U64 misses = 0;
+  U64 evictions = 0;
+  U64 prefetches = 0;
+  U64 stale_answers = 0;
+  U64 tcp_fallbacks = 0; // truncated UDP answers repeated over TCP
+  U64 tls_connections = 0; // DNS-over-TLS connections opened
+};
+
+extern CacheStats cache_stats;
+
+// Copies the cached response for the `question` to `out`, with its TTLs up to
+// date & ID 0. Can be called from any thread.
+//
+// Returns false if the response isn't cached or should be refreshed soon. Such
+// questions should be asked through `LookupBase` on the main thread.
+bool CopyFreshResponse(const QuestionKey &question, Str &out);
+
+// Upstream DNS server (from `etc::resolv`) with its latency & loss statistics.
+//
+// Queries go to the fastest healthy upstream. If it doesn't answer within its
+// p95 RTT, the query is repeated to another upstream, and then retried with
+// exponential backoff. Upstreams that time out are skipped for a while.
+//
+// Queries are sent over UDP, unless DNS_UPSTREAM is "tls". Then each upstream
+// gets a persistent DNS-over-TLS connection (port 853) that carries all of its
+// queries.
+struct Upstream {
+  static constexpr int kRTTBuckets = 14;
+
+  IP ip;
+  // Smoothed RTT & its variation (RFC 6298). Zero until the first answer.
+  std::chrono::steady_clock::duration srtt = {};
+  std::chrono::steady_clock::duration rttvar = {};
+  // Exponentially weighted moving average of the fraction of lost queries.
+  double loss = 0;
+  U64 queries = 0;
+  U64 answers = 0;
+  U64 timeouts = 0;
+  // Number of answers that arrived within 1 ms, 2 ms, 4 ms, ... The last
+  // bucket counts the slower answers.
+  U32 histogram[kRTTBuckets] = {};
+  // Consecutive timeouts. Failing upstreams are skipped until `backoff_until`.
+  U32 failures = 0;
+  std::chrono::steady_clock::time_point backoff_until = {};
+
+  // Time after which a query is considered lost.
+  std::chrono::steady_clock::duration RTO() const;
+  // RTT within which 95% of the answers arrived. Falls back to `RTO` until
+  // there are enough answers.
+  std::chrono::steady_clock::duration P95() const;
+  bool Healthy(std::chrono::steady_clock::time_point now) const;
+  void RecordAnswer(std::chrono::steady_clock::duration rtt);
+  void RecordTimeout(std::chrono::steady_clock::time_point now);
+};
+
+// Returns the upstreams, updated to match `etc::resolv`.
+const Vec<Upstream> &Upstreams();
 
 void StartClient(Status &);
 void StopClient();
 
 struct Entry : Expirable {
+  // Allows the client to tell the entries apart without `dynamic_cast`.
+  enum class Kind : U8 {
+    Pending, // waiting for the upstream server
+    Cached,  // answer (or override) that can be used right away
+  };
+
+  const Kind kind;
   Question question;
-  Entry(std::chrono::steady_clock::duration ttl, const Question &question)
-      : Expirable(ttl), question(question) {
+  Entry(Kind kind, std::chrono::steady_clock::duration ttl,
+        const Question &question)
+      : Expirable(ttl), kind(kind), question(question) {
     cache.insert(this);
   }
-  Entry(const Question &question) : Expirable(), question(question) {
+  Entry(Kind kind, const Question &question)
+      : Expirable(), kind(kind), question(question) {
     cache.insert(this);
   }
   virtual ~Entry() { cache.erase(cache.find(this)); }
 
+  // Time until which the entry can be used without asking the upstream server.
+  virtual Optional<std::chrono::steady_clock::time_point> FreshUntil() const {
+    return expiration;
+  }
+
   struct QuestionHash {
     using is_transparent = std::true_type;
 
@@ -70,6 +158,10 @@ struct Entry : Expirable {
       return std::hash<Str>()(q.domain_name) ^ std::hash<Type>()(q.type) ^
              std::hash<Class>()(q.class_);
     }
+    size_t operator()(const QuestionKey &q) const {
+      return std::hash<StrView>()(q.domain_name) ^ std::hash<Type>()(q.type) ^
+             std::hash<Class>()(q.class_);
+    }
     size_t operator()(const Entry *e) const { return (*this)(e->question); }
   };
 
@@ -82,6 +174,10 @@ struct Entry : Expirable {
     bool operator()(const Question &a, const Entry *b) const {
       return a == b->question;
     }
+    bool operator()(const QuestionKey &a, const Entry *b) const {
+      return a.domain_name == b->question.domain_name &&
+             a.type == b->question.type && a.class_ == b->question.class_;
+    }
   };
 
   static std::unordered_set<Entry *, QuestionHash, QuestionEqual> cache;
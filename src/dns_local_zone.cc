@@ -0,0 +1,305 @@
+#include "dns_local_zone.hh"
+
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "config.hh"
+#include "etc.hh"
+#include "format.hh"
+
+namespace maf::dns {
+
+using namespace std;
+
+static constexpr StrView kReverseSuffix = ".in-addr.arpa";
+
+// Timers of the SOA record, in seconds. The zone isn't transferred, so only
+// the minimum (used as the TTL of the negative answers) matters.
+static constexpr U32 kRefresh = 3600;
+static constexpr U32 kRetry = 600;
+static constexpr U32 kExpire = 86400;
+
+struct LocalHost {
+  IP ip;
+  bool is_static;
+};
+
+struct NameHash {
+  using is_transparent = true_type;
+  size_t operator()(StrView name) const { return hash<StrView>()(name); }
+};
+
+static shared_mutex zone_mutex;
+// Hosts by their lowercase name (without the local domain). Guarded by
+// `zone_mutex`.
+static unordered_map<Str, LocalHost, NameHash, equal_to<>> hosts;
+// Names used for the reverse lookups. Guarded by `zone_mutex`.
+static unordered_map<IP, Str> ptr_names;
+// Incremented on every change of the zone.
+static atomic<U32> serial = 1;
+
+LocalZoneStats local_zone_stats;
+
+static char Lower(char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+// Lowercases the `name` & checks that it's a valid domain name once the local
+// domain is appended.
+static bool NormalizeName(StrView name, Str &key) {
+  if (name.empty() ||
+      name.size() + 1 + kLocalDomain.size() > kMaxDomainNameLength) {
+    return false;
+  }
+  key.clear();
+  Size label_size = 0;
+  for (char c : name) {
+    c = Lower(c);
+    if (c == '.') {
+      if (label_size == 0) {
+        return false;
+      }
+      label_size = 0;
+    } else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' ||
+               c == '_') {
+      if (++label_size > 63) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+    key += c;
+  }
+  return label_size > 0;
+}
+
+// Called with `zone_mutex` locked.
+static void ErasePtrName(IP ip, StrView name) {
+  auto it = ptr_names.find(ip);
+  if (it == ptr_names.end() || it->second != name) {
+    return;
+  }
+  ptr_names.erase(it);
+  // Fall back to another name of the same host.
+  for (auto &[other_name, host] : hosts) {
+    if (host.ip == ip && other_name != name) {
+      auto &ptr_name = ptr_names[ip];
+      if (ptr_name.empty() || host.is_static) {
+        ptr_name = other_name;
+      }
+    }
+  }
+}
+
+static void Insert(StrView name, IP ip, bool is_static) {
+  Str key;
+  if (!NormalizeName(name, key)) {
+    return;
+  }
+  lock_guard lock(zone_mutex);
+  auto [it, inserted] = hosts.try_emplace(key, LocalHost{ip, is_static});
+  if (!inserted) {
+    LocalHost &host = it->second;
+    if (host.is_static && !is_static) {
+      return;
+    }
+    if (host.ip == ip && host.is_static == is_static) {
+      return;
+    }
+    if (host.ip != ip) {
+      IP old_ip = host.ip;
+      host.ip = ip;
+      ErasePtrName(old_ip, key);
+    }
+    host.is_static = is_static;
+  }
+  // Reverse lookups return the first name of the host. Static names take
+  // precedence.
+  auto [ptr_it, ptr_inserted] = ptr_names.try_emplace(ip, key);
+  if (!ptr_inserted && is_static && !hosts.find(ptr_it->second)->second.is_static) {
+    ptr_it->second = key;
+  }
+  ++serial;
+}
+
+void AddStaticHost(StrView name, IP ip) { Insert(name, ip, true); }
+
+void AddLeaseHost(StrView name, IP ip) { Insert(name, ip, false); }
+
+void RemoveLeaseHost(StrView name, IP ip) {
+  Str key;
+  if (!NormalizeName(name, key)) {
+    return;
+  }
+  lock_guard lock(zone_mutex);
+  auto it = hosts.find(key);
+  if (it == hosts.end() || it->second.is_static || it->second.ip != ip) {
+    return;
+  }
+  hosts.erase(it);
+  ErasePtrName(ip, key);
+  ++serial;
+}
+
+Optional<Str> LocalHostName(IP ip) {
+  shared_lock lock(zone_mutex);
+  if (auto it = ptr_names.find(ip); it != ptr_names.end()) {
+    return it->second + "." + kLocalDomain;
+  }
+  return nullopt;
+}
+
+// Parses "4.3.2.1.in-addr.arpa".
+static bool ParseReverseName(StrView name, IP &ip) {
+  if (!name.ends_with(kReverseSuffix)) {
+    return false;
+  }
+  name.remove_suffix(kReverseSuffix.size());
+  for (int i = 3; i >= 0; --i) {
+    Size dot = name.find('.');
+    StrView octet = name.substr(0, dot);
+    if (octet.empty() || octet.size() > 3) {
+      return false;
+    }
+    U32 value = 0;
+    for (char c : octet) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      value = value * 10 + (c - '0');
+    }
+    if (value > 255) {
+      return false;
+    }
+    ip.bytes[i] = value;
+    if ((dot == StrView::npos) != (i == 0)) {
+      return false;
+    }
+    name.remove_prefix(dot == StrView::npos ? name.size() : dot + 1);
+  }
+  return true;
+}
+
+// Name of the reverse zone that covers the LAN network, for example
+// "1.168.192.in-addr.arpa".
+static Str ReverseZone() {
+  Str zone;
+  for (int i = lan_network.Ones() / 8 - 1; i >= 0; --i) {
+    zone += f("%hhu.", lan_network.ip.bytes[i]);
+  }
+  return zone += kReverseSuffix.substr(1);
+}
+
+template <typename T> static void AppendBig(Str &out, T value) {
+  Big<T> big = value;
+  out.append((const char *)&big, sizeof(big));
+}
+
+// Appends the fixed part of a resource record. Its name should be appended
+// before.
+static void AppendRecordHeader(Str &out, Type type, U16 data_length) {
+  AppendBig<U16>(out, (U16)type);
+  AppendBig<U16>(out, (U16)Class::IN);
+  AppendBig<U32>(out, (U32)(kAuthoritativeTTL / 1s));
+  AppendBig<U16>(out, data_length);
+}
+
+void AppendLocalSOA(Str &out, StrView owner) {
+  Str data = EncodeDomainName(etc::hostname + "." + kLocalDomain);
+  data += EncodeDomainName("hostmaster." + kLocalDomain);
+  AppendBig<U32>(data, serial.load(memory_order_relaxed));
+  AppendBig<U32>(data, kRefresh);
+  AppendBig<U32>(data, kRetry);
+  AppendBig<U32>(data, kExpire);
+  AppendBig<U32>(data, (U32)(kAuthoritativeTTL / 1s));
+  out += owner;
+  AppendRecordHeader(out, Type::SOA, data.size());
+  out += data;
+}
+
+bool AnswerLocal(const MessageView &query, const QuestionView &question,
+                 StrView domain, Str &response) {
+  DomainNameBuffer buffer;
+  Size size = min(domain.size(), sizeof(buffer));
+  for (Size i = 0; i < size; ++i) {
+    buffer[i] = Lower(domain[i]);
+  }
+  StrView name(buffer, size);
+  if (name.ends_with('.')) {
+    name.remove_suffix(1);
+  }
+
+  bool any = question.type == Type::ANY;
+  Str zone;
+  bool exists = false;
+  // Whether the answer is the SOA record of the `zone`.
+  bool soa_answer = false;
+  // Data of the answer. Empty when the name has no records of this type.
+  Str data;
+  Type data_type = question.type;
+  IP ip;
+  if (name.ends_with(kLocalDomain) &&
+      (name.size() == kLocalDomain.size() ||
+       name[name.size() - kLocalDomain.size() - 1] == '.')) {
+    zone = kLocalDomain;
+    if (name.size() == kLocalDomain.size()) {
+      exists = true;
+      soa_answer = question.type == Type::SOA || any;
+    } else {
+      StrView key = name.substr(0, name.size() - kLocalDomain.size() - 1);
+      shared_lock lock(zone_mutex);
+      if (auto it = hosts.find(key); it != hosts.end()) {
+        exists = true;
+        if (question.type == Type::A || any) {
+          data_type = Type::A;
+          data.assign((const char *)&it->second.ip.addr, 4);
+        }
+      }
+    }
+  } else if (ParseReverseName(name, ip) && lan_network.Contains(ip)) {
+    zone = ReverseZone();
+    shared_lock lock(zone_mutex);
+    if (auto it = ptr_names.find(ip); it != ptr_names.end()) {
+      exists = true;
+      if (question.type == Type::PTR || any) {
+        data_type = Type::PTR;
+        data = EncodeDomainName(it->second + "." + kLocalDomain);
+      }
+    }
+  } else {
+    return false;
+  }
+
+  bool answered = soa_answer || !data.empty();
+  Header header = {
+      .id = query.header.id,
+      .recursion_desired = query.header.recursion_desired,
+      .truncated = false,
+      .authoritative = true,
+      .opcode = Header::OperationCode::QUERY,
+      .reply = true,
+      .response_code =
+          exists ? ResponseCode::NO_ERROR : ResponseCode::NAME_ERROR,
+      .reserved = 0,
+      .recursion_available = true,
+      .question_count = 1,
+      .answer_count = answered ? 1 : 0,
+      .authority_count = answered ? 0 : 1,
+      .additional_count = 0,
+  };
+  response.assign((const char *)&header, sizeof(header));
+  response += query.buffer.substr(sizeof(Header),
+                                  query.answers_offset - sizeof(Header));
+  if (!data.empty()) {
+    AppendBig<U16>(response, 0xc000 | sizeof(Header)); // pointer to the question
+    AppendRecordHeader(response, data_type, data.size());
+    response += data;
+  } else {
+    // Negative answers carry the SOA in the authority section, so that they
+    // can be cached (RFC 2308).
+    AppendLocalSOA(response, EncodeDomainName(zone));
+  }
+  local_zone_stats.answers.fetch_add(1, memory_order_relaxed);
+  return true;
+}
+
+} // namespace maf::dns
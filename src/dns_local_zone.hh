@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+
+#include "dns_utils.hh"
+#include "int.hh"
+#include "ip.hh"
+#include "optional.hh"
+#include "str.hh"
+
+// Authoritative zone of the local network.
+//
+// Holds the names of the LAN hosts ("<host>.lan") & answers their A, PTR &
+// negative queries without asking the upstream servers. Names come from
+// /etc/hosts & from the DHCP server, which updates the zone whenever a client
+// gets a new address or hostname. Reverse lookups are answered for the
+// addresses of the LAN network.
+namespace maf::dns {
+
+// Adds a name from /etc/hosts (without the local domain). Static names are
+// never removed & take precedence over the DHCP hostnames.
+void AddStaticHost(StrView name, IP ip);
+
+// Adds the hostname of a DHCP client. Hostnames that aren't valid domain names
+// are ignored.
+void AddLeaseHost(StrView name, IP ip);
+
+// Removes the hostname of a DHCP client, unless it points to another address
+// or is also a static name.
+void RemoveLeaseHost(StrView name, IP ip);
+
+// Name of a LAN host ("<host>.lan"), as returned by its reverse lookup.
+Optional<Str> LocalHostName(IP ip);
+
+// Builds the answer to the `query` if its `domain` belongs to the local zone.
+// Returns false (leaving `response` unchanged) for other domains.
+//
+// Can be called from any thread.
+bool AnswerLocal(const MessageView &query, const QuestionView &question,
+                 StrView domain, Str &response);
+
+// Appends an SOA record of Gatekeeper ("<hostname>.lan"). Its TTL & minimum
+// are `kAuthoritativeTTL`. The `owner` is an encoded domain name (or a
+// compression pointer).
+void AppendLocalSOA(Str &out, StrView owner);
+
+struct LocalZoneStats {
+  std::atomic<U64> answers = 0;
+};
+
+extern LocalZoneStats local_zone_stats;
+
+} // namespace maf::dns
@@ -0,0 +1,101 @@
+// Benchmark of the DNS message parsers.
+//
+// Parses captured DNS packets the way the DNS server & client do on their hot
+// paths. Compares the in-place `MessageView` against the owning `Message`. Run
+// with `./run dns_parse_bench`.
+
+#pragma maf main
+
+#include <chrono>
+#include <cstdlib>
+
+#include "dns_utils.hh"
+#include "format.hh"
+#include "log.hh"
+
+using namespace maf;
+using namespace maf::dns;
+
+static constexpr Size kIterations = 1'000'000;
+
+// Counts the allocations made while parsing.
+static U64 allocations = 0;
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  if (void *ptr = malloc(size)) {
+    return ptr;
+  }
+  abort();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { free(ptr); }
+
+// Query for "www.google.com" A, with an EDNS0 OPT record.
+static constexpr char kQuery[] =
+    "\x1a\x2b\x01\x00\x00\x01\x00\x00\x00\x00\x00\x01\x03\x77\x77\x77\x06\x67"
+    "\x6f\x6f\x67\x6c\x65\x03\x63\x6f\x6d\x00\x00\x01\x00\x01\x00\x00\x29\x04"
+    "\xd0\x00\x00\x00\x00\x00\x00";
+
+// Response for "www.youtube.com" A - a compressed CNAME followed by four A
+// records & an EDNS0 OPT record.
+static constexpr char kResponse[] =
+    "\x3c\x4d\x81\x80\x00\x01\x00\x05\x00\x00\x00\x01\x03\x77\x77\x77\x07\x79"
+    "\x6f\x75\x74\x75\x62\x65\x03\x63\x6f\x6d\x00\x00\x01\x00\x01\xc0\x0c\x00"
+    "\x05\x00\x01\x00\x00\x01\x2c\x00\x16\x0a\x79\x6f\x75\x74\x75\x62\x65\x2d"
+    "\x75\x69\x01\x6c\x06\x67\x6f\x6f\x67\x6c\x65\xc0\x18\xc0\x2d\x00\x01\x00"
+    "\x01\x00\x00\x01\x2c\x00\x04\x8e\xfa\xba\x0e\xc0\x2d\x00\x01\x00\x01\x00"
+    "\x00\x01\x2c\x00\x04\x8e\xfa\xba\x2e\xc0\x2d\x00\x01\x00\x01\x00\x00\x01"
+    "\x2c\x00\x04\x8e\xfa\xba\x4e\xc0\x2d\x00\x01\x00\x01\x00\x00\x01\x2c\x00"
+    "\x04\x8e\xfa\xba\x6e\x00\x00\x29\x04\xd0\x00\x00\x00\x00\x00\x00";
+
+static U64 sink = 0;
+
+// Parses the packet & reads its question, like `HandleRequest` does.
+static void ParseMessage(StrView packet) {
+  Message msg;
+  Str err;
+  msg.Parse(packet.data(), packet.size(), err);
+  if (!err.empty() || msg.questions.size() != 1) {
+    abort();
+  }
+  sink += msg.questions.front().domain_name.size() + msg.answers.size();
+}
+
+static void ParseMessageView(StrView packet) {
+  MessageView msg;
+  Str err;
+  msg.Parse(packet, err);
+  if (!err.empty() || msg.header.question_count != 1) {
+    abort();
+  }
+  DomainNameBuffer name_buffer;
+  StrView domain_name =
+      msg.LoadName(msg.FirstQuestion().name_offset, name_buffer);
+  sink += domain_name.size() + msg.header.answer_count;
+}
+
+static void Report(const char *name, StrView packet, void (*parse)(StrView)) {
+  U64 allocations_before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (Size i = 0; i < kIterations; ++i) {
+    parse(packet);
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  LOG << f("%-22s %6.0f ns/message, %5.1f allocations/message", name,
+           elapsed.count() * 1e9 / kIterations,
+           (double)(allocations - allocations_before) / kIterations);
+}
+
+int main() {
+  StrView query(kQuery, sizeof(kQuery) - 1);
+  StrView response(kResponse, sizeof(kResponse) - 1);
+  Report("query / Message", query, ParseMessage);
+  Report("query / MessageView", query, ParseMessageView);
+  Report("response / Message", response, ParseMessage);
+  Report("response / MessageView", response, ParseMessageView);
+  LOG << "(checksum " << sink << ")";
+  return 0;
+}
@@ -1,42 +1,132 @@
 #include "dns_server.hh"
 
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <cstring>
+#include <thread>
+
 #include "config.hh"
+#include "dns_blocklist.hh"
 #include "dns_client.hh"
+#include "dns_local_zone.hh"
 #include "dns_utils.hh"
 #include "epoll_udp.hh"
 #include "expirable.hh"
+#include "format.hh"
 #include "log.hh"
+#include "optional.hh"
+#include "spsc_ring.hh"
+#include "split.hh"
 #include "status.hh"
+#include "timer.hh"
+#include "unique_ptr.hh"
+#include "vec.hh"
+#include "virtual_fs.hh"
 
 using namespace std;
 using namespace maf;
 
 namespace maf::dns {
 
+// Number of threads that serve the DNS queries. When zero, the queries are
+// served by the main thread.
+//
+// Can be set with the DNS_THREADS environment variable. Server threads answer
+// the fresh cache hits on their own, so that a storm of queries (for example
+// when all of the devices reconnect after a power cut) doesn't starve the
+// other services of the main thread. Other queries are passed to the main
+// thread, which asks the upstream servers.
+static int thread_count = 0;
+static constexpr int kMaxThreads = 64;
+
+// How the server answers the AAAA queries. Can be set with the DNS_AAAA
+// environment variable ("auto", "proxy" or "nodata").
+//
+// Gatekeeper's NAT is IPv4-only, yet clients ask for AAAA alongside every A
+// query. When the WAN has no IPv6 route, the AAAA answers are useless & asking
+// the upstream servers for them only doubles the upstream traffic. "auto"
+// answers them with NODATA while there is no IPv6 default route.
+enum class AAAAPolicy { Auto, Proxy, NoData };
+static AAAAPolicy aaaa_policy = AAAAPolicy::Auto;
+
+// Whether HTTPS (type 65) queries are answered with NODATA. Can be enabled by
+// setting the DNS_HTTPS environment variable to "nodata".
+//
+// HTTPS records advertise HTTP/3 & Encrypted Client Hello. Without them
+// browsers still connect, but discover HTTP/3 only through Alt-Svc.
+static bool https_nodata = false;
+
+// Period (in seconds) of the checks of the IPv6 default route.
+static constexpr double kRouteCheckInterval = 60;
+static std::atomic<bool> wan_has_ipv6 = true;
+static Optional<Timer> route_timer;
+
+NoDataStats nodata_stats;
+
+// EDNS parameters of a query (RFC 6891).
+struct EDNS {
+  // Whether the query had an OPT record. Its response gets one too.
+  bool present = false;
+  // Largest response that the client can receive over UDP.
+  U16 udp_payload_size = kMaxUDPSize;
+};
+
+static EDNS ReadEDNS(const MessageView &msg) {
+  EDNS edns;
+  msg.ForEachRecord([&](const RecordView &r) {
+    if (r.type == Type::OPT) {
+      edns.present = true;
+      // The class of the OPT record holds the payload size.
+      edns.udp_payload_size =
+          clamp<U16>((U16)r.class_, kMaxUDPSize,
+                     epoll::UDPListener::kMaxDatagramSize);
+    }
+  });
+  return edns;
+}
+
+// Fits the `response` into the client's UDP payload size & adds an OPT record
+// if the client used EDNS.
+static void FinishResponse(Str &response, const EDNS &edns) {
+  if (!edns.present) {
+    TruncateResponse(response, edns.udp_payload_size);
+    return;
+  }
+  TruncateResponse(response, edns.udp_payload_size - kOPTSize);
+  Header &header = *(Header *)response.data();
+  header.additional_count = header.additional_count.Get() + 1;
+  AppendOPT(response, epoll::UDPListener::kMaxDatagramSize);
+}
+
+struct Server;
+
 struct ProxyLookup : LookupBase {
+  // Server that received the query. The answer is sent through its socket.
+  Server &server;
   IP client_ip;
   U16 client_port;
   Header header;
-  ProxyLookup(IP client_ip, U16 client_port, Message &msg)
-      : client_ip(client_ip), client_port(client_port), header(msg.header) {
-    Start(msg.questions.front().domain_name, (U16)msg.questions.front().type);
+  EDNS edns;
+  ProxyLookup(Server &server, IP client_ip, U16 client_port,
+              const Header &header, const EDNS &edns, StrView domain, Type type)
+      : server(server), client_ip(client_ip), client_port(client_port),
+        header(header), edns(edns) {
+    Start(domain, (U16)type);
   }
 
   void OnStartupFailure(Status &) override { delete this; }
-  void OnAnswer(const Message &msg) override;
+  void OnAnswer(const Message &msg, StrView wire) override;
   void OnExpired() override { delete this; }
 };
 
 struct Server : epoll::UDPListener {
 
-  // Start listening.
-  //
-  // To actually accept new connections, make sure to Poll the `epoll`
-  // instance after listening.
-  void Listen(Status &status) {
+  // Open the socket, without adding it to `epoll`.
+  void Open(Status &status) {
     fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd == -1) {
       AppendErrorMessage(status) += "socket";
@@ -47,24 +137,46 @@ struct Server : epoll::UDPListener {
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(flag)) <
         0) {
       AppendErrorMessage(status) += "setsockopt: SO_REUSEADDR";
-      StopListening();
+      fd.Close();
+      return;
+    }
+
+    // Each server thread has its own socket. The kernel spreads the queries
+    // between them.
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&flag, sizeof(flag)) <
+        0) {
+      AppendErrorMessage(status) += "setsockopt: SO_REUSEPORT";
+      fd.Close();
       return;
     }
 
     if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, lan.name.data(),
                    lan.name.size()) < 0) {
       AppendErrorMessage(status) += "Error when setsockopt bind to device";
-      StopListening();
+      fd.Close();
       return;
     };
 
     fd.Bind(INADDR_ANY, kServerPort, status);
     if (!OK(status)) {
-      StopListening();
+      fd.Close();
       return;
     }
+  }
 
+  // Start listening.
+  //
+  // To actually accept new connections, make sure to Poll the `epoll`
+  // instance after listening.
+  void Listen(Status &status) {
+    Open(status);
+    if (!OK(status)) {
+      return;
+    }
     epoll::Add(this, status);
+    if (!OK(status)) {
+      StopListening();
+    }
   }
 
   // Stop listening.
@@ -75,7 +187,7 @@ struct Server : epoll::UDPListener {
     close(fd);
   }
 
-  Header ResponseHeader(const Message &msg) {
+  Header ResponseHeader(const MessageView &msg) {
     return Header{
         .id = msg.header.id,
         .recursion_desired = msg.header.recursion_desired,
@@ -93,12 +205,12 @@ struct Server : epoll::UDPListener {
     };
   }
 
-  void SendError(ResponseCode code, const Message &msg, IP client_ip,
-                 U16 client_port, string &err) {
+  void SendError(ResponseCode code, const MessageView &msg, IP client_ip,
+                 U16 client_port) {
     Header response = ResponseHeader(msg);
     response.response_code = code;
-    fd.SendTo(client_ip, client_port,
-              StrView((const char *)(&response), sizeof(response)), err);
+    Reply(client_ip, client_port,
+          StrView((const char *)(&response), sizeof(response)));
   }
 
   void HandleRequest(string_view buf, IP source_ip, U16 source_port) override {
@@ -107,11 +219,11 @@ struct Server : epoll::UDPListener {
           << ToStr(source_ip) << " (expected network " << lan_network << ")";
       return;
     }
-    Message msg;
+    MessageView msg;
     string err;
-    msg.Parse(buf.data(), buf.size(), err);
+    msg.Parse(buf, err);
     if (!err.empty()) {
-      SendError(ResponseCode::FORMAT_ERROR, msg, source_ip, source_port, err);
+      SendError(ResponseCode::FORMAT_ERROR, msg, source_ip, source_port);
       return;
     }
 
@@ -120,8 +232,7 @@ struct Server : epoll::UDPListener {
       // "google.com" with opcode=STATUS & ID=0x0002.
       //
       // Maybe it's some kind of a connectivity probe?
-      SendError(ResponseCode::NOT_IMPLEMENTED, msg, source_ip, source_port,
-                err);
+      SendError(ResponseCode::NOT_IMPLEMENTED, msg, source_ip, source_port);
       return;
     }
 
@@ -131,8 +242,7 @@ struct Server : epoll::UDPListener {
       // Google IP address).
       //
       // IQUERY requests were obsoleted by RFC 3425.
-      SendError(ResponseCode::NOT_IMPLEMENTED, msg, source_ip, source_port,
-                err);
+      SendError(ResponseCode::NOT_IMPLEMENTED, msg, source_ip, source_port);
       return;
     }
 
@@ -140,21 +250,105 @@ struct Server : epoll::UDPListener {
       LOG << "DNS server received a packet with an unsupported opcode: "
           << ToStr(msg.header.opcode) << ". Source: " << source_ip
           << ". DNS message: " << msg.ToStr();
-      SendError(ResponseCode::NOT_IMPLEMENTED, msg, source_ip, source_port,
-                err);
+      SendError(ResponseCode::NOT_IMPLEMENTED, msg, source_ip, source_port);
       return;
     }
 
-    if (msg.questions.size() != 1) {
+    if (msg.header.question_count != 1) {
       LOG << "DNS server expected a packet with exactly one question. "
              "Received: "
           << msg.ToStr();
-      SendError(ResponseCode::NOT_IMPLEMENTED, msg, source_ip, source_port,
-                err);
+      SendError(ResponseCode::NOT_IMPLEMENTED, msg, source_ip, source_port);
+      return;
+    }
+
+    QuestionView question = msg.FirstQuestion();
+    DomainNameBuffer name_buffer;
+    StrView domain = msg.LoadName(question.name_offset, name_buffer);
+    EDNS edns = ReadEDNS(msg);
+    Str local_answer;
+    if (AnswerLocal(msg, question, domain, local_answer)) {
+      FinishResponse(local_answer, edns);
+      Reply(source_ip, source_port, local_answer);
       return;
     }
+    if (IsBlocked(domain)) {
+      SendBlocked(msg, question, edns, source_ip, source_port);
+      return;
+    }
+    if (question.type == Type::AAAA &&
+        (aaaa_policy == AAAAPolicy::NoData ||
+         (aaaa_policy == AAAAPolicy::Auto &&
+          !wan_has_ipv6.load(std::memory_order_relaxed)))) {
+      nodata_stats.aaaa.fetch_add(1, std::memory_order_relaxed);
+      SendNoData(msg, edns, source_ip, source_port);
+      return;
+    }
+    if (question.type == Type::HTTPS && https_nodata) {
+      nodata_stats.https.fetch_add(1, std::memory_order_relaxed);
+      SendNoData(msg, edns, source_ip, source_port);
+      return;
+    }
+    Resolve(msg.header, edns, domain, question.type, source_ip, source_port);
+  }
+
+  // Answers that the domain has no records of the queried type. The SOA in the
+  // authority section lets the clients cache the answer (RFC 2308).
+  void SendNoData(const MessageView &msg, const EDNS &edns, IP client_ip,
+                  U16 client_port) {
+    Header header = ResponseHeader(msg);
+    header.question_count = 1;
+    header.authority_count = 1;
+    Str response((const char *)&header, sizeof(header));
+    response += msg.buffer.substr(sizeof(Header),
+                                  msg.answers_offset - sizeof(Header));
+    Big<U16> question_name = 0xc000 | sizeof(Header);
+    AppendLocalSOA(response, StrView((const char *)&question_name,
+                                     sizeof(question_name)));
+    FinishResponse(response, edns);
+    Reply(client_ip, client_port, response);
+  }
+
+  // Answers the queries for blocked domains with 0.0.0.0 (A) or :: (AAAA).
+  // Other types get an empty answer.
+  void SendBlocked(const MessageView &msg, const QuestionView &question,
+                   const EDNS &edns, IP client_ip, U16 client_port) {
+    U16 data_length = question.type == Type::A      ? 4
+                      : question.type == Type::AAAA ? 16
+                                                    : 0;
+    Header header = ResponseHeader(msg);
+    header.question_count = 1;
+    header.answer_count = data_length ? 1 : 0;
+    Str response((const char *)&header, sizeof(header));
+    response += msg.buffer.substr(sizeof(Header),
+                                  msg.answers_offset - sizeof(Header));
+    if (data_length) {
+      struct __attribute__((__packed__)) {
+        Big<U16> name = 0xc000 | sizeof(Header); // pointer to the question
+        Big<U16> type;
+        Big<U16> class_;
+        Big<U32> ttl;
+        Big<U16> data_length;
+      } record = {.type = (U16)question.type,
+                  .class_ = (U16)question.class_,
+                  .ttl = (U32)(kAuthoritativeTTL / 1s),
+                  .data_length = data_length};
+      response.append((const char *)&record, sizeof(record));
+      response.append(data_length, '\0');
+    }
+    FinishResponse(response, edns);
+    Reply(client_ip, client_port, response);
+  }
+
+  // Answers a valid query.
+  virtual void Resolve(const Header &header, const EDNS &edns, StrView domain,
+                       Type type, IP client_ip, U16 client_port) {
+    new ProxyLookup(*this, client_ip, client_port, header, edns, domain, type);
+  }
 
-    new ProxyLookup(source_ip, source_port, msg);
+  // Sends the answer of a `ProxyLookup`. Called on the main thread.
+  virtual void SendAnswer(IP client_ip, U16 client_port, StrView answer) {
+    Reply(client_ip, client_port, answer);
   }
 
   void NotifyRead(Status &epoll_status) override {
@@ -167,47 +361,328 @@ struct Server : epoll::UDPListener {
 
 Server server;
 
-void ProxyLookup::OnAnswer(const Message &msg) {
-  string buffer;
-  Header response_header{
-      .id = header.id,
-      .recursion_desired = true,
-      .truncated = false,
-      .authoritative = false,
-      .opcode = Header::OperationCode::QUERY,
-      .reply = true,
-      .response_code = msg.header.response_code,
-      .reserved = 0,
-      .recursion_available = true,
-      .question_count = 1,
-      .answer_count = msg.answers.size(),
-      .authority_count = msg.authority.size(),
-      .additional_count = msg.additional.size(),
+// Query that a server thread couldn't answer from the cache.
+struct ForwardedQuery {
+  IP client_ip;
+  U16 client_port;
+  Header header;
+  EDNS edns;
+  Type type;
+  U8 domain_size;
+  char domain[kMaxDomainNameLength];
+};
+
+// Wakes up the main thread when the server threads have some queries for it.
+//
+// The queries are passed through the `ServerThread::forwarded` rings. The
+// eventfd is only signalled when a ring goes from empty to non-empty.
+struct ForwardedQueries : epoll::Listener {
+  // Limit on the number of queries taken from a single ring before other
+  // epoll events get a chance to run.
+  static constexpr Size kMaxDrain = 1024;
+
+  void Setup(Status &status) {
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+      AppendErrorMessage(status) += "eventfd()";
+    }
+  }
+
+  // Can be called from any thread.
+  void Wake() {
+    U64 one = 1;
+    write(fd, &one, sizeof(one));
+  }
+
+  void NotifyRead(Status &status) override;
+
+  const char *Name() const override { return "dns::ForwardedQueries"; }
+};
+
+ForwardedQueries forwarded_queries;
+
+// Server with its own socket, epoll & thread.
+struct ServerThread : Server {
+  // Wakes up the thread when it should stop.
+  struct StopSignal : epoll::Listener {
+    ServerThread &thread;
+
+    StopSignal(ServerThread &thread) : thread(thread) {}
+
+    void NotifyRead(Status &) override {
+      // `epoll::Loop` returns once all of the listeners are removed.
+      Status ignored;
+      epoll::Del(&thread, ignored);
+      epoll::Del(this, ignored);
+    }
+
+    const char *Name() const override { return "dns::ServerThread::Stop"; }
   };
-  response_header.write_to(buffer);
-  msg.questions.front().write_to(buffer);
-  for (auto &a : msg.answers) {
-    a.write_to(buffer);
+
+  int index;
+  std::thread thread;
+  StopSignal stop_signal;
+  // Queries waiting for the main thread.
+  SPSCRing<ForwardedQuery, 1024> forwarded;
+  // Number of queries dropped because `forwarded` was full.
+  std::atomic<U64> dropped = 0;
+  // Reused for the responses copied from the cache.
+  Str response;
+
+  ServerThread(int index) : index(index), stop_signal(*this) {}
+
+  void Start(Status &status) {
+    Open(status);
+    if (!OK(status)) {
+      return;
+    }
+    stop_signal.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_signal.fd == -1) {
+      AppendErrorMessage(status) += "eventfd()";
+      fd.Close();
+      return;
+    }
+    thread = std::thread(&ServerThread::Loop, this);
+  }
+
+  void Stop() {
+    if (!thread.joinable()) {
+      return;
+    }
+    U64 one = 1;
+    write(stop_signal.fd, &one, sizeof(one));
+    thread.join();
+    stop_signal.fd.Close();
+    fd.Close();
+  }
+
+  void Loop() {
+    Str thread_name = f("DNS #%d", index);
+    prctl(PR_SET_NAME, thread_name.c_str(), 0, 0, 0);
+    epoll::Init();
+    Status status;
+    epoll::Add(this, status);
+    epoll::Add(&stop_signal, status);
+    if (OK(status)) {
+      epoll::Loop(status);
+    }
+    if (!OK(status)) {
+      AppendErrorMessage(status) += thread_name + " stopped";
+      ERROR << status;
+    }
+    close(epoll::fd);
+  }
+
+  void Resolve(const Header &header, const EDNS &edns, StrView domain,
+               Type type, IP client_ip, U16 client_port) override {
+    if (CopyFreshResponse({.domain_name = domain, .type = type}, response)) {
+      ((Header *)response.data())->id = header.id;
+      FinishResponse(response, edns);
+      Reply(client_ip, client_port, response);
+      return;
+    }
+    ForwardedQuery query = {.client_ip = client_ip,
+                            .client_port = client_port,
+                            .header = header,
+                            .edns = edns,
+                            .type = type,
+                            .domain_size = (U8)domain.size()};
+    memcpy(query.domain, domain.data(), domain.size());
+    bool was_empty;
+    if (!forwarded.Push(query, was_empty)) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (was_empty) {
+      forwarded_queries.Wake();
+    }
   }
-  for (auto &a : msg.authority) {
-    a.write_to(buffer);
+
+  // Replies are queued by this thread, so the main thread sends its answers
+  // on its own.
+  void SendAnswer(IP client_ip, U16 client_port, StrView answer) override {
+    Str err;
+    fd.SendTo(client_ip, client_port, answer, err);
   }
-  for (auto &a : msg.additional) {
-    a.write_to(buffer);
+
+  // Expirable objects belong to the main thread.
+  void NotifyRead(Status &status) override {
+    UDPListener::NotifyRead(status);
   }
-  Str err;
-  server.fd.SendTo(client_ip, client_port, buffer, err);
+
+  const char *Name() const override { return "dns::ServerThread"; }
+};
+
+// Never destroyed, because the main thread may still have lookups that answer
+// through their sockets.
+Vec<UniquePtr<ServerThread>> threads;
+
+void ForwardedQueries::NotifyRead(Status &status) {
+  U64 signals;
+  read(fd, &signals, sizeof(signals));
+  ForwardedQuery batch[16];
+  for (auto &thread : threads) {
+    Size drained = 0;
+    while (Size n = thread->forwarded.Pop(batch, std::size(batch))) {
+      for (Size i = 0; i < n; ++i) {
+        ForwardedQuery &query = batch[i];
+        new ProxyLookup(*thread, query.client_ip, query.client_port,
+                        query.header, query.edns,
+                        StrView(query.domain, query.domain_size),
+                        query.type);
+      }
+      drained += n;
+      if (drained >= kMaxDrain) {
+        // The ring is still non-empty so its thread won't signal us. Come back
+        // after handling the other events.
+        Wake();
+        break;
+      }
+    }
+  }
+}
+
+void ProxyLookup::OnAnswer(const Message &msg, StrView wire) {
+  Str response(wire);
+  ((Header *)response.data())->id = header.id;
+  FinishResponse(response, edns);
+  server.SendAnswer(client_ip, client_port, response);
   delete this;
 }
 
+// Whether the kernel has a usable IPv6 default route.
+static bool HasIPv6DefaultRoute() {
+  Status status;
+  Str routes = fs::Read(fs::real, "/proc/net/ipv6_route", status);
+  if (!OK(status)) {
+    return false; // IPv6 is disabled
+  }
+  // Each line is: destination, prefix length, source, source prefix length,
+  // next hop, metric, reference count, use count, flags & device.
+  for (StrView line : SplitOnChars(routes, "\n")) {
+    char destination[33], device[32];
+    unsigned prefix_length, flags;
+    if (sscanf(Str(line).c_str(), "%32s %x %*s %*s %*s %*s %*s %*s %x %31s",
+               destination, &prefix_length, &flags, device) != 4) {
+      continue;
+    }
+    constexpr unsigned kRouteUp = 0x0001, kRouteReject = 0x0200;
+    if (prefix_length == 0 && (flags & kRouteUp) &&
+        !(flags & kRouteReject) && strcmp(device, "lo") != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void CheckIPv6Route() {
+  bool has_ipv6 = HasIPv6DefaultRoute();
+  if (wan_has_ipv6.exchange(has_ipv6) != has_ipv6) {
+    LOG << (has_ipv6 ? "Found an IPv6 default route. Proxying AAAA queries."
+                     : "No IPv6 default route. Answering AAAA queries with "
+                       "NODATA.");
+  }
+}
+
+static void ReadPolicies() {
+  if (char *env = getenv("DNS_AAAA")) {
+    StrView value = env;
+    if (value == "auto") {
+      aaaa_policy = AAAAPolicy::Auto;
+    } else if (value == "proxy") {
+      aaaa_policy = AAAAPolicy::Proxy;
+    } else if (value == "nodata") {
+      aaaa_policy = AAAAPolicy::NoData;
+    } else {
+      ERROR << "DNS_AAAA should be \"auto\", \"proxy\" or \"nodata\". Got \""
+            << value << "\". Ignoring it.";
+    }
+  }
+  if (char *env = getenv("DNS_HTTPS")) {
+    StrView value = env;
+    if (value == "proxy" || value == "nodata") {
+      https_nodata = value == "nodata";
+    } else {
+      ERROR << "DNS_HTTPS should be \"proxy\" or \"nodata\". Got \"" << value
+            << "\". Ignoring it.";
+    }
+  }
+}
+
+static int ThreadCount() {
+  if (char *env = getenv("DNS_THREADS")) {
+    int n = atoi(env);
+    if (n >= 0 && n <= kMaxThreads) {
+      return n;
+    }
+    ERROR << "DNS_THREADS should be a number between 0 and " << kMaxThreads
+          << ". Got \"" << env << "\". Ignoring it.";
+  }
+  return 0;
+}
+
 void StartServer(Status &status) {
-  server.Listen(status);
+  Status blocklist_status;
+  StartBlocklist(blocklist_status);
+  if (!OK(blocklist_status)) {
+    ERROR << blocklist_status;
+  }
+  ReadPolicies();
+  if (aaaa_policy == AAAAPolicy::Auto) {
+    CheckIPv6Route();
+    route_timer.emplace();
+    route_timer->handler = CheckIPv6Route;
+    route_timer->Arm(kRouteCheckInterval, kRouteCheckInterval);
+  }
+  thread_count = ThreadCount();
+  if (thread_count == 0) {
+    server.Listen(status);
+    if (!OK(status)) {
+      AppendErrorMessage(status) += "Failed to start DNS server";
+    }
+    return;
+  }
+  forwarded_queries.Setup(status);
+  if (OK(status)) {
+    epoll::Add(&forwarded_queries, status);
+  }
   if (!OK(status)) {
     AppendErrorMessage(status) += "Failed to start DNS server";
     return;
   }
+  for (int i = 0; i < thread_count; ++i) {
+    ServerThread &thread = *threads.emplace_back(new ServerThread(i));
+    thread.Start(status);
+    if (!OK(status)) {
+      AppendErrorMessage(status) += f("Failed to start DNS server thread %d", i);
+      StopServer();
+      return;
+    }
+  }
+  LOG << "DNS server running on " << thread_count << " threads.";
 }
 
-void StopServer() { server.StopListening(); }
+void StopServer() {
+  if (thread_count == 0) {
+    server.StopListening();
+  } else {
+    for (auto &thread : threads) {
+      thread->Stop();
+    }
+    Status ignored;
+    epoll::Del(&forwarded_queries, ignored);
+    forwarded_queries.fd.Close();
+  }
+  route_timer.reset();
+  StopBlocklist();
+}
+
+U64 DroppedQueries() {
+  U64 dropped = 0;
+  for (auto &thread : threads) {
+    dropped += thread->dropped.load(std::memory_order_relaxed);
+  }
+  return dropped;
+}
 
 } // namespace maf::dns
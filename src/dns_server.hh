@@ -1,5 +1,8 @@
 #pragma once
 
+#include <atomic>
+
+#include "int.hh"
 #include "status.hh"
 
 namespace maf::dns {
@@ -7,4 +10,16 @@ namespace maf::dns {
 void StartServer(Status &);
 void StopServer();
 
-} // namespace maf::dns
\ No newline at end of file
+// Number of queries that the server threads dropped because the main thread
+// couldn't keep up with them.
+U64 DroppedQueries();
+
+// Queries answered with NODATA instead of asking the upstream servers.
+struct NoDataStats {
+  std::atomic<U64> aaaa = 0;
+  std::atomic<U64> https = 0;
+};
+
+extern NoDataStats nodata_stats;
+
+} // namespace maf::dns
@@ -1,6 +1,10 @@
 #include "dns_table.hh"
 #include "chrono.hh"
+#include "dns_blocklist.hh"
 #include "dns_client.hh"
+#include "dns_local_zone.hh"
+#include "dns_server.hh"
+#include "format.hh"
 
 using namespace std;
 
@@ -9,19 +13,61 @@ namespace maf::dns {
 Table::Table() : webui::Table("dns", "DNS", {"Expiration", "Entry"}) {}
 
 void Table::Update(RenderOptions &opts) {
+  caption = f("DNS (%zu entries, %zu KiB", Entry::cache.size(),
+              cache_stats.size / 1024);
+  if (cache_stats.budget) {
+    caption += f(" of %zu KiB", cache_stats.budget / 1024);
+  }
+  if (U64 lookups = cache_stats.hits + cache_stats.misses) {
+    caption += f(", %.1f%% hit rate", 100.0 * cache_stats.hits / lookups);
+  }
+  if (cache_stats.evictions) {
+    caption += f(", %lu evicted", cache_stats.evictions);
+  }
+  if (cache_stats.prefetches) {
+    caption += f(", %lu prefetched", cache_stats.prefetches);
+  }
+  if (cache_stats.stale_answers) {
+    caption += f(", %lu stale answers", cache_stats.stale_answers);
+  }
+  if (cache_stats.tcp_fallbacks) {
+    caption += f(", %lu TCP fallbacks", cache_stats.tcp_fallbacks);
+  }
+  if (cache_stats.tls_connections) {
+    caption += f(", %lu TLS connections", cache_stats.tls_connections);
+  }
+  if (U64 local = local_zone_stats.answers) {
+    caption += f(", %lu local answers", local);
+  }
+  if (U64 blocked = blocklist_stats.blocked_queries) {
+    caption += f(", %lu blocked", blocked);
+  }
+  U64 nodata_aaaa = nodata_stats.aaaa, nodata_https = nodata_stats.https;
+  if (nodata_aaaa + nodata_https) {
+    caption += f(", %lu upstream queries saved (AAAA: %lu, HTTPS: %lu)",
+                 nodata_aaaa + nodata_https, nodata_aaaa, nodata_https);
+  }
+  if (U64 dropped = DroppedQueries()) {
+    caption += f(", %lu dropped queries", dropped);
+  }
+  caption += ")";
   rows.clear();
   auto now = chrono::steady_clock::now();
   for (auto *entry : Entry::cache) {
 
+    Optional<chrono::steady_clock::time_point> fresh_until =
+        entry->FreshUntil();
     Optional<chrono::steady_clock::duration> expiration =
-        entry->expiration.transform(
+        fresh_until.transform(
             [&](auto expiration) { return expiration - now; });
     rows.emplace_back(Row{
         .question = entry->question.to_html(),
         .domain = entry->question.domain_name,
         .type = (U16)entry->question.type,
-        .expiration = FormatDuration(expiration),
-        .expiration_time = entry->expiration,
+        .expiration = fresh_until && *fresh_until <= now
+                          ? "stale"
+                          : FormatDuration(expiration),
+        .expiration_time = fresh_until,
     });
   }
   if (opts.sort_column) {
@@ -1,5 +1,6 @@
 #include "dns_utils.hh"
 
+#include <cstring>
 #include <netinet/in.h>
 
 #include "format.hh"
@@ -31,6 +32,8 @@ Str ToStr(Type t) {
     return "AAAA";
   case Type::SRV:
     return "SRV";
+  case Type::OPT:
+    return "OPT";
   case Type::HTTPS:
     return "HTTPS";
   case Type::ANY:
@@ -93,43 +96,58 @@ encode_segment:
 
 pair<Str, Size> LoadDomainName(const char *dns_message_base,
                                Size dns_message_len, Size offset) {
+  DomainNameBuffer buffer;
+  StrView domain_name;
+  Size size = LoadDomainName(dns_message_base, dns_message_len, offset, buffer,
+                             domain_name);
+  return make_pair(Str(domain_name), size);
+}
+
+Size LoadDomainName(const char *dns_message_base, Size dns_message_len,
+                    Size offset, DomainNameBuffer &buffer, StrView &name) {
   Size start_offset = offset;
-  Str domain_name;
+  // Pointers may only jump backwards - to avoid infinite loops.
+  Size jump_limit = offset;
+  // Number of bytes read at `start_offset`. Known after the first jump.
+  Size bytes_read = 0;
+  Size encoded_length = 1;
+  Size name_length = 0;
   while (true) {
     if (offset >= dns_message_len) {
-      return make_pair("", 0);
+      return 0;
     }
-    char n = dns_message_base[offset++];
+    U8 n = dns_message_base[offset++];
     if (n == 0) {
-      return make_pair(domain_name, offset - start_offset);
+      name = StrView(buffer, name_length);
+      return bytes_read ? bytes_read : offset - start_offset;
     }
     if ((n & 0b1100'0000) == 0b1100'0000) { // DNS compression
       if (offset >= dns_message_len) {
-        return make_pair("", 0);
+        return 0;
       }
-      U16 new_offset = ((n & 0b0011'1111) << 8) | dns_message_base[offset++];
-      if (new_offset >=
-          start_offset) { // disallow forward jumps to avoid infinite loops
-        return make_pair("", 0);
+      Size new_offset =
+          ((n & 0b0011'1111) << 8) | (U8)dns_message_base[offset++];
+      if (new_offset >= jump_limit) {
+        return 0;
       }
-      auto [suffix, suffix_bytes] =
-          LoadDomainName(dns_message_base, dns_message_len, new_offset);
-      if (suffix_bytes == 0) {
-        return make_pair("", 0);
+      if (bytes_read == 0) {
+        bytes_read = offset - start_offset;
       }
-      if (!domain_name.empty()) {
-        domain_name += '.';
-      }
-      domain_name += suffix;
-      return make_pair(domain_name, offset - start_offset);
+      offset = jump_limit = new_offset;
+      continue;
     }
-    if (offset + n > dns_message_len) {
-      return make_pair("", 0);
+    if (n & 0b1100'0000) { // reserved label types
+      return 0;
     }
-    if (!domain_name.empty()) {
-      domain_name += '.';
+    encoded_length += n + 1;
+    if (offset + n > dns_message_len || encoded_length > 255) {
+      return 0;
+    }
+    if (name_length) {
+      buffer[name_length++] = '.';
     }
-    domain_name.append((char *)dns_message_base + offset, n);
+    memcpy(buffer + name_length, dns_message_base + offset, n);
+    name_length += n;
     offset += n;
   }
 }
@@ -231,6 +249,34 @@ struct SOA {
   }
 };
 
+void AppendOPT(Str &buffer, U16 udp_payload_size) {
+  struct __attribute__((__packed__)) {
+    U8 name = 0; // root domain
+    Big<U16> type = (U16)Type::OPT;
+    Big<U16> udp_payload_size;
+    U8 extended_rcode = 0;
+    U8 version = 0;
+    Big<U16> flags = 0;
+    Big<U16> data_length = 0;
+  } opt = {.udp_payload_size = udp_payload_size};
+  static_assert(sizeof(opt) == kOPTSize);
+  buffer.append((const char *)&opt, sizeof(opt));
+}
+
+Optional<U32> NegativeTTL(const Record &record,
+                          chrono::steady_clock::time_point now) {
+  if (record.type != Type::SOA) {
+    return nullopt;
+  }
+  // SOA data is stored without DNS compression, so it can be parsed alone.
+  SOA soa;
+  if (soa.LoadFrom(record.data.data(), record.data.size(), 0) !=
+      record.data.size()) {
+    return nullopt;
+  }
+  return min(record.ttl(now), soa.minimum_ttl);
+}
+
 size_t Question::LoadFrom(const char *ptr, size_t len, size_t offset) {
   size_t start_offset = offset;
   auto [loaded_name, loaded_size] = LoadDomainName(ptr, len, offset);
@@ -322,11 +368,10 @@ void Record::write_to(string &buffer) const {
                 sizeof(data_length_big_endian));
   buffer.append(data);
 }
-U32 Record::ttl() const {
+U32 Record::ttl() const { return ttl(chrono::steady_clock::now()); }
+U32 Record::ttl(chrono::steady_clock::time_point now) const {
   if (expiration.has_value()) {
-    auto d = duration_cast<chrono::seconds>(*expiration -
-                                            chrono::steady_clock::now())
-                 .count();
+    auto d = duration_cast<chrono::seconds>(*expiration - now).count();
     return (U32)max(d, 0l);
   } else {
     return (U32)duration_cast<chrono::seconds>(kAuthoritativeTTL).count();
@@ -442,4 +487,159 @@ void Message::ForEachRecord(Fn<void(const Record &)> f) const {
   }
 }
 
+void MessageView::Parse(StrView buffer, Str &err) {
+  this->buffer = buffer;
+  const char *ptr = buffer.data();
+  Size len = buffer.size();
+  if (len < sizeof(Header)) {
+    err = "DNS message buffer is too short: " + ::ToStr(len) +
+          " bytes. DNS header requires at least 12 bytes. Hex-escaped "
+          "buffer: " +
+          BytesToHex(ptr, len);
+    return;
+  }
+  header = *(Header *)ptr;
+
+  DomainNameBuffer name_buffer;
+  StrView name;
+  Size offset = sizeof(Header);
+  for (int i = 0; i < header.question_count.Get(); ++i) {
+    Size name_size = LoadDomainName(ptr, len, offset, name_buffer, name);
+    if (name_size == 0 || offset + name_size + 4 > len) {
+      err = "Failed to load DNS question from " + BytesToHex(ptr, len);
+      return;
+    }
+    offset += name_size + 4;
+  }
+  answers_offset = offset;
+
+  U32 n = header.answer_count.Get() + header.authority_count.Get() +
+          header.additional_count.Get();
+  for (U32 i = 0; i < n; ++i) {
+    Size name_size = LoadDomainName(ptr, len, offset, name_buffer, name);
+    if (name_size == 0 || offset + name_size + 10 > len) {
+      err = "Failed to load a record from DNS message:\n" +
+            BytesToHex(ptr, len) + "\nFailed when parsing:\n" +
+            BytesToHex(ptr + offset, len - offset);
+      return;
+    }
+    offset += name_size + 10;
+    U16 data_length = Big(*(U16 *)(ptr + offset - 2)).big_endian;
+    if (offset + data_length > len) {
+      err = "DNS record data goes past the end of the message:\n" +
+            BytesToHex(ptr, len);
+      return;
+    }
+    offset += data_length;
+  }
+}
+
+StrView MessageView::LoadName(Size offset,
+                              DomainNameBuffer &name_buffer) const {
+  StrView name;
+  LoadDomainName(buffer.data(), buffer.size(), offset, name_buffer, name);
+  return name;
+}
+
+Str MessageView::ToStr() const {
+  Message msg;
+  Str err;
+  msg.Parse(buffer.data(), buffer.size(), err);
+  if (!err.empty()) {
+    return err;
+  }
+  return msg.ToStr();
+}
+
+// Names were validated by `Parse` so they can be skipped without any checks.
+static Size SkipDomainName(const char *ptr, Size offset) {
+  while (true) {
+    U8 n = ptr[offset];
+    if (n == 0) {
+      return offset + 1;
+    }
+    if ((n & 0b1100'0000) == 0b1100'0000) {
+      return offset + 2;
+    }
+    offset += n + 1;
+  }
+}
+
+void TruncateResponse(Str &response, Size limit) {
+  if (response.size() <= limit) {
+    return;
+  }
+  MessageView msg;
+  Str err;
+  msg.Parse(response, err);
+  Header &header = *(Header *)response.data();
+  if (!err.empty()) {
+    // Shouldn't happen for the responses that were parsed before caching.
+    header.truncated = true;
+    header.question_count = 0;
+    header.answer_count = 0;
+    header.authority_count = 0;
+    header.additional_count = 0;
+    response.resize(sizeof(Header));
+    return;
+  }
+  U32 answer_count = header.answer_count.Get();
+  U32 authority_count = header.authority_count.Get();
+  Size answers_end = msg.answers_offset;
+  Size authority_end = msg.answers_offset;
+  U32 i = 0;
+  msg.ForEachRecord([&](const RecordView &r) {
+    ++i;
+    Size end = r.data_offset + r.data_length;
+    if (i <= answer_count) {
+      answers_end = end;
+    }
+    if (i <= answer_count + authority_count) {
+      authority_end = end;
+    }
+  });
+  Size size;
+  if (authority_end <= limit) {
+    header.additional_count = 0;
+    size = authority_end;
+  } else if (answer_count > 0 && answers_end <= limit) {
+    header.authority_count = 0;
+    header.additional_count = 0;
+    size = answers_end;
+  } else {
+    header.truncated = true;
+    header.answer_count = 0;
+    header.authority_count = 0;
+    header.additional_count = 0;
+    size = msg.answers_offset;
+  }
+  response.resize(size);
+}
+
+Size MessageView::SkipQuestion(Size offset) const {
+  return SkipDomainName(buffer.data(), offset) + 4;
+}
+
+QuestionView MessageView::ReadQuestion(Size offset) const {
+  const char *ptr = buffer.data() + SkipDomainName(buffer.data(), offset);
+  return QuestionView{
+      .name_offset = offset,
+      .type = Type(Big(*(U16 *)ptr).big_endian),
+      .class_ = Class(Big(*(U16 *)(ptr + 2)).big_endian),
+  };
+}
+
+RecordView MessageView::ReadRecord(Size offset) const {
+  Size fields = SkipDomainName(buffer.data(), offset);
+  const char *ptr = buffer.data() + fields;
+  RecordView r;
+  r.name_offset = offset;
+  r.type = Type(Big(*(U16 *)ptr).big_endian);
+  r.class_ = Class(Big(*(U16 *)(ptr + 2)).big_endian);
+  r.ttl = Big(*(U32 *)(ptr + 4)).big_endian;
+  r.data_length = Big(*(U16 *)(ptr + 8)).big_endian;
+  r.data_offset = fields + 10;
+  return r;
+}
+
 } // namespace maf::dns
\ No newline at end of file
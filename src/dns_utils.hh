@@ -19,6 +19,13 @@ static constexpr std::chrono::steady_clock::duration kAuthoritativeTTL = 60s;
 
 static constexpr U16 kServerPort = 53;
 
+// Largest DNS message that can be sent over UDP without EDNS (RFC 1035).
+static constexpr U16 kMaxUDPSize = 512;
+
+// UDP payload size advertised to the upstream servers with EDNS (RFC 6891).
+// Avoids IP fragmentation on the usual paths (DNS Flag Day 2020).
+static constexpr U16 kEDNSPayloadSize = 1232;
+
 enum class Type : U16 {
   A = 1,
   NS = 2,
@@ -29,6 +36,7 @@ enum class Type : U16 {
   TXT = 16,
   AAAA = 28,
   SRV = 33,
+  OPT = 41,
   HTTPS = 65,
   ANY = 255,
 };
@@ -53,6 +61,14 @@ struct Question {
   auto operator<=>(const Question &other) const = default;
 };
 
+// Version of `Question` that doesn't own its domain name. Allows cache lookups
+// without copying the name.
+struct QuestionKey {
+  StrView domain_name = "";
+  Type type = Type::A;
+  Class class_ = Class::IN;
+};
+
 enum class ResponseCode {
   NO_ERROR = 0,
   FORMAT_ERROR = 1,
@@ -64,15 +80,44 @@ enum class ResponseCode {
 
 const char *ToStr(ResponseCode);
 
+struct Record;
+
+// TTL of the negative answers (NXDOMAIN & NODATA) that carry this SOA record:
+// the smaller of its own TTL & its MINIMUM field (RFC 2308, section 5).
+//
+// Returns nullopt if the `record` isn't a valid SOA record.
+Optional<U32> NegativeTTL(const Record &soa,
+                          std::chrono::steady_clock::time_point now);
+
+// Appends an EDNS OPT pseudo-record that advertises the `udp_payload_size`
+// (RFC 6891). The `additional_count` of the message should be incremented.
+void AppendOPT(Str &buffer, U16 udp_payload_size);
+
+// Size of the OPT record appended by `AppendOPT`.
+static constexpr Size kOPTSize = 11;
+
 // Convert a domain name from "www.google.com" to "\3www\6google\3com\0".
 Str EncodeDomainName(const Str &domain_name);
 
+// Longest domain name in the "www.google.com" form. Encoded domain names are
+// limited to 255 bytes by RFC 1035.
+static constexpr Size kMaxDomainNameLength = 253;
+
+using DomainNameBuffer = char[kMaxDomainNameLength];
+
 // Load a domain name from a DNS packet (supporting DNS compression).
 //
 // Returns a pair of domain name and the number of bytes read.
 std::pair<Str, Size> LoadDomainName(const char *dns_message_base,
                                     Size dns_message_len, Size offset);
 
+// Load a domain name from a DNS packet into the `buffer`, without allocating.
+//
+// Returns the number of bytes read (0 if the name is malformed). `name` is set
+// to the part of `buffer` that holds the domain name.
+Size LoadDomainName(const char *dns_message_base, Size dns_message_len,
+                    Size offset, DomainNameBuffer &buffer, StrView &name);
+
 struct __attribute__((__packed__)) Header {
   enum class OperationCode {
     QUERY = 0,
@@ -115,6 +160,7 @@ struct Record : public Question {
   Size LoadFrom(const char *ptr, Size len, Size offset);
   void write_to(Str &buffer) const;
   U32 ttl() const;
+  U32 ttl(std::chrono::steady_clock::time_point now) const;
   Str ToStr() const;
   Str pretty_value() const;
   Str to_html() const;
@@ -132,4 +178,75 @@ struct Message {
   void ForEachRecord(Fn<void(const Record &)> f) const;
 };
 
+// Question of a `MessageView`. The name is stored at `name_offset`.
+struct QuestionView {
+  Size name_offset;
+  Type type;
+  Class class_;
+};
+
+// Record of a `MessageView`. The data is stored at `data_offset`.
+struct RecordView : QuestionView {
+  U32 ttl;
+  Size data_offset;
+  U16 data_length;
+};
+
+// DNS message that is parsed in place, without allocating.
+//
+// `Parse` validates the structure of the whole packet. The questions & records
+// are then read directly from the `buffer`, which must outlive the view.
+// Domain names are decoded only when needed, with `LoadName`.
+//
+// Use `Message` to get a copy that can outlive the packet.
+struct MessageView {
+  StrView buffer;
+  Header header = {};
+  // Offset of the first answer, right after the questions.
+  Size answers_offset = sizeof(Header);
+
+  void Parse(StrView buffer, Str &err);
+
+  QuestionView FirstQuestion() const { return ReadQuestion(sizeof(Header)); }
+
+  template <typename F> void ForEachQuestion(F f) const {
+    Size offset = sizeof(Header);
+    for (U16 i = 0; i < header.question_count.Get(); ++i) {
+      QuestionView q = ReadQuestion(offset);
+      offset = SkipQuestion(offset);
+      f(q);
+    }
+  }
+
+  template <typename F> void ForEachRecord(F f) const {
+    Size offset = answers_offset;
+    U32 n = header.answer_count.Get() + header.authority_count.Get() +
+            header.additional_count.Get();
+    for (U32 i = 0; i < n; ++i) {
+      RecordView r = ReadRecord(offset);
+      offset = r.data_offset + r.data_length;
+      f(r);
+    }
+  }
+
+  // Decodes the domain name at `offset` into the `buffer`.
+  StrView LoadName(Size offset, DomainNameBuffer &buffer) const;
+
+  // Builds an owning `Message` to print it. Meant for logging.
+  Str ToStr() const;
+
+private:
+  Size SkipQuestion(Size offset) const;
+  QuestionView ReadQuestion(Size offset) const;
+  RecordView ReadRecord(Size offset) const;
+};
+
+// Shrinks the `response` to at most `limit` bytes, for clients that can't
+// receive larger UDP datagrams (RFC 2181, section 9).
+//
+// Drops the additional records first & then the authority records. When the
+// answers don't fit either, only the question is kept & the TC bit is set, so
+// that the client repeats the query over TCP.
+void TruncateResponse(Str &response, Size limit);
+
 } // namespace maf::dns
\ No newline at end of file
@@ -16,8 +16,9 @@ thread_local int fd = 0;
 thread_local int listener_count = 0;
 
 static constexpr int kMaxEpollEvents = 10;
-static epoll_event events[kMaxEpollEvents];
-static int events_count = 0;
+// Each thread may run its own `Loop`.
+static thread_local epoll_event events[kMaxEpollEvents];
+static thread_local int events_count = 0;
 
 void Init() { fd = epoll_create1(EPOLL_CLOEXEC); }
 
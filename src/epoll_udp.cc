@@ -1,28 +1,107 @@
 #include "epoll_udp.hh"
 #include "status.hh"
 #include <cstring>
+#include <sys/socket.h>
 
 namespace maf::epoll {
 
+void UDPListener::Reply(IP remote_ip, U16 remote_port, StrView buffer) {
+  sockaddr_in remote_addr = {
+      .sin_family = AF_INET,
+      .sin_port = Big(remote_port).big_endian,
+      .sin_addr = {.s_addr = remote_ip.addr},
+  };
+  if (!handling) {
+    ++stats.send_calls;
+    if (sendto(fd, buffer.data(), buffer.size(), 0,
+               (struct sockaddr *)&remote_addr, sizeof(remote_addr)) < 0) {
+      ++stats.dropped;
+      errno = 0;
+    } else {
+      ++stats.sent;
+    }
+    return;
+  }
+  if (send_count == kBatchSize) {
+    Flush();
+  }
+  send_addrs[send_count] = remote_addr;
+  send_buffers[send_count].assign(buffer);
+  ++send_count;
+}
+
+void UDPListener::Flush() {
+  mmsghdr msgs[kBatchSize];
+  iovec iovecs[kBatchSize];
+  for (int i = 0; i < send_count; ++i) {
+    iovecs[i] = {.iov_base = send_buffers[i].data(),
+                 .iov_len = send_buffers[i].size()};
+    msgs[i] = {.msg_hdr = {.msg_name = &send_addrs[i],
+                           .msg_namelen = sizeof(send_addrs[i]),
+                           .msg_iov = &iovecs[i],
+                           .msg_iovlen = 1}};
+  }
+  int sent = 0;
+  while (fd != -1 && sent < send_count) {
+    ++stats.send_calls;
+    int n = sendmmsg(fd, msgs + sent, send_count - sent, 0);
+    if (n < 0) {
+      // `sendmmsg` stops at the first datagram that can't be sent. Skip it,
+      // like a failed `sendto`.
+      ++stats.dropped;
+      errno = 0;
+      n = 1;
+    } else {
+      stats.sent += n;
+    }
+    sent += n;
+  }
+  send_count = 0;
+}
+
 void UDPListener::NotifyRead(Status &status) {
+  mmsghdr msgs[kBatchSize];
+  iovec iovecs[kBatchSize];
+  sockaddr_in addrs[kBatchSize];
+  handling = true;
   while (fd != -1) {
-    sockaddr_in clientaddr;
-    socklen_t clilen = sizeof(struct sockaddr);
-    SSize len = recvfrom(fd, recvbuf, sizeof(recvbuf), 0,
-                         (struct sockaddr *)&clientaddr, &clilen);
-    if (len < 0) {
+    for (int i = 0; i < kBatchSize; ++i) {
+      iovecs[i] = {.iov_base = recv_buffers[i], .iov_len = kMaxDatagramSize};
+      msgs[i] = {.msg_hdr = {.msg_name = &addrs[i],
+                             .msg_namelen = sizeof(addrs[i]),
+                             .msg_iov = &iovecs[i],
+                             .msg_iovlen = 1}};
+    }
+    ++stats.recv_calls;
+    int n = recvmmsg(fd, msgs, kBatchSize, 0, nullptr);
+    if (n < 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         errno = 0;
-        break;
       } else {
-        AppendErrorMessage(status) += "UDPListener recvfrom";
-        return;
+        AppendErrorMessage(status) += "UDPListener recvmmsg";
       }
+      break;
+    }
+    stats.received += n;
+    for (int i = 0; i < n && fd != -1; ++i) {
+      if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        ++stats.dropped;
+        continue;
+      }
+      IP source_ip(addrs[i].sin_addr.s_addr);
+      U16 source_port = Big<U16>(addrs[i].sin_port).big_endian;
+      HandleRequest(StrView((char *)recv_buffers[i], msgs[i].msg_len),
+                    source_ip, source_port);
+    }
+    Flush();
+    if (n < kBatchSize) {
+      // Socket is empty. Level-triggered epoll will call us again once more
+      // datagrams arrive.
+      break;
     }
-    IP source_ip(clientaddr.sin_addr.s_addr);
-    U16 source_port = Big<U16>(clientaddr.sin_port).big_endian;
-    HandleRequest(StrView((char *)recvbuf, len), source_ip, source_port);
   }
+  Flush();
+  handling = false;
 }
 
-} // namespace maf::epoll
\ No newline at end of file
+} // namespace maf::epoll
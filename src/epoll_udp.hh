@@ -1,5 +1,7 @@
 #pragma once
 
+#include <netinet/in.h>
+
 #include <string>
 #include <string_view>
 
@@ -9,13 +11,45 @@
 
 namespace maf::epoll {
 
+// Listener for UDP sockets.
+//
+// Datagrams are received in batches, with one `recvmmsg`. Replies queued with
+// `Reply` go out together at the end of the batch, with one `sendmmsg`.
 struct UDPListener : Listener {
+  static constexpr int kBatchSize = 16;
+  // Larger datagrams are dropped.
+  static constexpr Size kMaxDatagramSize = 4096;
+
+  // Number of datagrams & syscalls. Updated by the thread that handles the
+  // datagrams.
+  struct Stats {
+    U64 received = 0;
+    U64 recv_calls = 0;
+    U64 sent = 0;
+    U64 send_calls = 0;
+    U64 dropped = 0; // too large to receive or failed to send
+  };
+  Stats stats;
+
   virtual void HandleRequest(StrView buf, IP source_ip, U16 source_port) = 0;
 
+  // Sends the datagram at the end of the current batch. Outside of
+  // `HandleRequest` it's sent right away.
+  //
+  // Must be called from the thread that handles the datagrams.
+  void Reply(IP remote_ip, U16 remote_port, StrView buffer);
+
   void NotifyRead(Status &) override;
 
 private:
-  U8 recvbuf[65536] = {0};
+  // Sends the queued replies.
+  void Flush();
+
+  bool handling = false;
+  U8 recv_buffers[kBatchSize][kMaxDatagramSize];
+  int send_count = 0;
+  sockaddr_in send_addrs[kBatchSize];
+  Str send_buffers[kBatchSize];
 };
 
-} // namespace maf::epoll
\ No newline at end of file
+} // namespace maf::epoll
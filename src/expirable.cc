@@ -1,12 +1,251 @@
 #include "expirable.hh"
 
+#include <bit>
 #include <cmath>
 #include <set>
 
+#include "int.hh"
+
 using namespace std;
 
 namespace maf {
 
+Expirable::Expirable() : expiration(nullopt) {}
+
+Expirable::Expirable(chrono::steady_clock::time_point expiration)
+    : expiration(expiration) {
+  AddToExpirationQueue();
+}
+
+Expirable::Expirable(chrono::steady_clock::duration ttl)
+    : Expirable(chrono::steady_clock::now() + ttl) {}
+
+Expirable::~Expirable() { RemoveFromExpirationQueue(); }
+
+void Expirable::UpdateExpiration(std::chrono::steady_clock::duration ttl) {
+  UpdateExpiration(chrono::steady_clock::now() + ttl);
+}
+
+#if EXPIRABLE_TIMING_WHEEL
+
+// Hierarchical timing wheel (Varghese & Lauck).
+//
+// Level 0 has a slot for every millisecond. Slots of each higher level are 64
+// times longer than the slots of the level below. Objects are put into the
+// lowest level that can hold their expiration and move down ("cascade") when
+// the wheel enters their slot. Objects expiring later than the top level can
+// reach (~12 days) are parked in its most distant slot & re-inserted from
+// there.
+struct TimingWheel {
+  static constexpr int kBits = 6;
+  static constexpr int kSlots = 1 << kBits;
+  static constexpr U64 kSlotMask = kSlots - 1;
+  static constexpr int kLevels = 5;
+
+  Expirable *slots[kLevels][kSlots] = {};
+  // Bit `i` is set when slot `i` of the given level may be non-empty.
+  U64 occupied[kLevels] = {};
+  // All of the ticks before `current` have been expired.
+  U64 current;
+  Size count = 0;
+
+  static U64 Tick(chrono::steady_clock::time_point time) {
+    return chrono::duration_cast<chrono::milliseconds>(time.time_since_epoch())
+        .count();
+  }
+
+  TimingWheel() : current(Tick(chrono::steady_clock::now())) {}
+
+  void Link(Expirable *e, int level, Size index) {
+    Expirable *&head = slots[level][index];
+    e->wheel_next = head;
+    if (head) {
+      head->wheel_pprev = &e->wheel_next;
+    }
+    head = e;
+    e->wheel_pprev = &head;
+    occupied[level] |= 1ull << index;
+  }
+
+  static void Unlink(Expirable *e) {
+    *e->wheel_pprev = e->wheel_next;
+    if (e->wheel_next) {
+      e->wheel_next->wheel_pprev = e->wheel_pprev;
+    }
+    e->wheel_next = nullptr;
+    e->wheel_pprev = nullptr;
+  }
+
+  void Place(Expirable *e) {
+    U64 tick = Tick(*e->expiration);
+    if (tick <= current) {
+      // Already due - will be deleted on the next tick.
+      Link(e, 0, current & kSlotMask);
+      return;
+    }
+    int level = (63 - countl_zero(tick - current)) / kBits;
+    if (level >= kLevels) {
+      // Too far into the future. Park it in the most distant slot.
+      level = kLevels - 1;
+      tick = current + (1ull << (kBits * kLevels)) - 1;
+    }
+    // The slot may be behind the current position of its level. Such slots
+    // are reached in the next rotation.
+    Link(e, level, (tick >> (kBits * level)) & kSlotMask);
+  }
+
+  void Insert(Expirable *e) {
+    ++count;
+    Place(e);
+  }
+
+  void Remove(Expirable *e) {
+    Unlink(e);
+    --count;
+  }
+
+  // Moves the objects from the slots that the wheel entered to the lower
+  // levels. Called whenever `current` crosses a level 0 rotation.
+  void Cascade() {
+    for (int level = 1; level < kLevels; ++level) {
+      Size index = (current >> (kBits * level)) & kSlotMask;
+      Expirable *list = slots[level][index];
+      slots[level][index] = nullptr;
+      occupied[level] &= ~(1ull << index);
+      while (list) {
+        Expirable *e = list;
+        list = e->wheel_next;
+        Place(e);
+      }
+      if (index != 0) {
+        break;
+      }
+    }
+  }
+
+  // Deletes the objects that expired before the `target` tick.
+  void Advance(U64 target) {
+    while (current < target) {
+      if (count == 0) {
+        current = target;
+        return;
+      }
+      Size index = current & kSlotMask;
+      U64 pending = occupied[0] >> index;
+      if (pending == 0) {
+        // Nothing in level 0 until the end of this rotation.
+        U64 next = (current | kSlotMask) + 1;
+        if (next > target) {
+          current = target;
+          return;
+        }
+        current = next;
+        Cascade();
+        continue;
+      }
+      int skip = countr_zero(pending);
+      if (current + skip >= target) {
+        current = target;
+        return;
+      }
+      current += skip;
+      index += skip;
+      // Destructors unlink the objects. They may also add new objects. Those
+      // that are already due end up in this slot as well.
+      while (Expirable *e = slots[0][index]) {
+        delete e;
+      }
+      occupied[0] &= ~(1ull << index);
+      ++current;
+      if ((current & kSlotMask) == 0) {
+        Cascade();
+      }
+    }
+  }
+
+  // Lower bound of the tick that `Advance` should reach next. Objects in the
+  // higher levels count from the start of their slot, when they cascade down.
+  Optional<U64> NextTick() const {
+    if (count == 0) {
+      return nullopt;
+    }
+    U64 next = UINT64_MAX;
+    for (int level = 0; level < kLevels; ++level) {
+      U64 mask = occupied[level];
+      if (mask == 0) {
+        continue;
+      }
+      int shift = kBits * level;
+      U64 rotation = current >> (shift + kBits) << (shift + kBits);
+      // The current slot of the higher levels was already cascaded. Objects
+      // in it belong to the next rotation.
+      Size start = ((current >> shift) & kSlotMask) + (level ? 1 : 0);
+      U64 tick;
+      if (start < kSlots && (mask >> start)) {
+        tick = rotation + ((start + countr_zero(mask >> start)) << shift);
+      } else {
+        tick = rotation + (1ull << (shift + kBits)) +
+               ((U64)countr_zero(mask) << shift);
+      }
+      next = min(next, tick);
+    }
+    return next;
+  }
+
+  ~TimingWheel() {
+    for (int level = 0; level < kLevels; ++level) {
+      for (int index = 0; index < kSlots; ++index) {
+        while (Expirable *e = slots[level][index]) {
+          delete e;
+        }
+      }
+    }
+  }
+};
+
+static thread_local TimingWheel wheel;
+
+void Expirable::AddToExpirationQueue() {
+  if (expiration == nullopt) {
+    return;
+  }
+  wheel.Insert(this);
+}
+
+void Expirable::RemoveFromExpirationQueue() {
+  if (wheel_pprev == nullptr) {
+    return;
+  }
+  wheel.Remove(this);
+}
+
+void Expirable::UpdateExpiration(
+    chrono::steady_clock::time_point new_expiration) {
+  if (wheel_pprev == nullptr) {
+    expiration = new_expiration;
+    wheel.Insert(this);
+    return;
+  }
+  TimingWheel::Unlink(this);
+  expiration = new_expiration;
+  wheel.Place(this);
+}
+
+void Expirable::Expire() {
+  wheel.Advance(TimingWheel::Tick(chrono::steady_clock::now()));
+}
+
+Optional<chrono::steady_clock::time_point> Expirable::NextExpiration() {
+  Optional<U64> tick = wheel.NextTick();
+  if (!tick) {
+    return nullopt;
+  }
+  // Objects of a tick are deleted once the clock is past it.
+  return chrono::steady_clock::time_point(chrono::milliseconds(*tick + 1));
+}
+
+#else
+
 struct OrderByExpiration {
   using is_transparent = true_type;
   bool operator()(const Expirable *a, const Expirable *b) const {
@@ -33,18 +272,6 @@ struct ExpirationQueue : multiset<Expirable *, OrderByExpiration> {
 
 static thread_local ExpirationQueue expiration_queue;
 
-Expirable::Expirable() : expiration(nullopt) {}
-
-Expirable::Expirable(chrono::steady_clock::time_point expiration)
-    : expiration(expiration) {
-  AddToExpirationQueue();
-}
-
-Expirable::Expirable(chrono::steady_clock::duration ttl)
-    : Expirable(chrono::steady_clock::now() + ttl) {}
-
-Expirable::~Expirable() { RemoveFromExpirationQueue(); }
-
 void Expirable::AddToExpirationQueue() {
   if (expiration == nullopt) {
     return;
@@ -52,7 +279,7 @@ void Expirable::AddToExpirationQueue() {
   expiration_queue.insert(this);
 }
 
-void Expirable::RemoveFromExpirationQueue() const {
+void Expirable::RemoveFromExpirationQueue() {
   if (expiration == nullopt) {
     return;
   }
@@ -72,8 +299,11 @@ void Expirable::UpdateExpiration(
   expiration_queue.insert(this);
 }
 
-void Expirable::UpdateExpiration(std::chrono::steady_clock::duration ttl) {
-  UpdateExpiration(chrono::steady_clock::now() + ttl);
+Optional<chrono::steady_clock::time_point> Expirable::NextExpiration() {
+  if (expiration_queue.empty()) {
+    return nullopt;
+  }
+  return (*expiration_queue.begin())->expiration;
 }
 
 void Expirable::Expire() {
@@ -84,4 +314,6 @@ void Expirable::Expire() {
   }
 }
 
-} // namespace maf
\ No newline at end of file
+#endif // EXPIRABLE_TIMING_WHEEL
+
+} // namespace maf
@@ -4,6 +4,10 @@
 
 #include "optional.hh"
 
+#ifndef EXPIRABLE_TIMING_WHEEL
+#define EXPIRABLE_TIMING_WHEEL 1
+#endif
+
 namespace maf {
 
 // Mixin class that can be used to automatically delete objects after a certain
@@ -13,6 +17,9 @@ namespace maf {
 //
 // Expirable objects are deleted by the `Expire` function, which should be
 // called periodically.
+//
+// Objects are kept in a hierarchical timing wheel with 1 ms resolution. Build
+// with CXXFLAGS=-DEXPIRABLE_TIMING_WHEEL=0 to use an ordered set instead.
 struct Expirable {
   // Don't modify directly. Use `UpdateExpiration` instead.
   Optional<std::chrono::steady_clock::time_point> expiration;
@@ -29,16 +36,31 @@ struct Expirable {
   // Destructor automatically removes `this` from the expiration queue.
   virtual ~Expirable();
 
-  // O(log n)
+  // O(1) (O(log n) with the ordered set queue)
   void UpdateExpiration(std::chrono::steady_clock::time_point new_expiration);
   void UpdateExpiration(std::chrono::steady_clock::duration ttl);
 
-  // O(1)
+  // O(1) amortized
   static void Expire();
 
+  // Time when `Expire` should be called next, or nullopt if there is nothing
+  // to expire. May be earlier than the actual expiration (but never later),
+  // so that the objects kept in the coarse levels of the timing wheel can
+  // move down on time.
+  //
+  // O(1)
+  static Optional<std::chrono::steady_clock::time_point> NextExpiration();
+
 private:
+  // Intrusive list links used by the timing wheel. Unused by the ordered set
+  // queue but kept so that the layout doesn't depend on the build flags.
+  Expirable *wheel_next = nullptr;
+  Expirable **wheel_pprev = nullptr;
+
+  friend struct TimingWheel;
+
   void AddToExpirationQueue();
-  void RemoveFromExpirationQueue() const;
+  void RemoveFromExpirationQueue();
 };
 
 } // namespace maf
\ No newline at end of file
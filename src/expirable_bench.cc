@@ -0,0 +1,92 @@
+// Benchmark of the `Expirable` expiration queue.
+//
+// Simulates a cache of short-lived objects that are refreshed millions of
+// times. Compare the two queue implementations with:
+//
+//   ./run expirable_bench
+//   CXXFLAGS=-DEXPIRABLE_TIMING_WHEEL=0 ./run expirable_bench
+
+#pragma maf main
+
+#include <chrono>
+
+#include "expirable.hh"
+#include "format.hh"
+#include "log.hh"
+#include "vec.hh"
+
+using namespace maf;
+using namespace std::chrono_literals;
+
+static constexpr Size kObjects = 100'000;
+static constexpr Size kRefreshes = 5'000'000;
+// `Expire` is called once every this many refreshes, as if every packet was
+// followed by a few cache lookups.
+static constexpr Size kRefreshesPerExpire = 4;
+
+struct Object : Expirable {
+  Object(std::chrono::steady_clock::duration ttl) : Expirable(ttl) {}
+};
+
+static U64 seed = 0x9E3779B97F4A7C15ull;
+
+static U64 Random() {
+  // xorshift64
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+// TTLs between 1 minute & 1 hour - typical for DNS records. Long enough for
+// nothing to expire while the benchmark runs.
+static std::chrono::steady_clock::duration RandomTTL() {
+  return std::chrono::seconds(60 + Random() % 3540);
+}
+
+template <typename Fn> static double NanosecondsPerOp(Size ops, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / ops;
+}
+
+int main() {
+  LOG << "Expiration queue: "
+      << (EXPIRABLE_TIMING_WHEEL ? "timing wheel" : "ordered set");
+
+  Vec<Object *> objects;
+  objects.reserve(kObjects);
+  double insert = NanosecondsPerOp(kObjects, [&] {
+    for (Size i = 0; i < kObjects; ++i) {
+      objects.push_back(new Object(RandomTTL()));
+    }
+  });
+
+  double refresh = NanosecondsPerOp(kRefreshes, [&] {
+    for (Size i = 0; i < kRefreshes; ++i) {
+      objects[Random() % kObjects]->UpdateExpiration(RandomTTL());
+    }
+  });
+
+  double refresh_and_expire = NanosecondsPerOp(kRefreshes, [&] {
+    for (Size i = 0; i < kRefreshes; ++i) {
+      objects[Random() % kObjects]->UpdateExpiration(RandomTTL());
+      if (i % kRefreshesPerExpire == 0) {
+        Expirable::Expire();
+      }
+    }
+  });
+
+  double cancel = NanosecondsPerOp(kObjects, [&] {
+    for (Object *object : objects) {
+      delete object;
+    }
+  });
+
+  LOG << f("insert: %.1f ns, refresh: %.1f ns, refresh + expire: %.1f ns, "
+           "cancel: %.1f ns",
+           insert, refresh, refresh_and_expire, cancel);
+  return 0;
+}
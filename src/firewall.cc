@@ -2,29 +2,40 @@
 
 #include <chrono>
 #include <cstddef>
-#include <fcntl.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_queue.h>
+#include <sys/eventfd.h>
 #include <sys/prctl.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <csignal>
+#include <mutex>
 #include <optional>
+#include <sched.h>
+#include <shared_mutex>
 #include <thread>
-#include <unordered_set>
 #include <utility>
 
+#include "checksum.hh"
 #include "config.hh"
 #include "epoll.hh"
-#include "expirable.hh"
 #include "format.hh"
 #include "log.hh"
+#include "nat_table.hh"
 #include "netfilter.hh"
 #include "netlink.hh"
 #include "nfqueue.hh"
 #include "span.hh"
+#include "split.hh"
+#include "spsc_ring.hh"
 #include "status.hh"
+#include "timer.hh"
 #include "traffic_log.hh"
+#include "unique_ptr.hh"
+#include "vec.hh"
+#include "virtual_fs.hh"
 
 using namespace maf;
 using namespace netfilter;
@@ -44,11 +55,61 @@ namespace gatekeeper::firewall {
 
 static constexpr bool kLogNatPackets = false;
 static constexpr bool kLogPassthroughPackets = false;
+
+// Number of packets after which the NAT of a flow is handed over to the kernel.
+// Later packets of the flow skip the firewall threads. Set to 0 to disable.
+static constexpr U32 kOffloadAfterPackets = 64;
+
+// Limit on the number of flows offloaded to the kernel at the same time. Also
+// the size of the kernel NAT maps. Once it's reached, new flows stay in the
+// firewall threads.
+static constexpr Size kMaxOffloadedFlows = 8192;
+
+// How often the traffic of offloaded flows is collected from the kernel.
+static constexpr std::chrono::steady_clock::duration kOffloadPollInterval =
+    1s;
 static constexpr char kTableName[] = "gatekeeper";
 
+// Number of nfqueues (and firewall threads) used to process the traffic.
+//
+// Can be overridden with the FIREWALL_THREADS environment variable. Defaults to
+// the number of CPU cores.
+static U16 queue_count = 1;
+
+// Number of packets that may wait in each nfqueue for their verdicts.
+//
+// Can be overridden with the FIREWALL_QUEUE_LENGTH environment variable.
+static constexpr U32 kDefaultQueueLength = 2048;
+static U32 queue_length = kDefaultQueueLength;
+
+// Socket receive buffer reserved for each queued packet. The kernel accounts
+// for the whole allocation of a packet so MTU-sized packets take up to 4 KiB.
+static constexpr int kReceiveBufferPerPacket = 4 * 1024;
+
+// When set, packets that don't fit in the nfqueue are accepted without NAT
+// (instead of being dropped). Enabled by the FIREWALL_FAIL_OPEN environment
+// variable.
+static bool fail_open = false;
+
+// Equivalent to:
+// queue num 1337-<1337 + queue_count - 1> fanout
+//
+// The "fanout" flag makes the kernel pick the queue based on the CPU that
+// handles the packet (rather than on a hash of the packet IPs). This keeps the
+// packets of a flow on the same CPU as the firewall thread that handles them.
+static std::string QueueExpression() {
+  std::string expr =
+      "\x2c\x00\x01\x80\x0a\x00\x01\x00\x71\x75\x65\x75\x65\x00\x00\x00\x1c\x00"
+      "\x02\x80\x06\x00\x01\x00\x05\x39\x00\x00\x06\x00\x02\x00\x00\x01\x00\x00"
+      "\x06\x00\x03\x00\x00\x02\x00\x00"s;
+  *(Big<U16> *)(expr.data() + 24) = kQueueNumber;
+  *(Big<U16> *)(expr.data() + 32) = queue_count;
+  return expr;
+}
+
 // Equivalent to:
-// oif != 3 ip saddr 10.1.0.0/16 notrack counter queue to 1337
-static std::string PostroutingRule() {
+// oif != 3 ip saddr 10.1.0.0/16 notrack
+static std::string PostroutingMatch() {
   std::string base =
       "\x24\x00\x01\x80\x09\x00\x01\x00\x6d\x65\x74\x61\x00\x00\x00\x00\x14\x00"
       "\x02\x80\x08\x00\x02\x00\x00\x00\x00\x05\x08\x00\x01\x00\x00\x00\x00\x01"
@@ -60,18 +121,15 @@ static std::string PostroutingRule() {
       "\x04\x00\x00\x00\x00\x02\x2c\x00\x01\x80\x08\x00\x01\x00\x63\x6d\x70\x00"
       "\x20\x00\x02\x80\x08\x00\x01\x00\x00\x00\x00\x01\x08\x00\x02\x00\x00\x00"
       "\x00\x00\x0c\x00\x03\x80\x06\x00\x01\x00\x55\x66\x00\x00\x10\x00\x01\x80"
-      "\x0c\x00\x01\x00\x6e\x6f\x74\x72\x61\x63\x6b\x00\x14\x00\x01\x80\x0c\x00"
-      "\x01\x00\x63\x6f\x75\x6e\x74\x65\x72\x00\x04\x00\x02\x80\x24\x00\x01\x80"
-      "\x0a\x00\x01\x00\x71\x75\x65\x75\x65\x00\x00\x00\x14\x00\x02\x80\x06\x00"
-      "\x01\x00\x05\x39\x00\x00\x06\x00\x02\x00\x00\x01\x00\x00"s;
+      "\x0c\x00\x01\x00\x6e\x6f\x74\x72\x61\x63\x6b\x00"s;
   *(U32 *)(base.data() + 76) = lan.index;
   *(U32 *)(base.data() + 172) = lan_network.ip.addr;
   return base;
 }
 
 // Equivalent to:
-// iif != 3 ip daddr 10.0.0.8 notrack counter queue to 1337
-static std::string PreroutingRule() {
+// iif != 3 ip daddr 10.0.0.8 notrack
+static std::string PreroutingMatch() {
   std::string base =
       "\x24\x00\x01\x80\x09\x00\x01\x00\x6d\x65\x74\x61\x00\x00\x00\x00\x14\x00"
       "\x02\x80\x08\x00\x02\x00\x00\x00\x00\x04\x08\x00\x01\x00\x00\x00\x00\x01"
@@ -83,15 +141,94 @@ static std::string PreroutingRule() {
       "\x04\x00\x00\x00\x00\x04\x2c\x00\x01\x80\x08\x00\x01\x00\x63\x6d\x70\x00"
       "\x20\x00\x02\x80\x08\x00\x01\x00\x00\x00\x00\x01\x08\x00\x02\x00\x00\x00"
       "\x00\x00\x0c\x00\x03\x80\x08\x00\x01\x00\x55\x66\x77\x88\x10\x00\x01\x80"
-      "\x0c\x00\x01\x00\x6e\x6f\x74\x72\x61\x63\x6b\x00\x14\x00\x01\x80\x0c\x00"
-      "\x01\x00\x63\x6f\x75\x6e\x74\x65\x72\x00\x04\x00\x02\x80\x24\x00\x01\x80"
-      "\x0a\x00\x01\x00\x71\x75\x65\x75\x65\x00\x00\x00\x14\x00\x02\x80\x06\x00"
-      "\x01\x00\x05\x39\x00\x00\x06\x00\x02\x00\x00\x01\x00\x00"s;
+      "\x0c\x00\x01\x00\x6e\x6f\x74\x72\x61\x63\x6b\x00"s;
   *(U32 *)(base.data() + 76) = lan.index;
   *(U32 *)(base.data() + 172) = wan_ip.addr;
   return base;
 }
 
+// Equivalent to:
+// counter queue num 1337-1340 fanout
+static std::string QueueRule() {
+  std::string counter =
+      "\x14\x00\x01\x80\x0c\x00\x01\x00\x63\x6f\x75\x6e\x74\x65\x72\x00\x04\x00"
+      "\x02\x80"s;
+  return counter + QueueExpression();
+}
+
+// Kernel maps used to translate the addresses of offloaded flows. Keys are
+// `OffloadKey`s & values are the new IPs.
+static constexpr char kSourceNATMap[] = "snat";
+static constexpr char kDestinationNATMap[] = "dnat";
+
+// Key of the kernel NAT maps. Matches the concatenation of
+// "meta l4proto . ip saddr . ip daddr . th sport . th dport", where each field
+// is padded to 4 bytes.
+struct OffloadKey {
+  U8 proto;
+  U8 padding0[3] = {};
+  IP source_ip;
+  IP destination_ip;
+  Big<U16> source_port;
+  U16 padding1 = 0;
+  Big<U16> destination_port;
+  U16 padding2 = 0;
+
+  bool operator==(const OffloadKey &other) const {
+    return memcmp(this, &other, sizeof(*this)) == 0;
+  }
+
+  Span<const char> Span() const { return {(const char *)this, sizeof(*this)}; }
+
+  struct Hash {
+    Size operator()(const OffloadKey &key) const {
+      return std::hash<std::string_view>()(
+          std::string_view((const char *)&key, sizeof(key)));
+    }
+  };
+};
+
+static_assert(sizeof(OffloadKey) == 20, "OffloadKey should have 20 bytes");
+
+// Equivalent to:
+// ip saddr set meta l4proto . ip saddr . ip daddr . th sport . th dport map
+//     @snat accept
+//
+// With `source` set to false, it translates the destination address instead
+// (using the "dnat" map).
+static std::string OffloadRule(bool source) {
+  std::string expr =
+      "\x24\x00\x01\x80\x09\x00\x01\x00\x6d\x65\x74\x61\x00\x00\x00\x00\x14\x00"
+      "\x02\x80\x08\x00\x02\x00\x00\x00\x00\x10\x08\x00\x01\x00\x00\x00\x00\x08"
+      "\x34\x00\x01\x80\x0c\x00\x01\x00\x70\x61\x79\x6c\x6f\x61\x64\x00\x24\x00"
+      "\x02\x80\x08\x00\x01\x00\x00\x00\x00\x09\x08\x00\x02\x00\x00\x00\x00\x01"
+      "\x08\x00\x03\x00\x00\x00\x00\x0c\x08\x00\x04\x00\x00\x00\x00\x04\x34\x00"
+      "\x01\x80\x0c\x00\x01\x00\x70\x61\x79\x6c\x6f\x61\x64\x00\x24\x00\x02\x80"
+      "\x08\x00\x01\x00\x00\x00\x00\x0a\x08\x00\x02\x00\x00\x00\x00\x01\x08\x00"
+      "\x03\x00\x00\x00\x00\x10\x08\x00\x04\x00\x00\x00\x00\x04\x34\x00\x01\x80"
+      "\x0c\x00\x01\x00\x70\x61\x79\x6c\x6f\x61\x64\x00\x24\x00\x02\x80\x08\x00"
+      "\x01\x00\x00\x00\x00\x0b\x08\x00\x02\x00\x00\x00\x00\x02\x08\x00\x03\x00"
+      "\x00\x00\x00\x00\x08\x00\x04\x00\x00\x00\x00\x02\x34\x00\x01\x80\x0c\x00"
+      "\x01\x00\x70\x61\x79\x6c\x6f\x61\x64\x00\x24\x00\x02\x80\x08\x00\x01\x00"
+      "\x00\x00\x00\x0c\x08\x00\x02\x00\x00\x00\x00\x02\x08\x00\x03\x00\x00\x00"
+      "\x00\x02\x08\x00\x04\x00\x00\x00\x00\x02\x30\x00\x01\x80\x0b\x00\x01\x00"
+      "\x6c\x6f\x6f\x6b\x75\x70\x00\x00\x20\x00\x02\x80\x09\x00\x01\x00\x73\x6e"
+      "\x61\x74\x00\x00\x00\x00\x08\x00\x02\x00\x00\x00\x00\x08\x08\x00\x03\x00"
+      "\x00\x00\x00\x01\x4c\x00\x01\x80\x0c\x00\x01\x00\x70\x61\x79\x6c\x6f\x61"
+      "\x64\x00\x3c\x00\x02\x80\x08\x00\x05\x00\x00\x00\x00\x01\x08\x00\x02\x00"
+      "\x00\x00\x00\x01\x08\x00\x03\x00\x00\x00\x00\x0c\x08\x00\x04\x00\x00\x00"
+      "\x00\x04\x08\x00\x06\x00\x00\x00\x00\x01\x08\x00\x07\x00\x00\x00\x00\x0a"
+      "\x08\x00\x08\x00\x00\x00\x00\x01\x30\x00\x01\x80\x0e\x00\x01\x00\x69\x6d"
+      "\x6d\x65\x64\x69\x61\x74\x65\x00\x00\x00\x1c\x00\x02\x80\x08\x00\x01\x00"
+      "\x00\x00\x00\x00\x10\x00\x02\x80\x0c\x00\x02\x80\x08\x00\x01\x00\x00\x00"
+      "\x00\x01"s;
+  if (!source) {
+    memcpy(expr.data() + 268, kDestinationNATMap, sizeof(kDestinationNATMap));
+    *(Big<U32> *)(expr.data() + 332) = 16; // offset of "ip daddr"
+  }
+  return expr;
+}
+
 struct NetfilterHook {
   NetfilterHook(Status &status) {
     Netlink netlink(NETLINK_NETFILTER, status);
@@ -119,8 +256,9 @@ struct NetfilterHook {
       status() += "Error while creating PREROUTING netfilter chain";
       return;
     }
-    NewRule(netlink, family, kTableName, "POSTROUTING", PostroutingRule(),
-            status);
+    SetupOffload(netlink);
+    NewRule(netlink, family, kTableName, "POSTROUTING",
+            PostroutingMatch() + QueueRule(), status);
     if (!status.Ok()) {
       status() += "Error while creating POSTROUTING netfilter rule";
       status() +=
@@ -129,8 +267,8 @@ struct NetfilterHook {
           "load kernel modules: nfnetlink-queue & nft-queue";
       return;
     }
-    NewRule(netlink, family, kTableName, "PREROUTING", PreroutingRule(),
-            status);
+    NewRule(netlink, family, kTableName, "PREROUTING",
+            PreroutingMatch() + QueueRule(), status);
     if (!status.Ok()) {
       status() += "Error while creating PREROUTING netfilter rule";
       return;
@@ -144,6 +282,38 @@ struct NetfilterHook {
     DisableOpenWRTFirewall(netlink);
   }
 
+  // True when the kernel is able to take over the NAT of established flows.
+  bool offload = false;
+
+  // Creates the maps & rules that translate the addresses of offloaded flows.
+  // They're placed before the rules that send the traffic to the firewall
+  // threads.
+  //
+  // Offloading is optional. If the kernel doesn't support it, all of the
+  // traffic keeps going through the firewall threads.
+  void SetupOffload(Netlink &netlink) {
+    if constexpr (kOffloadAfterPackets == 0) {
+      return;
+    }
+    Status status;
+    for (const char *map : {kSourceNATMap, kDestinationNATMap}) {
+      NewMap(netlink, Family::IPv4, kTableName, map, sizeof(OffloadKey),
+             sizeof(IP), true, kMaxOffloadedFlows, status);
+    }
+    NewRule(netlink, Family::IPv4, kTableName, "POSTROUTING",
+            PostroutingMatch() + OffloadRule(true), status);
+    NewRule(netlink, Family::IPv4, kTableName, "PREROUTING",
+            PreroutingMatch() + OffloadRule(false), status);
+    if (!OK(status)) {
+      AppendErrorMessage(status) +=
+          "Couldn't setup NAT offloading. All traffic will be handled in "
+          "userspace";
+      ERROR << status;
+      return;
+    }
+    offload = true;
+  }
+
   // OpenWRT ships with a firewall (called "fw4") and plenty of rules for
   // handling different types of (often malicious) traffic. We take care of all
   // of that in userspace. This function clears all of "fw4" rules so they don't
@@ -168,9 +338,10 @@ struct NetfilterHook {
 };
 
 std::optional<NetfilterHook> hook;
-std::optional<Netlink> queue;
 
-std::thread loop;
+// True when the NAT of established flows can be handed over to the kernel.
+// Firewall replays run without any netfilter hooks.
+static bool OffloadEnabled() { return hook.has_value() && hook->offload; }
 
 enum class ProtocolID : U8 {
   ICMP = 1,
@@ -206,16 +377,7 @@ struct IP_Header {
 
   void UpdateChecksum() {
     checksum = 0;
-    U32 sum = 0;
-    U16 *p = (U16 *)this;
-    U16 *end = (U16 *)((char *)this + HeaderLength());
-    for (; p < end; ++p) {
-      sum += Big(*p).big_endian;
-    }
-    while (sum >> 16) {
-      sum = (sum & 0xffff) + (sum >> 16);
-    }
-    checksum = Big<U16>(~sum).big_endian;
+    checksum = ~checksum::Sum(this, HeaderLength());
   }
 };
 
@@ -250,34 +412,86 @@ static_assert(sizeof(UDP_Header) == 8, "UDP_Header should have 8 bytes");
 
 void UpdateLayer4Checksum(IP_Header &ip, U16 &checksum) {
   checksum = 0;
-  U32 sum = 0;
   U16 header_len = ip.HeaderLength();
   U16 data_len = ip.total_length - header_len;
-  sum += ip.source_ip.halves[0];
-  sum += ip.source_ip.halves[1];
-  sum += ip.destination_ip.halves[0];
-  sum += ip.destination_ip.halves[1];
-  sum += data_len;
-  sum += (U16)ip.proto;
-  U8 *buff = (U8 *)&ip + header_len;
-  for (int i = 0; i < (data_len / 2); i++) {
-    sum += Big<U16>((buff[i * 2 + 1] << 8) | buff[i * 2]).big_endian;
+  U32 sum = checksum::Sum((U8 *)&ip + header_len, data_len);
+  // Pseudo-header. All of the values are in network byte order.
+  sum += (ip.source_ip.addr & 0xffff) + (ip.source_ip.addr >> 16);
+  sum += (ip.destination_ip.addr & 0xffff) + (ip.destination_ip.addr >> 16);
+  sum += Big<U16>(data_len).big_endian;
+  sum += Big<U16>((U16)ip.proto).big_endian;
+  checksum = ~checksum::Fold(sum);
+  if (checksum == 0 && ip.proto == ProtocolID::UDP) {
+    // Zero means that the UDP checksum was not computed.
+    checksum = 0xffff;
+  }
+}
+
+void RecomputeChecksums(Span<> packet) {
+  IP_Header &ip = *(IP_Header *)packet.data();
+  ip.UpdateChecksum();
+  char *l4 = packet.data() + ip.HeaderLength();
+  if (ip.proto == ProtocolID::TCP) {
+    UpdateLayer4Checksum(ip, ((TCP_Header *)l4)->checksum);
+  } else if (ip.proto == ProtocolID::UDP) {
+    UpdateLayer4Checksum(ip, ((UDP_Header *)l4)->checksum);
   }
-  if ((data_len % 2) == 1) {
-    sum += buff[data_len - 1] << 8;
+}
+
+// Changes one of the packet addresses & adjusts the checksums to match.
+//
+// Checksums are updated incrementally (RFC 1624) so the cost doesn't depend on
+// the packet size.
+//
+// Packets whose checksum was not yet computed (`l4_checksum_partial`) need a
+// full recomputation because nfqueue clears their CHECKSUM_PARTIAL state once
+// they are modified.
+static void RewriteAddress(IP_Header &ip, IP &address, IP new_address,
+                           U16 &l4_checksum, bool l4_checksum_partial) {
+  IP old_address = address;
+  address = new_address;
+  checksum::Adjust(ip.checksum, old_address.addr, new_address.addr);
+  if (l4_checksum_partial) {
+    UpdateLayer4Checksum(ip, l4_checksum);
+    return;
   }
-  while (sum >> 16) {
-    sum = (sum & 0xFFFF) + (sum >> 16);
+  if (ip.proto == ProtocolID::UDP) {
+    checksum::AdjustUDP(l4_checksum, old_address.addr, new_address.addr);
+  } else {
+    checksum::Adjust(l4_checksum, old_address.addr, new_address.addr);
   }
-  sum = ~sum;
-  checksum = Big<U16>(sum).big_endian;
 }
 
+void RewritePacketAddress(Span<> packet, bool source, IP new_address,
+                          bool l4_checksum_partial) {
+  IP_Header &ip = *(IP_Header *)packet.data();
+  char *l4 = packet.data() + ip.HeaderLength();
+  U16 &checksum = ip.proto == ProtocolID::TCP ? ((TCP_Header *)l4)->checksum
+                                              : ((UDP_Header *)l4)->checksum;
+  RewriteAddress(ip, source ? ip.source_ip : ip.destination_ip, new_address,
+                 checksum, l4_checksum_partial);
+}
+
+// NAT tables are shared by all of the firewall threads. Packets are distributed
+// between the queues according to the CPU that received them so the packets
+// going in opposite directions of a flow are often handled by different
+// threads.
+
 struct FullConeNAT {
   // Note: theoretically we could only store the last two bytes of the IP
   // because our network is /16. This might change in the future though and it's
   // not that much of a saving anyway so let's keep things simple.
-  IP lan_host_ip;
+  //
+  // Address in network byte order. Atomic because firewall threads may read &
+  // write it concurrently.
+  std::atomic<U32> lan_host_addr;
+
+  IP LanHostIP() const {
+    return IP(lan_host_addr.load(std::memory_order_relaxed));
+  }
+  void SetLanHostIP(IP ip) {
+    lan_host_addr.store(ip.addr, std::memory_order_relaxed);
+  }
 
   static FullConeNAT &Lookup(ProtocolID protocol, U16 local_port);
 };
@@ -289,118 +503,153 @@ FullConeNAT &FullConeNAT::Lookup(ProtocolID protocol, U16 local_port) {
   return nat_table[protocol_index][local_port];
 }
 
-struct SymmetricNAT : Expirable {
-  struct Key {
-    IP remote_ip;
-    U16 remote_port;
-    U16 local_port;
-
-    bool operator==(const Key &other) const {
-      return remote_ip == other.remote_ip && remote_port == other.remote_port &&
-             local_port == other.local_port;
-    }
+struct SymmetricNAT {
+  static constexpr std::chrono::steady_clock::duration kTTL = 30min;
 
-    Size Hash() const { return *reinterpret_cast<const size_t *>(this); }
-  } key;
-  IP local_ip;
+  using Key = NATTable::Key;
+  using Entry = NATTable::Entry;
+  using Tick = NATTable::Tick;
 
-  struct HashByRemote {
-    using is_transparent = std::true_type;
+  static constexpr Tick kTTLTicks =
+      std::chrono::duration_cast<std::chrono::seconds>(kTTL).count();
 
-    Size operator()(const SymmetricNAT *n) const { return n->key.Hash(); }
-    Size operator()(const Key &key) const { return key.Hash(); }
-  };
-
-  struct EqualByRemote {
-    using is_transparent = std::true_type;
-
-    bool operator()(const SymmetricNAT *a, const SymmetricNAT *b) const {
-      return a->key == b->key;
-    }
+  static Tick ToTick(std::chrono::steady_clock::time_point time) {
+    // Steady clock starts at boot so 32 bits of seconds are plenty. +1 because
+    // tick 0 is reserved for empty slots.
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               time.time_since_epoch())
+               .count() +
+           1;
+  }
 
-    bool operator()(const Key &a, const SymmetricNAT *b) const {
-      return a == b->key;
+  // Symmetric NAT entries are spread across shards (by flow hash). Each shard
+  // has its own lock so firewall threads rarely contend with each other.
+  struct Shard {
+    std::mutex mutex;
+    NATTable table;
+
+    // Creates a new entry or keeps the existing one alive for another
+    // `kTTL`. Must be called with `mutex` held.
+    //
+    // Returns nullptr if the shard is full.
+    Entry *Refresh(const Key &key, IP local_ip, Tick now) {
+      Entry *entry = table.FindOrInsert(key, local_ip, now);
+      if (entry) {
+        entry->expiration = now + kTTLTicks;
+      }
+      return entry;
     }
   };
 
-  static std::unordered_set<SymmetricNAT *, HashByRemote, EqualByRemote> table;
+  static constexpr int kShardBits = 6;
+  static Shard shards[1 << kShardBits];
 
-  SymmetricNAT(Key key, IP local_ip)
-      : Expirable(30min), key(key), local_ip(local_ip) {
-    table.insert(this);
+  static Shard &ShardFor(const Key &key) {
+    // Fibonacci hashing - mixes the bits of the key so that all of them affect
+    // the shard index.
+    return shards[(key.Hash() * 0x9E3779B97F4A7C15ull) >> (64 - kShardBits)];
   }
-  ~SymmetricNAT() { table.erase(this); }
 };
 
-std::unordered_set<SymmetricNAT *, SymmetricNAT::HashByRemote,
-                   SymmetricNAT::EqualByRemote>
-    SymmetricNAT::table;
+SymmetricNAT::Shard SymmetricNAT::shards[1 << kShardBits];
 
+// Maps LAN IPs to MACs. Written by the firewall threads whenever a LAN host
+// sends something to the Internet & read when packets come back.
+std::shared_mutex local_ip_to_mac_mutex;
 std::unordered_map<IP, MAC> local_ip_to_mac;
 
-// Using pipes for inter-thread communication is rather inefficient but at the
-// time this was written, the epoll namespace didn't had any purely-userspace
-// mechanism to do it.
+static Optional<MAC> LocalMAC(IP local_ip) {
+  std::shared_lock lock(local_ip_to_mac_mutex);
+  auto it = local_ip_to_mac.find(local_ip);
+  if (it == local_ip_to_mac.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+// Flows whose NAT was offloaded to the kernel (see `kOffloadAfterPackets`).
 //
-// If this ever becomes a performance bottleneck, then one solution might be to
-// switch the main thread to wait on a task queue instead of epoll. A secondary
-// thread would wait for the epoll events and push them to the task queue.
-struct RecordTrafficPipe : epoll::Listener {
-  FD write_fd;
+// Their packets no longer reach the firewall threads so their traffic is
+// periodically collected from the counters of the kernel map elements.
+struct OffloadedFlow {
+  MAC local_mac;
+  // Last seen values of the kernel counters.
+  U64 up_bytes = 0;
+  U64 down_bytes = 0;
+  std::chrono::steady_clock::time_point last_active;
+};
 
-  void Setup(Status &status) {
-    int pipe_fds[2];
-    if (pipe(pipe_fds) == -1) {
-      AppendErrorMessage(status) +=
-          "Couldn't create pipes for the firewall loop";
-      return;
-    }
-    fd = pipe_fds[0];
-    write_fd = pipe_fds[1];
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
-    epoll::Add(this, status);
-  }
+// Indexed by the keys of the "snat" map elements.
+//
+// Firewall threads insert the flows here & pass them to the main thread, which
+// adds them to the kernel maps. Limited to `kMaxOffloadedFlows`.
+std::mutex offloaded_flows_mutex;
+std::unordered_map<OffloadKey, OffloadedFlow, OffloadKey::Hash>
+    offloaded_flows;
+
+// Used by the main thread to manage the offloaded flows. Opened on first use.
+Optional<Netlink> offload_netlink;
+
+static OffloadKey SourceNATKey(U8 proto, IP local_ip,
+                               const SymmetricNAT::Key &key) {
+  return OffloadKey{
+      .proto = proto,
+      .source_ip = local_ip,
+      .destination_ip = key.remote_ip,
+      .source_port = key.local_port,
+      .destination_port = key.remote_port,
+  };
+}
 
-  struct RecordTrafficMessage {
-    MAC local_host;
-    IP remote_ip;
-    U32 up;
-    U32 down;
+// Key of the packets that come back from the Internet.
+static OffloadKey DestinationNATKey(const OffloadKey &snat_key) {
+  return OffloadKey{
+      .proto = snat_key.proto,
+      .source_ip = snat_key.destination_ip,
+      .destination_ip = wan_ip,
+      .source_port = snat_key.destination_port,
+      .destination_port = snat_key.source_port,
   };
+}
 
-  void NotifyRead(Status &status) override {
-    while (true) {
-      RecordTrafficMessage msg;
-      SSize read_bytes = read(fd, &msg, sizeof(msg));
-      if (read_bytes == 0) { // EOF
-        epoll::Del(this, status);
-        break;
-      } else if (read_bytes == -1) { // Nothing to read / Error
-        if (errno == EWOULDBLOCK) {
-          errno = 0;
-          break;
-        }
-        AppendErrorMessage(status) += "read()";
-        epoll::Del(this, status);
-        break;
-      } else if (read_bytes < sizeof(RecordTrafficMessage)) { // Not enough data
-        break;
-      } else { // Got a full entry
-        RecordTraffic(msg.local_host, msg.remote_ip, msg.up, msg.down);
-      }
+struct RecordTrafficMessage {
+  std::chrono::system_clock::time_point tick;
+  MAC local_host;
+  IP remote_ip;
+  U32 up;
+  U32 down;
+};
+
+// Wakes up the main thread when the firewall threads have some traffic to
+// record or flows to offload.
+//
+// The work itself is passed through the `Worker::traffic` & `Worker::offloads`
+// rings. The eventfd is only signalled when a ring goes from empty to non-empty
+// so under load most of the packets don't need any syscalls.
+struct MainThreadQueue : epoll::Listener {
+  // Limit on the number of records taken from a single ring before other
+  // epoll events get a chance to run.
+  static constexpr Size kMaxDrain = 4096;
+
+  void Setup(Status &status) {
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+      AppendErrorMessage(status) += "eventfd()";
     }
   }
 
-  // This method should be called from the Firewall thread only.
-  void FirewallRecordTraffic(MAC local_mac, IP remote_ip, U32 up, U32 down) {
-    RecordTrafficMessage msg{local_mac, remote_ip, up, down};
-    write(write_fd, &msg, sizeof(msg));
+  // Can be called from any thread.
+  void Wake() {
+    U64 one = 1;
+    write(fd, &one, sizeof(one));
   }
 
-  const char *Name() const override { return "firewall::RecordTrafficPipe"; }
+  void NotifyRead(Status &status) override;
+
+  const char *Name() const override { return "firewall::MainThreadQueue"; }
 };
 
-RecordTrafficPipe pipe;
+MainThreadQueue main_thread_queue;
 
 static void LogPacket(U32 packet_id, IP_Header &ip, TCP_Header &tcp,
                       UDP_Header &udp, Span<> payload, const char *action) {
@@ -419,7 +668,190 @@ static void LogPacket(U32 packet_id, IP_Header &ip, TCP_Header &tcp,
       << action;
 }
 
-void OnReceive(nfgenmsg &msg, Netlink::Attrs attr_seq) {
+// Each firewall thread owns one nfqueue.
+//
+// Packets are received in batches. Verdicts for the whole batch are sent
+// together, once all of its packets are processed.
+struct Worker {
+  // Limit on the size of a single verdict packet. Netlink sockets reject
+  // packets that don't fit in their send buffer (64 KiB, doubled by the
+  // kernel).
+  static constexpr Size kMaxVerdictBytes = 64 * 1024;
+
+  U16 index;
+  Big<U16> queue_number;
+  Optional<Netlink> queue;
+  std::thread thread;
+  std::atomic_int tid = 0;
+
+  // Packets of the current batch that were modified. Each of them needs its own
+  // verdict, carrying the new payload.
+  struct ModifiedPacket {
+    Verdict verdict;
+    Netlink::Attr *payload;
+  };
+  Vec<ModifiedPacket> modified_packets;
+  Size modified_bytes = 0;
+
+  // ID of the last packet that can be accepted without modifications.
+  // Accepting it with NFQNL_MSG_VERDICT_BATCH accepts all of the earlier
+  // packets as well.
+  Optional<U32> accepted_packet_id;
+
+  // Number of batches received, indexed by the number of packets in a batch.
+  std::atomic<U64> batch_sizes[Netlink::kMaxBatch + 1] = {};
+
+  // Traffic of the current `kTrafficLogResolution` tick, summed per local host
+  // & remote IP. Passed to the main thread once the tick ends.
+  struct TrafficEndpoints {
+    MAC local_host;
+    IP remote_ip;
+
+    bool operator==(const TrafficEndpoints &) const = default;
+
+    struct Hash {
+      Size operator()(const TrafficEndpoints &e) const {
+        return std::hash<MAC>()(e.local_host) * 31 +
+               std::hash<IP>()(e.remote_ip);
+      }
+    };
+  };
+  std::unordered_map<TrafficEndpoints, TrafficBytes, TrafficEndpoints::Hash>
+      tick_traffic;
+  std::chrono::system_clock::time_point traffic_tick;
+
+  // Traffic waiting to be recorded by the main thread.
+  SPSCRing<RecordTrafficMessage, 4096> traffic;
+  // Number of traffic records dropped because `traffic` was full.
+  std::atomic<U64> traffic_overflows = 0;
+
+  // Flows waiting to be added to the kernel maps by the main thread. Keys of
+  // their "snat" map elements.
+  SPSCRing<OffloadKey, 256> offloads;
+
+  Worker(U16 index) : index(index), queue_number(kQueueNumber + index) {}
+
+  void Loop();
+  int ProcessBatch(Status &status);
+  void OnReceive(nfgenmsg &msg, Netlink::Attrs attr_seq);
+  void Modified(U32 packet_id_be32, Netlink::Attr &payload);
+  void QueueTraffic(MAC local_mac, IP remote_ip, U32 up, U32 down);
+  void FlushTraffic(std::chrono::system_clock::time_point now);
+  void Offload(ProtocolID proto, const SymmetricNAT::Key &key, IP local_ip);
+  void SendModifiedVerdicts(Status &status);
+  void SendVerdicts(Status &status);
+};
+
+Vec<UniquePtr<Worker>> workers;
+
+void Worker::QueueTraffic(MAC local_mac, IP remote_ip, U32 up, U32 down) {
+  FlushTraffic(std::chrono::system_clock::now());
+  TrafficBytes &bytes = tick_traffic[{local_mac, remote_ip}];
+  bytes.up += up;
+  bytes.down += down;
+}
+
+// Passes the traffic of the previous tick to the main thread. Does nothing
+// until the tick ends.
+void Worker::FlushTraffic(std::chrono::system_clock::time_point now) {
+  auto tick = TrafficLogTick(now);
+  if (tick == traffic_tick) {
+    return;
+  }
+  bool wake = false;
+  for (auto &[endpoints, bytes] : tick_traffic) {
+    bool was_empty;
+    if (!traffic.Push({traffic_tick, endpoints.local_host, endpoints.remote_ip,
+                       bytes.up, bytes.down},
+                      was_empty)) {
+      traffic_overflows.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    wake |= was_empty;
+  }
+  tick_traffic.clear();
+  traffic_tick = tick;
+  if (wake) {
+    main_thread_queue.Wake();
+  }
+}
+
+// Limit on the number of flows added to the kernel maps in a single nftables
+// transaction. Keeps the netlink messages well below the socket buffer size.
+static constexpr Size kMaxOffloadBatch = 256;
+
+// Adds the flows to the kernel maps. Flows that couldn't be added are handled
+// by the firewall threads again.
+//
+// Runs on the main thread.
+static void AddOffloadedFlows(Span<const OffloadKey> snat_keys) {
+  IP wan = wan_ip;
+  Vec<OffloadKey> dnat_keys;
+  Vec<MapElement> snat, dnat;
+  for (auto &snat_key : snat_keys) {
+    dnat_keys.push_back(DestinationNATKey(snat_key));
+  }
+  for (Size i = 0; i < snat_keys.size(); ++i) {
+    snat.push_back({.key = snat_keys[i].Span(),
+                    .data = {(const char *)&wan, sizeof(wan)}});
+    dnat.push_back({.key = dnat_keys[i].Span(),
+                    .data = {(const char *)&snat_keys[i].source_ip,
+                             sizeof(IP)}});
+  }
+  Status status;
+  if (!offload_netlink.has_value()) {
+    offload_netlink.emplace(NETLINK_NETFILTER, status);
+  }
+  if (OK(status)) {
+    MapElements maps[] = {{kSourceNATMap, snat}, {kDestinationNATMap, dnat}};
+    NewMapElements(*offload_netlink, Family::IPv4, kTableName, maps, status);
+  }
+  if (!OK(status)) {
+    AppendErrorMessage(status) +=
+        f("Couldn't offload %zu flows to the kernel", snat_keys.size());
+    ERROR << status;
+    offload_netlink.reset();
+    std::lock_guard lock(offloaded_flows_mutex);
+    for (auto &snat_key : snat_keys) {
+      offloaded_flows.erase(snat_key);
+    }
+  }
+}
+
+void MainThreadQueue::NotifyRead(Status &status) {
+  U64 signals;
+  read(fd, &signals, sizeof(signals));
+  Vec<OffloadKey> offloads;
+  for (auto &worker : workers) {
+    OffloadKey keys[64];
+    while (Size n = worker->offloads.Pop(keys, std::size(keys))) {
+      offloads.insert(offloads.end(), keys, keys + n);
+    }
+  }
+  for (Size i = 0; i < offloads.size(); i += kMaxOffloadBatch) {
+    AddOffloadedFlows(Span<const OffloadKey>(
+        offloads.data() + i, std::min(kMaxOffloadBatch, offloads.size() - i)));
+  }
+  RecordTrafficMessage batch[64];
+  for (auto &worker : workers) {
+    Size drained = 0;
+    while (Size n = worker->traffic.Pop(batch, std::size(batch))) {
+      for (Size i = 0; i < n; ++i) {
+        RecordTraffic(batch[i].tick, batch[i].local_host, batch[i].remote_ip,
+                      batch[i].up, batch[i].down);
+      }
+      drained += n;
+      if (drained >= kMaxDrain) {
+        // The ring is still non-empty so its worker won't signal us. Come
+        // back after handling the other events.
+        Wake();
+        break;
+      }
+    }
+  }
+}
+
+void Worker::OnReceive(nfgenmsg &msg, Netlink::Attrs attr_seq) {
   Netlink::Attr *attrs[NFQA_MAX + 1]{};
   for (auto &attr : attr_seq) {
     if (attr.type > NFQA_MAX) {
@@ -434,8 +866,6 @@ void OnReceive(nfgenmsg &msg, Netlink::Attrs attr_seq) {
   nfqnl_msg_packet_hdr &phdr =
       attrs[NFQA_PACKET_HDR]->As<nfqnl_msg_packet_hdr>();
 
-  netfilter::Verdict verdict(phdr.packet_id, true);
-
   if (attrs[NFQA_PAYLOAD] == nullptr) {
     ERROR << "NFQA_PAYLOAD is missing";
     return;
@@ -454,45 +884,63 @@ void OnReceive(nfgenmsg &msg, Netlink::Attrs attr_seq) {
   UDP_Header &udp = *(UDP_Header *)(&inet);
 
   auto &checksum = ip.proto == ProtocolID::TCP ? tcp.checksum : udp.checksum;
+  bool checksum_partial =
+      attrs[NFQA_SKB_INFO] != nullptr &&
+      (attrs[NFQA_SKB_INFO]->As<Big<U32>>().Get() & NFQA_SKB_CSUMNOTREADY);
   int socket_type = ip.proto == ProtocolID::TCP ? SOCK_STREAM : SOCK_DGRAM;
 
-  Expirable::Expire();
+  auto now = std::chrono::steady_clock::now();
+  bool offload = false;
 
   if (ip.destination_ip == wan_ip && !from_lan && has_ports) {
     // Packet coming to our WAN IP from outside of LAN.
     // We may need to modify the destination (NAT demangling).
 
     // Attempt to find a matching entry in the Symmetric NAT table.
-    auto it = SymmetricNAT::table.find<SymmetricNAT::Key>(
-        {ip.source_ip, inet.source_port, inet.destination_port});
-    if (it != SymmetricNAT::table.end()) {
-      // Found a matching entry. Keep this entry for the next 30 minutes.
-      (*it)->UpdateExpiration(30min);
+    SymmetricNAT::Key key{ip.source_ip, inet.source_port,
+                          inet.destination_port};
+    SymmetricNAT::Shard &shard = SymmetricNAT::ShardFor(key);
+    Optional<IP> symmetric_ip;
+    {
+      std::lock_guard lock(shard.mutex);
+      SymmetricNAT::Tick tick = SymmetricNAT::ToTick(now);
+      if (SymmetricNAT::Entry *entry = shard.table.Find(key, tick)) {
+        // Found a matching entry. Keep this entry for the next 30 minutes.
+        entry->expiration = tick + SymmetricNAT::kTTLTicks;
+        symmetric_ip = entry->local_ip;
+        offload = ++entry->packets == kOffloadAfterPackets;
+      }
+    }
+    if (offload && OffloadEnabled()) {
+      Offload(ip.proto, key, *symmetric_ip);
+    }
+    if (symmetric_ip.has_value()) {
       // Mangle the destination IP to point at the LAN IP
       if constexpr (kLogNatPackets) {
-        Str action = f("symmetric NAT to %s", ToStr((*it)->local_ip).c_str());
+        Str action = f("symmetric NAT to %s", ToStr(*symmetric_ip).c_str());
         LogPacket(phdr.packet_id, ip, tcp, udp, payload, action.c_str());
       }
-      ip.destination_ip = (*it)->local_ip;
+      RewriteAddress(ip, ip.destination_ip, *symmetric_ip, checksum,
+                     checksum_partial);
       packet_modified = true;
     } else {
       // If no Symmetric NAT entry exists, try the Full Cone NAT table.
-      FullConeNAT &fullcone =
-          FullConeNAT::Lookup(ip.proto, inet.destination_port);
-      if (fullcone.lan_host_ip.addr != 0) {
+      IP fullcone_ip =
+          FullConeNAT::Lookup(ip.proto, inet.destination_port).LanHostIP();
+      if (fullcone_ip.addr != 0) {
         if constexpr (kLogNatPackets) {
           LogPacket(phdr.packet_id, ip, tcp, udp, payload, "fullcone NAT");
         }
-        ip.destination_ip = fullcone.lan_host_ip;
+        RewriteAddress(ip, ip.destination_ip, fullcone_ip, checksum,
+                       checksum_partial);
         packet_modified = true;
       }
     }
 
     if (packet_modified) {
-      auto it = local_ip_to_mac.find(ip.destination_ip);
-      if (it != local_ip_to_mac.end()) {
-        MAC &mac = it->second;
-        pipe.FirewallRecordTraffic(mac, ip.source_ip, 0, payload.size());
+      Optional<MAC> mac = LocalMAC(ip.destination_ip);
+      if (mac.has_value()) {
+        QueueTraffic(*mac, ip.source_ip, 0, payload.size());
       }
     }
   } else if (from_lan && to_internet && ip.source_ip != lan_ip && has_ports) {
@@ -502,66 +950,165 @@ void OnReceive(nfgenmsg &msg, Netlink::Attrs attr_seq) {
     if (attrs[NFQA_HWADDR] != nullptr) {
       nfqnl_msg_packet_hw &hw = attrs[NFQA_HWADDR]->As<nfqnl_msg_packet_hw>();
       MAC &mac = *(MAC *)hw.hw_addr;
-      local_ip_to_mac[ip.source_ip] = mac;
-      pipe.FirewallRecordTraffic(mac, ip.destination_ip, payload.size(), 0);
+      bool known_mac;
+      {
+        std::shared_lock lock(local_ip_to_mac_mutex);
+        auto it = local_ip_to_mac.find(ip.source_ip);
+        known_mac = it != local_ip_to_mac.end() && it->second == mac;
+      }
+      if (!known_mac) {
+        std::unique_lock lock(local_ip_to_mac_mutex);
+        local_ip_to_mac[ip.source_ip] = mac;
+      }
+      QueueTraffic(mac, ip.destination_ip, payload.size(), 0);
     }
 
     // Record the original source IP in the Full Cone NAT table.
     // New packets from unknown sources will be sent to this LAN IP.
-    FullConeNAT &fullcone = FullConeNAT::Lookup(ip.proto, inet.source_port);
-    fullcone.lan_host_ip = ip.source_ip;
+    FullConeNAT::Lookup(ip.proto, inet.source_port).SetLanHostIP(ip.source_ip);
 
     // Record the original source IP in the Symmetric NAT table.
     // New packets from this destination will be sent back to this LAN IP.
-    auto it = SymmetricNAT::table.find<SymmetricNAT::Key>(
-        {ip.destination_ip, inet.destination_port, inet.source_port});
-    if (it == SymmetricNAT::table.end()) {
-      new SymmetricNAT(SymmetricNAT::Key{ip.destination_ip,
-                                         inet.destination_port,
-                                         inet.source_port},
-                       ip.source_ip);
-    } else {
-      (*it)->UpdateExpiration(30min);
+    SymmetricNAT::Key key{ip.destination_ip, inet.destination_port,
+                          inet.source_port};
+    SymmetricNAT::Shard &shard = SymmetricNAT::ShardFor(key);
+    {
+      std::lock_guard lock(shard.mutex);
+      SymmetricNAT::Entry *entry =
+          shard.Refresh(key, ip.source_ip, SymmetricNAT::ToTick(now));
+      // When the table is full the reply packets fall back to the Full Cone
+      // NAT.
+      offload = entry && ++entry->packets == kOffloadAfterPackets;
+    }
+    if (offload && OffloadEnabled()) {
+      Offload(ip.proto, key, ip.source_ip);
     }
 
     if constexpr (kLogNatPackets) {
       LogPacket(phdr.packet_id, ip, tcp, udp, payload, "source NAT");
     }
     // Mangle the source IP to point back at our WAN IP
-    ip.source_ip = wan_ip;
+    RewriteAddress(ip, ip.source_ip, wan_ip, checksum, checksum_partial);
     packet_modified = true;
   }
 
-  Status status;
   if (packet_modified) {
-    ip.UpdateChecksum();
-    UpdateLayer4Checksum(ip, checksum);
-    queue->SendWithAttr(verdict, *attrs[NFQA_PAYLOAD], status);
+    Modified(phdr.packet_id, *attrs[NFQA_PAYLOAD]);
   } else {
-    queue->Send(verdict, status);
+    accepted_packet_id = (U32)phdr.packet_id;
     if constexpr (kLogPassthroughPackets) {
       LogPacket(phdr.packet_id, ip, tcp, udp, payload, "passthrough");
     }
   }
-  if (!status.Ok()) {
-    status() += "Couldn't send verdict";
-    ERROR << status;
+}
+
+// Hands over the NAT of a flow to the kernel.
+//
+// The flow is only reserved here. The main thread adds it to the kernel maps so
+// that the firewall threads never wait for nftables.
+void Worker::Offload(ProtocolID proto, const SymmetricNAT::Key &key,
+                     IP local_ip) {
+  Optional<MAC> mac = LocalMAC(local_ip);
+  if (!mac.has_value()) {
+    return; // Traffic couldn't be attributed to any device.
+  }
+  OffloadKey snat_key = SourceNATKey((U8)proto, local_ip, key);
+  {
+    std::lock_guard lock(offloaded_flows_mutex);
+    if (offloaded_flows.size() >= kMaxOffloadedFlows) {
+      return; // The flow stays in userspace.
+    }
+    auto [it, inserted] = offloaded_flows.try_emplace(
+        snat_key,
+        OffloadedFlow{.local_mac = *mac,
+                      .last_active = std::chrono::steady_clock::now()});
+    if (!inserted) {
+      return;
+    }
+  }
+  bool was_empty;
+  if (!offloads.Push(snat_key, was_empty)) {
+    std::lock_guard lock(offloaded_flows_mutex);
+    offloaded_flows.erase(snat_key);
+    return;
+  }
+  if (was_empty) {
+    main_thread_queue.Wake();
+  }
+}
+
+void Worker::Modified(U32 packet_id_be32, Netlink::Attr &payload) {
+  Size bytes = sizeof(Verdict) + NLA_ALIGN(payload.len);
+  if (modified_bytes + bytes > kMaxVerdictBytes) {
+    Status status;
+    SendModifiedVerdicts(status);
+    if (!OK(status)) {
+      AppendErrorMessage(status) += "Couldn't send verdicts";
+      ERROR << status;
+    }
+  }
+  modified_packets.push_back({
+      .verdict = Verdict(packet_id_be32, true, queue_number),
+      .payload = &payload,
+  });
+  modified_bytes += bytes;
+}
+
+// Sends the verdicts of modified packets in a single netlink packet.
+void Worker::SendModifiedVerdicts(Status &status) {
+  if (modified_packets.empty()) {
+    return;
+  }
+  static const char kPadding[NLA_ALIGNTO] = {};
+  iovec iov[modified_packets.size() * 3];
+  Size iov_count = 0;
+  for (auto &[verdict, payload] : modified_packets) {
+    verdict.nlmsg_seq = queue->seq++;
+    verdict.nlmsg_len = sizeof(verdict) + payload->len;
+    iov[iov_count++] = {.iov_base = &verdict, .iov_len = sizeof(verdict)};
+    iov[iov_count++] = {.iov_base = payload, .iov_len = payload->len};
+    if (Size padding = NLA_ALIGN(payload->len) - payload->len) {
+      iov[iov_count++] = {.iov_base = (void *)kPadding, .iov_len = padding};
+    }
   }
+  modified_packets.clear();
+  modified_bytes = 0;
+  queue->SendRaw(Span<const iovec>(iov, iov_count), status);
 }
 
-std::atomic_int loop_tid = 0;
+// Sends the verdicts for all of the packets of the current batch.
+//
+// Verdicts of the modified packets must be sent first - otherwise the batch
+// verdict could accept them in their original form.
+void Worker::SendVerdicts(Status &status) {
+  SendModifiedVerdicts(status);
+  if (accepted_packet_id.has_value()) {
+    VerdictBatch verdict(*accepted_packet_id, true, queue_number);
+    accepted_packet_id.reset();
+    queue->Send(verdict, status);
+  }
+}
 
-bool stop = false;
+std::atomic_bool stop = false;
 
 static void sig_handler(int signum) { stop = true; }
 
-void Loop() {
-  prctl(PR_SET_NAME, "Firewall loop", 0, 0, 0);
-  loop_tid = gettid();
+void Worker::Loop() {
+  Str thread_name = f("Firewall #%d", index);
+  prctl(PR_SET_NAME, thread_name.c_str(), 0, 0, 0);
+  tid = gettid();
+  // Nfqueue "fanout" sends the packets received by CPU `n` to the queue number
+  // `n % queue_count`. Keeping this thread on the same CPUs avoids bouncing the
+  // packets between CPU caches.
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int cpu = index; cpu < CPU_SETSIZE; cpu += queue_count) {
+    CPU_SET(cpu, &cpus);
+  }
+  sched_setaffinity(0, sizeof(cpus), &cpus);
   while (!stop) {
     Status status;
-    queue->ReceiveT<NFNL_SUBSYS_QUEUE << 8 | NFQNL_MSG_PACKET, nfgenmsg>(
-        OnReceive, status);
+    ProcessBatch(status);
     if (!stop && !status.Ok()) {
       status() += "Firewall failed to receive message from kernel";
       ERROR << status;
@@ -569,31 +1116,234 @@ void Loop() {
   }
 }
 
-void Start(Status &status) {
-  pipe.Setup(status);
+// Receives a batch of packets, processes them & sends back their verdicts.
+//
+// Returns the number of received netlink packets. Only the receive errors are
+// reported through `status`. Other errors are logged.
+int Worker::ProcessBatch(Status &status) {
+  int batch_size =
+      queue->ReceiveBatchT<NFNL_SUBSYS_QUEUE << 8 | NFQNL_MSG_PACKET, nfgenmsg>(
+          [&](nfgenmsg &msg, Netlink::Attrs attrs) { OnReceive(msg, attrs); },
+          status);
+  if (batch_size > 0) {
+    batch_sizes[batch_size].fetch_add(1, std::memory_order_relaxed);
+  }
+  Status verdict_status;
+  SendVerdicts(verdict_status);
+  if (!verdict_status.Ok()) {
+    verdict_status() += "Couldn't send verdicts";
+    ERROR << verdict_status;
+  }
+  if (!tick_traffic.empty()) {
+    FlushTraffic(std::chrono::system_clock::now());
+  }
+  return batch_size;
+}
+
+Optional<Timer> offload_timer;
+
+// Collects the traffic of offloaded flows from the kernel & removes the flows
+// that were inactive for longer than `SymmetricNAT::kTTL`.
+//
+// Runs on the main thread.
+static void PollOffloadedFlows() {
+  struct Traffic {
+    MAC local_mac;
+    IP remote_ip;
+    U32 up;
+    U32 down;
+  };
+  Vec<Traffic> traffic;
+  auto now = std::chrono::steady_clock::now();
+  Status status;
+  if (!offload_netlink.has_value()) {
+    offload_netlink.emplace(NETLINK_NETFILTER, status);
+  }
+  if (OK(status)) {
+    GetMapElements(
+        *offload_netlink, Family::IPv4, kTableName, kSourceNATMap,
+        [&](Span<> key, Span<> data, U64 packets, U64 bytes) {
+          if (key.size() != sizeof(OffloadKey)) {
+            return;
+          }
+          OffloadKey &snat_key = *(OffloadKey *)key.data();
+          std::lock_guard lock(offloaded_flows_mutex);
+          auto it = offloaded_flows.find(snat_key);
+          if (it == offloaded_flows.end() || bytes <= it->second.up_bytes) {
+            return;
+          }
+          OffloadedFlow &flow = it->second;
+          traffic.push_back({flow.local_mac, snat_key.destination_ip,
+                             (U32)(bytes - flow.up_bytes), 0});
+          flow.up_bytes = bytes;
+          flow.last_active = now;
+        },
+        status);
+  }
+  if (OK(status)) {
+    GetMapElements(
+        *offload_netlink, Family::IPv4, kTableName, kDestinationNATMap,
+        [&](Span<> key, Span<> data, U64 packets, U64 bytes) {
+          if (key.size() != sizeof(OffloadKey) || data.size() != sizeof(IP)) {
+            return;
+          }
+          OffloadKey &dnat_key = *(OffloadKey *)key.data();
+          IP local_ip = *(IP *)data.data();
+          OffloadKey snat_key = SourceNATKey(
+              dnat_key.proto, local_ip,
+              SymmetricNAT::Key{dnat_key.source_ip, dnat_key.source_port,
+                                dnat_key.destination_port});
+          std::lock_guard lock(offloaded_flows_mutex);
+          auto it = offloaded_flows.find(snat_key);
+          if (it == offloaded_flows.end() || bytes <= it->second.down_bytes) {
+            return;
+          }
+          OffloadedFlow &flow = it->second;
+          traffic.push_back({flow.local_mac, dnat_key.source_ip, 0,
+                             (U32)(bytes - flow.down_bytes)});
+          flow.down_bytes = bytes;
+          flow.last_active = now;
+        },
+        status);
+  }
   if (!OK(status)) {
-    AppendErrorMessage(status) += "Couldn't setup pipe for recording traffic";
+    AppendErrorMessage(status) += "Couldn't read the offloaded flows";
+    ERROR << status;
+    offload_netlink.reset();
     return;
   }
 
-  hook.emplace(status);
-  if (!status.Ok()) {
-    hook.reset();
+  Vec<OffloadKey> expired_snat, expired_dnat;
+  {
+    std::lock_guard lock(offloaded_flows_mutex);
+    for (auto it = offloaded_flows.begin(); it != offloaded_flows.end();) {
+      auto &[snat_key, flow] = *it;
+      SymmetricNAT::Key key{snat_key.destination_ip, snat_key.destination_port,
+                            snat_key.source_port};
+      if (flow.last_active + SymmetricNAT::kTTL < now) {
+        expired_snat.push_back(snat_key);
+        expired_dnat.push_back(DestinationNATKey(snat_key));
+        it = offloaded_flows.erase(it);
+        continue;
+      }
+      if (flow.last_active == now) {
+        // Keep the userspace NAT entry alive, in case the flow returns to the
+        // firewall threads.
+        SymmetricNAT::Shard &shard = SymmetricNAT::ShardFor(key);
+        std::lock_guard shard_lock(shard.mutex);
+        shard.Refresh(key, snat_key.source_ip, SymmetricNAT::ToTick(now));
+      }
+      ++it;
+    }
+  }
+  if (!expired_snat.empty()) {
+    Vec<Span<const char>> snat_keys, dnat_keys;
+    for (Size i = 0; i < expired_snat.size(); ++i) {
+      snat_keys.push_back(expired_snat[i].Span());
+      dnat_keys.push_back(expired_dnat[i].Span());
+    }
+    DelMapElements(*offload_netlink, Family::IPv4, kTableName, kSourceNATMap,
+                   snat_keys, status);
+    DelMapElements(*offload_netlink, Family::IPv4, kTableName,
+                   kDestinationNATMap, dnat_keys, status);
+    if (!OK(status)) {
+      AppendErrorMessage(status) += "Couldn't remove expired offloaded flows";
+      ERROR << status;
+    }
+  }
+
+  for (auto &t : traffic) {
+    RecordTraffic(t.local_mac, t.remote_ip, t.up, t.down);
+  }
+}
+
+static U16 ThreadCount() {
+  if (char *env = getenv("FIREWALL_THREADS")) {
+    int n = atoi(env);
+    if (n > 0 && n <= 256) {
+      return n;
+    }
+    ERROR << "FIREWALL_THREADS should be a number between 1 and 256. Got \""
+          << env << "\". Ignoring it.";
+  }
+  return std::clamp(std::thread::hardware_concurrency(), 1u, 256u);
+}
+
+static U32 QueueLength() {
+  if (char *env = getenv("FIREWALL_QUEUE_LENGTH")) {
+    int n = atoi(env);
+    if (n >= 16 && n <= 65536) {
+      return n;
+    }
+    ERROR << "FIREWALL_QUEUE_LENGTH should be a number between 16 and 65536. "
+             "Got \""
+          << env << "\". Ignoring it.";
+  }
+  return kDefaultQueueLength;
+}
+
+void Start(Status &status) {
+  main_thread_queue.Setup(status);
+  if (OK(status)) {
+    epoll::Add(&main_thread_queue, status);
+  }
+  if (!OK(status)) {
+    AppendErrorMessage(status) += "Couldn't setup queue for the main thread";
     return;
   }
 
-  queue.emplace(NETLINK_NETFILTER, status);
+  queue_count = ThreadCount();
+  queue_length = QueueLength();
+  fail_open = getenv("FIREWALL_FAIL_OPEN") != nullptr;
+
+  hook.emplace(status);
   if (!status.Ok()) {
-    queue.reset();
     hook.reset();
     return;
   }
 
-  Bind bind;
-  queue->Send(bind, status);
+  for (U16 i = 0; i < queue_count; ++i) {
+    Worker &worker = *workers.emplace_back(new Worker(i));
+    worker.queue.emplace(NETLINK_NETFILTER, status);
+    if (!status.Ok()) {
+      AppendErrorMessage(status) +=
+          f("Couldn't open nfqueue %d", worker.queue_number.Get());
+      workers.clear();
+      hook.reset();
+      return;
+    }
+
+    Bind bind(worker.queue_number);
+    worker.queue->Send(bind, status);
+
+    CopyPacket copy_packet(worker.queue_number, queue_length, fail_open);
+    worker.queue->Send(copy_packet, status);
+
+    // Room for the whole queue. Otherwise the packets are dropped (ENOBUFS)
+    // before the queue fills up. SO_RCVBUFFORCE ignores the system-wide limit
+    // (net.core.rmem_max) but requires CAP_NET_ADMIN.
+    int rcvbuf = queue_length * kReceiveBufferPerPacket;
+    if (setsockopt(worker.queue->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+                   sizeof(rcvbuf)) == -1) {
+      Status rcvbuf_status;
+      AppendErrorMessage(rcvbuf_status) +=
+          f("Couldn't enlarge the receive buffer of nfqueue %d",
+            worker.queue_number.Get());
+      ERROR << rcvbuf_status;
+    }
 
-  CopyPacket copy_packet;
-  queue->Send(copy_packet, status);
+    // Wake up periodically to pass the accumulated traffic to the main
+    // thread, even when no packets arrive.
+    timeval timeout = {
+        .tv_usec = std::chrono::microseconds(kTrafficLogResolution).count()};
+    if (setsockopt(worker.queue->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout)) == -1) {
+      AppendErrorMessage(status) += "setsockopt(SO_RCVTIMEO)";
+      workers.clear();
+      hook.reset();
+      return;
+    }
+  }
 
   // Use SIGUSR1 to stop the firewall loop.
   //
@@ -621,22 +1371,220 @@ void Start(Status &status) {
         break;
       }
       port_forwarding += pos;
-      FullConeNAT::Lookup(ProtocolID::TCP, port).lan_host_ip = ip;
-      FullConeNAT::Lookup(ProtocolID::UDP, port).lan_host_ip = ip;
+      FullConeNAT::Lookup(ProtocolID::TCP, port).SetLanHostIP(ip);
+      FullConeNAT::Lookup(ProtocolID::UDP, port).SetLanHostIP(ip);
       LOG << "Forwarding port " << port << " to " << ip;
     }
   }
 
-  loop = std::thread(Loop);
+  if (hook->offload) {
+    offload_timer.emplace();
+    offload_timer->handler = PollOffloadedFlows;
+    double interval_s =
+        std::chrono::duration<double>(kOffloadPollInterval).count();
+    offload_timer->Arm(interval_s, interval_s);
+  }
+
+  if (queue_count > 1) {
+    LOG << "Firewall running on " << queue_count << " threads.";
+  }
+  if (fail_open) {
+    LOG << "Firewall queues are fail-open. Packets that don't fit in them will "
+           "bypass the NAT.";
+  }
+  for (auto &worker : workers) {
+    worker->thread = std::thread(&Worker::Loop, worker.get());
+  }
 }
 
 void Stop() {
-  tgkill(getpid(), loop_tid, SIGUSR1);
-  loop.join();
-  queue.reset();
+  stop = true;
+  for (auto &worker : workers) {
+    if (!worker->thread.joinable()) {
+      continue;
+    }
+    // Worker may still be starting up. Wait until it reports its thread ID.
+    while (worker->tid == 0) {
+      std::this_thread::yield();
+    }
+    tgkill(getpid(), worker->tid, SIGUSR1);
+    worker->thread.join();
+  }
+  workers.clear();
+  offload_timer.reset();
+  offload_netlink.reset();
+  offloaded_flows.clear();
   hook.reset();
   Status status_ignore;
-  epoll::Del(&pipe, status_ignore);
+  epoll::Del(&main_thread_queue, status_ignore);
+}
+
+Replay::Replay(FD queue, Status &status) : worker(new Worker(workers.size())) {
+  workers.emplace_back(worker);
+  worker->queue.emplace(std::move(queue), NETLINK_NETFILTER, status);
+  if (!OK(status)) {
+    return;
+  }
+  if (!main_thread_queue.fd.Opened()) {
+    main_thread_queue.Setup(status);
+  }
+}
+
+Replay::~Replay() {
+  std::erase_if(workers, [&](auto &w) { return w.get() == worker; });
+  if (workers.empty()) {
+    main_thread_queue.fd.Close();
+  }
+}
+
+int Replay::ProcessBatch(Status &status) {
+  return worker->ProcessBatch(status);
+}
+
+void Replay::RecordTraffic() {
+  Status status;
+  main_thread_queue.NotifyRead(status);
+}
+
+Table table;
+
+Table::Table()
+    : webui::Table("firewall", "Firewall",
+                   {"Batch size", "Batches", "Packets"}) {}
+
+void Table::Update(RenderOptions &) {
+  maf::Size nat_entries = 0;
+  U64 nat_rejected = 0;
+  for (auto &shard : SymmetricNAT::shards) {
+    std::lock_guard lock(shard.mutex);
+    nat_entries += shard.table.count;
+    nat_rejected += shard.table.rejected;
+  }
+  U64 traffic_overflows = 0;
+  for (auto &worker : workers) {
+    traffic_overflows +=
+        worker->traffic_overflows.load(std::memory_order_relaxed);
+  }
+  caption = f("Firewall (%zu NAT entries", nat_entries);
+  if (nat_rejected) {
+    caption += f(", %lu rejected because the NAT table was full",
+                 nat_rejected);
+  }
+  if (traffic_overflows) {
+    caption += f(", %lu traffic records dropped", traffic_overflows);
+  }
+  {
+    std::lock_guard lock(offloaded_flows_mutex);
+    if (!offloaded_flows.empty()) {
+      caption += f(", %zu flows offloaded to the kernel",
+                   offloaded_flows.size());
+    }
+  }
+  caption += ")";
+  rows.clear();
+  for (int batch_size = 1; batch_size <= Netlink::kMaxBatch; ++batch_size) {
+    U64 batches = 0;
+    for (auto &worker : workers) {
+      batches += worker->batch_sizes[batch_size].load(std::memory_order_relaxed);
+    }
+    if (batches) {
+      rows.push_back({.batch_size = batch_size, .batches = batches});
+    }
+  }
+}
+
+int Table::Size() const { return rows.size(); }
+
+void Table::Get(int row, int col, Str &out) const {
+  if (row < 0 || row >= Size()) {
+    return;
+  }
+  switch (col) {
+  case 0:
+    out = maf::ToStr(rows[row].batch_size);
+    break;
+  case 1:
+    out = maf::ToStr(rows[row].batches);
+    break;
+  case 2:
+    out = maf::ToStr(rows[row].batches * rows[row].batch_size);
+    break;
+  }
+}
+
+Str Table::RowID(int row) const {
+  if (row < 0 || row >= Size()) {
+    return "";
+  }
+  return f("firewall-batch-%d", rows[row].batch_size);
+}
+
+
+QueueTable queue_table;
+
+QueueTable::QueueTable()
+    : webui::Table("firewall-queues", "Firewall queues",
+                   {"Queue", "Waiting", "Dropped (queue full)",
+                    "Dropped (ENOBUFS)"}) {}
+
+void QueueTable::Update(RenderOptions &) {
+  caption = f("Firewall queues (up to %u packets each%s)", queue_length,
+              fail_open ? ", fail-open" : "");
+  rows.clear();
+  if (workers.empty()) {
+    return;
+  }
+  Status status;
+  Str stats = fs::Read(fs::real, "/proc/net/netfilter/nfnetlink_queue", status);
+  if (!OK(status)) {
+    caption += " - couldn't read the kernel statistics";
+    return;
+  }
+  // Each line describes one queue: queue number, peer port ID, queue total,
+  // copy mode, copy range, queue dropped, user dropped, ID sequence & 1.
+  for (StrView line : SplitOnChars(stats, "\n")) {
+    Row row;
+    unsigned portid, copy_mode, copy_range;
+    if (sscanf(Str(line).c_str(), "%hu %u %u %u %u %u %u", &row.queue,
+               &portid, &row.waiting, &copy_mode, &copy_range,
+               &row.queue_dropped, &row.user_dropped) != 7) {
+      continue;
+    }
+    if (row.queue < kQueueNumber.Get() ||
+        row.queue >= kQueueNumber.Get() + queue_count) {
+      continue;
+    }
+    rows.push_back(row);
+  }
+}
+
+int QueueTable::Size() const { return rows.size(); }
+
+void QueueTable::Get(int row, int col, Str &out) const {
+  if (row < 0 || row >= Size()) {
+    return;
+  }
+  switch (col) {
+  case 0:
+    out = maf::ToStr(rows[row].queue);
+    break;
+  case 1:
+    out = maf::ToStr(rows[row].waiting);
+    break;
+  case 2:
+    out = maf::ToStr(rows[row].queue_dropped);
+    break;
+  case 3:
+    out = maf::ToStr(rows[row].user_dropped);
+    break;
+  }
+}
+
+Str QueueTable::RowID(int row) const {
+  if (row < 0 || row >= Size()) {
+    return "";
+  }
+  return f("firewall-queue-%d", rows[row].queue);
 }
 
 } // namespace gatekeeper::firewall
\ No newline at end of file
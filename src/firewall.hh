@@ -1,6 +1,10 @@
 #pragma once
 
+#include "fd.hh"
+#include "ip.hh"
+#include "span.hh"
 #include "status.hh"
+#include "webui.hh"
 
 namespace gatekeeper::firewall {
 
@@ -10,4 +14,74 @@ void Start(maf::Status &status);
 
 void Stop();
 
-} // namespace gatekeeper::firewall
\ No newline at end of file
+struct Worker;
+
+// Runs the packet processing of a firewall thread on the calling thread, with
+// a socket that stands in for the kernel nfqueue. Used by `firewall_bench`.
+//
+// `queue` should be one end of a SOCK_SEQPACKET socket pair. The other end is
+// used to feed the nfqueue packet messages & to collect the verdicts.
+struct Replay {
+  Replay(maf::FD queue, maf::Status &);
+  ~Replay();
+
+  // Processes the packets waiting in the queue & sends their verdicts. Blocks
+  // if the queue is empty.
+  //
+  // Returns the number of received netlink packets.
+  int ProcessBatch(maf::Status &);
+
+  // Records the traffic passed from the firewall thread. Normally this is done
+  // by the main thread, when woken up through epoll.
+  void RecordTraffic();
+
+private:
+  Worker *worker;
+};
+
+// Recomputes the IP & TCP/UDP checksums of an IPv4 `packet` from scratch.
+// Used by `checksum_test` to check the incremental updates of the NAT.
+void RecomputeChecksums(maf::Span<> packet);
+
+// Changes the source (or destination) address of a TCP or UDP IPv4 `packet`
+// & updates its checksums, the way the NAT does. `l4_checksum_partial` marks
+// packets whose TCP/UDP checksum wasn't computed yet. Used by `checksum_test`.
+void RewritePacketAddress(maf::Span<> packet, bool source,
+                          maf::IP new_address, bool l4_checksum_partial);
+
+// Shows how many packets the firewall threads receive with a single syscall.
+struct Table : webui::Table {
+  struct Row {
+    int batch_size;
+    maf::U64 batches;
+  };
+  std::vector<Row> rows;
+  Table();
+  void Update(RenderOptions &) override;
+  int Size() const override;
+  void Get(int row, int col, maf::Str &out) const override;
+  maf::Str RowID(int row) const override;
+};
+
+extern Table table;
+
+// Shows the state of the nfqueues that pass the packets to the firewall
+// threads. Drop counters come from the kernel.
+struct QueueTable : webui::Table {
+  struct Row {
+    maf::U16 queue;
+    maf::U32 waiting;
+    maf::U32 queue_dropped;
+    maf::U32 user_dropped;
+  };
+  std::vector<Row> rows;
+  QueueTable();
+  void Update(RenderOptions &) override;
+  int Size() const override;
+  void Get(int row, int col, maf::Str &out) const override;
+  maf::Str RowID(int row) const override;
+};
+
+extern QueueTable queue_table;
+
+} // namespace gatekeeper::firewall
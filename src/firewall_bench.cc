@@ -0,0 +1,366 @@
+// Benchmark of the firewall packet processing.
+//
+// Replays IPv4 packets through the same code that handles the nfqueue traffic
+// (NAT lookups, address rewriting, checksums & traffic recording). The kernel
+// is replaced by a socket pair, fed with nfqueue packet messages.
+//
+// Usage:
+//
+//   ./run firewall_bench
+//   ./run firewall_bench -- capture.pcap [LAN network, e.g. 10.0.0.0/24]
+//
+// Without arguments it generates a synthetic mix of outgoing packets & their
+// replies. Classic pcap files (Ethernet, Linux cooked or raw IP) can be
+// replayed instead. Their packets addressed to the LAN hosts are redirected to
+// the WAN IP, as if they came from the Internet.
+
+#pragma maf main
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+#include <sys/socket.h>
+
+#include "checksum.hh"
+#include "config.hh"
+#include "firewall.hh"
+#include "format.hh"
+#include "int.hh"
+#include "log.hh"
+#include "mac.hh"
+#include "netlink.hh"
+#include "nfqueue.hh"
+#include "status.hh"
+#include "vec.hh"
+
+using namespace maf;
+using namespace gatekeeper;
+
+static constexpr Size kFlows = 4096;
+static constexpr Size kTimedPackets = 2'000'000;
+
+// Counts the allocations made while processing the packets.
+static U64 allocations = 0;
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  if (void *ptr = malloc(size)) {
+    return ptr;
+  }
+  abort();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { free(ptr); }
+
+struct Packet {
+  MAC source_mac;
+  Vec<char> ip; // IPv4 header & everything after it
+};
+
+static U16 Checksum(const void *data, Size size, U32 extra = 0) {
+  return ~checksum::Fold(checksum::Sum(data, size) + extra);
+}
+
+// Fills in the IP & TCP/UDP checksums, like a NIC would.
+static void SetChecksums(Vec<char> &ip) {
+  U8 *bytes = (U8 *)ip.data();
+  Size header_len = (bytes[0] & 0xf) * 4;
+  *(U16 *)(bytes + 10) = 0;
+  *(U16 *)(bytes + 10) = Checksum(bytes, header_len);
+  U8 proto = bytes[9];
+  Size l4_len = ip.size() - header_len;
+  Size checksum_offset = proto == IPPROTO_TCP ? 16 : 6;
+  if (l4_len < checksum_offset + 2) {
+    return;
+  }
+  U16 &l4_checksum = *(U16 *)(bytes + header_len + checksum_offset);
+  l4_checksum = 0;
+  const U16 *addrs = (const U16 *)(bytes + 12);
+  U32 pseudo = addrs[0] + addrs[1] + addrs[2] + addrs[3] +
+               Big<U16>(l4_len).big_endian + Big<U16>(proto).big_endian;
+  l4_checksum = Checksum(bytes + header_len, l4_len, pseudo);
+}
+
+static Vec<char> MakeIP(U8 proto, IP source, U16 source_port, IP destination,
+                        U16 destination_port, Size payload_size) {
+  Size l4_header = proto == IPPROTO_TCP ? 20 : 8;
+  Vec<char> ip(20 + l4_header + payload_size, 0);
+  U8 *bytes = (U8 *)ip.data();
+  bytes[0] = 0x45;
+  *(Big<U16> *)(bytes + 2) = ip.size();
+  bytes[8] = 64;
+  bytes[9] = proto;
+  *(IP *)(bytes + 12) = source;
+  *(IP *)(bytes + 16) = destination;
+  *(Big<U16> *)(bytes + 20) = source_port;
+  *(Big<U16> *)(bytes + 22) = destination_port;
+  if (proto == IPPROTO_TCP) {
+    bytes[32] = 5 << 4; // data offset
+    bytes[33] = 0x10;   // ACK
+    bytes[34] = 0xff;   // window
+  } else {
+    *(Big<U16> *)(bytes + 24) = 8 + payload_size;
+  }
+  for (Size i = 0; i < payload_size; ++i) {
+    bytes[20 + l4_header + i] = i;
+  }
+  SetChecksums(ip);
+  return ip;
+}
+
+// Outgoing packets of `kFlows` flows, each followed by a reply. Packet sizes
+// alternate between small (ACK-like) & full-sized.
+static Vec<Packet> SyntheticPackets() {
+  Vec<Packet> packets;
+  U64 seed = 0x9E3779B97F4A7C15ull;
+  for (Size i = 0; i < kFlows; ++i) {
+    // xorshift64
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    U8 host = 2 + i % 200;
+    IP local_ip = lan_network.ip;
+    local_ip.bytes[3] = host;
+    IP remote_ip((U32)seed);
+    remote_ip.bytes[0] = 1 + remote_ip.bytes[0] % 200; // public, unicast
+    U16 local_port = 1024 + (seed >> 32) % 60000;
+    U16 remote_port = i % 4 ? 443 : 53;
+    U8 proto = i % 4 ? IPPROTO_TCP : IPPROTO_UDP;
+    MAC local_mac(0x02, 0, 0, 0, 0, host);
+    MAC router_mac(0x02, 0, 0, 0, 0, 1);
+    packets.push_back({local_mac, MakeIP(proto, local_ip, local_port,
+                                         remote_ip, remote_port, 64)});
+    packets.push_back({router_mac, MakeIP(proto, remote_ip, remote_port,
+                                          wan_ip, local_port,
+                                          i % 2 ? 1400 : 64)});
+  }
+  return packets;
+}
+
+static Vec<Packet> PcapPackets(const char *path, Status &status) {
+  Vec<Packet> packets;
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    AppendErrorMessage(status) += f("Couldn't open \"%s\"", path);
+    return packets;
+  }
+  U32 header[6];
+  if (!file.read((char *)header, sizeof(header))) {
+    AppendErrorMessage(status) += "pcap file is too short";
+    return packets;
+  }
+  bool swapped;
+  if (header[0] == 0xa1b2c3d4 || header[0] == 0xa1b23c4d) {
+    swapped = false;
+  } else if (header[0] == 0xd4c3b2a1 || header[0] == 0x4d3cb2a1) {
+    swapped = true;
+  } else {
+    AppendErrorMessage(status) += "Not a pcap file (pcapng is not supported)";
+    return packets;
+  }
+  auto Get = [&](U32 x) { return swapped ? __builtin_bswap32(x) : x; };
+  U32 link_type = Get(header[5]);
+  Size link_header;
+  switch (link_type) {
+  case 1: // Ethernet
+    link_header = 14;
+    break;
+  case 113: // Linux cooked capture
+    link_header = 16;
+    break;
+  case 101: // Raw IP
+  case 228: // IPv4
+    link_header = 0;
+    break;
+  default:
+    AppendErrorMessage(status) += f("Unsupported pcap link type %u", link_type);
+    return packets;
+  }
+  MAC default_mac(0x02, 0, 0, 0, 0, 2);
+  U32 record[4];
+  Vec<char> frame;
+  while (file.read((char *)record, sizeof(record))) {
+    U32 captured = Get(record[2]);
+    frame.resize(captured);
+    if (!file.read(frame.data(), captured)) {
+      break;
+    }
+    Size offset = link_header;
+    U16 ether_type = 0x0800;
+    if (link_type == 1 || link_type == 113) {
+      ether_type = ((Big<U16> *)(frame.data() + link_header - 2))->Get();
+      if (link_type == 1) {
+        while (ether_type == 0x8100 && offset + 4 <= captured) { // VLAN
+          ether_type = ((Big<U16> *)(frame.data() + offset + 2))->Get();
+          offset += 4;
+        }
+      }
+    }
+    if (ether_type != 0x0800 || offset + 20 > captured ||
+        (frame[offset] & 0xf0) != 0x40) {
+      continue;
+    }
+    Size length = ((Big<U16> *)(frame.data() + offset + 2))->Get();
+    if (length < 20 || offset + length > captured) {
+      continue; // truncated by the capture
+    }
+    Packet &packet = packets.emplace_back();
+    packet.source_mac = link_type == 1 ? MAC(frame.data() + 6) : default_mac;
+    packet.ip.assign(frame.data() + offset, frame.data() + offset + length);
+    IP &source = *(IP *)(packet.ip.data() + 12);
+    IP &destination = *(IP *)(packet.ip.data() + 16);
+    if (lan_network.Contains(destination) && !lan_network.Contains(source)) {
+      destination = wan_ip;
+      SetChecksums(packet.ip);
+    }
+  }
+  return packets;
+}
+
+// Builds the message that nfqueue would send for the given packet.
+static Vec<char> NfqueueMessage(const Packet &packet, U32 packet_id) {
+  Size size = sizeof(nlmsghdr) + sizeof(nfgenmsg) +
+              NLA_ALIGN(NLA_HDRLEN + sizeof(nfqnl_msg_packet_hdr)) +
+              NLA_ALIGN(NLA_HDRLEN + sizeof(nfqnl_msg_packet_hw)) +
+              NLA_HDRLEN + packet.ip.size();
+  Vec<char> msg(NLA_ALIGN(size), 0);
+  char *p = msg.data();
+  *(nlmsghdr *)p = {
+      .nlmsg_len = (U32)size,
+      .nlmsg_type = NFNL_SUBSYS_QUEUE << 8 | NFQNL_MSG_PACKET,
+  };
+  p += sizeof(nlmsghdr);
+  *(nfgenmsg *)p = {
+      .nfgen_family = AF_INET,
+      .version = NFNETLINK_V0,
+      .res_id = netfilter::kQueueNumber.big_endian,
+  };
+  p += sizeof(nfgenmsg);
+  auto Attr = [&](U16 type, const void *data, Size len) {
+    *(nlattr *)p = {.nla_len = (U16)(NLA_HDRLEN + len), .nla_type = type};
+    memcpy(p + NLA_HDRLEN, data, len);
+    p += NLA_ALIGN(NLA_HDRLEN + len);
+  };
+  nfqnl_msg_packet_hdr hdr = {
+      .packet_id = Big<U32>(packet_id).big_endian,
+      .hw_protocol = Big<U16>(0x0800).big_endian,
+  };
+  Attr(NFQA_PACKET_HDR, &hdr, sizeof(hdr));
+  nfqnl_msg_packet_hw hw = {.hw_addrlen = Big<U16>(6).big_endian};
+  memcpy(hw.hw_addr, packet.source_mac.bytes, 6);
+  Attr(NFQA_HWADDR, &hw, sizeof(hw));
+  Attr(NFQA_PAYLOAD, packet.ip.data(), packet.ip.size());
+  return msg;
+}
+
+int main(int argc, char *argv[]) {
+  Status status;
+  if (argc > 2) {
+    int prefix;
+    if (sscanf(argv[2], "%hhu.%hhu.%hhu.%hhu/%d", &lan_network.ip.bytes[0],
+               &lan_network.ip.bytes[1], &lan_network.ip.bytes[2],
+               &lan_network.ip.bytes[3], &prefix) != 5 ||
+        prefix < 1 || prefix > 32) {
+      ERROR << "Couldn't parse the LAN network \"" << argv[2] << "\"";
+      return 1;
+    }
+    lan_network.netmask = IP(Big<U32>(~0u << (32 - prefix)).big_endian);
+    lan_network.ip = lan_network.ip & lan_network.netmask;
+    lan_ip = lan_network.ip;
+    lan_ip.bytes[3] |= 1;
+  }
+  wan_ip = IP(203, 0, 113, 1);
+
+  Vec<Packet> packets =
+      argc > 1 ? PcapPackets(argv[1], status) : SyntheticPackets();
+  if (!OK(status)) {
+    ERROR << status;
+    return 1;
+  }
+  if (packets.empty()) {
+    ERROR << "No IPv4 packets to replay";
+    return 1;
+  }
+  Vec<Vec<char>> messages;
+  Size bytes = 0;
+  for (Size i = 0; i < packets.size(); ++i) {
+    messages.push_back(NfqueueMessage(packets[i], i + 1));
+    bytes += packets[i].ip.size();
+  }
+  LOG << f("Replaying %zu packets (%.0f B on average)", packets.size(),
+           (double)bytes / packets.size());
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+    AppendErrorMessage(status) += "socketpair()";
+    ERROR << status;
+    return 1;
+  }
+  FD kernel(fds[1]);
+  // Room for a full batch of packets & their verdicts.
+  int buffer_size = 4 * 1024 * 1024;
+  for (int fd : fds) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  }
+  firewall::Replay replay(FD(fds[0]), status);
+  if (!OK(status)) {
+    ERROR << status;
+    return 1;
+  }
+
+  Size next = 0;
+  char verdicts[64 * 1024];
+  // Replays `count` packets. Returns the time spent in the firewall code.
+  auto Run = [&](Size count, U64 &batch_allocations) {
+    std::chrono::steady_clock::duration elapsed{};
+    batch_allocations = 0;
+    for (Size done = 0; done < count;) {
+      mmsghdr msgs[Netlink::kMaxBatch];
+      iovec iov[Netlink::kMaxBatch];
+      int batch = std::min<Size>(Netlink::kMaxBatch, count - done);
+      for (int i = 0; i < batch; ++i) {
+        Vec<char> &msg = messages[next];
+        next = (next + 1) % messages.size();
+        iov[i] = {.iov_base = msg.data(), .iov_len = msg.size()};
+        msgs[i] = {.msg_hdr = {.msg_iov = &iov[i], .msg_iovlen = 1}};
+      }
+      if (sendmmsg(kernel, msgs, batch, 0) != batch) {
+        AppendErrorMessage(status) += "sendmmsg()";
+        return elapsed;
+      }
+      U64 allocations_before = allocations;
+      auto start = std::chrono::steady_clock::now();
+      int received = 0;
+      while (received < batch && OK(status)) {
+        received += replay.ProcessBatch(status);
+      }
+      elapsed += std::chrono::steady_clock::now() - start;
+      batch_allocations += allocations - allocations_before;
+      done += batch;
+      while (recv(kernel, verdicts, sizeof(verdicts), MSG_DONTWAIT) > 0) {
+      }
+      replay.RecordTraffic();
+    }
+    return elapsed;
+  };
+
+  // First pass creates the NAT entries.
+  U64 warmup_allocations;
+  Run(packets.size(), warmup_allocations);
+  U64 timed_allocations;
+  auto elapsed = Run(kTimedPackets, timed_allocations);
+  if (!OK(status)) {
+    ERROR << status;
+    return 1;
+  }
+  double seconds = std::chrono::duration<double>(elapsed).count();
+  LOG << f("%.2f Mpps, %.0f ns/packet, %.3f allocations/packet",
+           kTimedPackets / seconds / 1e6, seconds * 1e9 / kTimedPackets,
+           (double)timed_allocations / kTimedPackets);
+  return 0;
+}
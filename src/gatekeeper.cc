@@ -1,5 +1,3 @@
-#include "gatekeeper.hh"
-
 #include <algorithm>
 #include <csignal>
 #include <cstdlib>
@@ -9,12 +7,12 @@
 #include "config.hh"
 #include "dhcp.hh"
 #include "dns_client.hh"
+#include "dns_local_zone.hh"
 #include "dns_server.hh"
 #include "epoll.hh"
 #include "etc.hh"
 #include "firewall.hh"
 #include "format.hh"
-#include "gatekeeper.hh"
 #include "interface.hh"
 #include "log.hh"
 #include "netlink.hh"
@@ -22,8 +20,8 @@
 #include "proc.hh"
 #include "random.hh"
 #include "rtnetlink.hh"
+#include "shutdown.hh"
 #include "sig.hh" // IWYU pragma: keep
-#include "signal.hh"
 #include "sock_diag.hh"
 #include "split.hh"
 #include "status.hh"
@@ -41,14 +39,9 @@ using namespace std;
 using namespace gatekeeper;
 using namespace maf;
 
-Optional<SignalHandler> sigabrt; // systemd watchdog
-Optional<SignalHandler> sigterm; // systemctl stop & systemd timeout
-Optional<SignalHandler> sigint;  // Ctrl+C
-
 Vec<UniquePtr<wifi::AccessPoint>> wifi_access_points;
 
-void StopSignal(const char *signal) {
-  LOG << "Received " << signal << ". Stopping Gatekeeper.";
+static void StopServices() {
   webui::Stop();
   dns::StopServer();
   dns::StopClient();
@@ -57,37 +50,8 @@ void StopSignal(const char *signal) {
   update::Stop();
   firewall::Stop();
   wifi_access_points.clear();
-  // Signal handlers must be stopped so that epoll::Loop would terminate.
-  UnhookSignals();
 }
 
-void gatekeeper::HookSignals(Status &status) {
-  sigterm.emplace(SIGTERM, status);
-  sigterm->handler = [](Status &) { StopSignal("SIGTERM"); };
-  if (!OK(status)) {
-    return;
-  }
-  sigint.emplace(SIGINT, status);
-  sigint->handler = [](Status &) { StopSignal("SIGINT"); };
-  if (!OK(status)) {
-    return;
-  }
-  sigabrt.emplace(SIGABRT, status);
-  sigabrt->handler = [](Status &) { StopSignal("SIGABRT"); };
-  if (!OK(status)) {
-    return;
-  }
-}
-
-void gatekeeper::UnhookSignals() {
-  sigabrt.reset();
-  sigterm.reset();
-  sigint.reset();
-}
-
-const char *gatekeeper::kKnownEnvironmentVariables[] = {
-    "LAN", "WAN", "NO_AUTO_UPDATE", "WIFI_PASSWORD", "WIFI_NAME", nullptr};
-
 // Get Environment Variable `name` or call `default_fn` and return its result.
 //
 // If `persist_default` is true, then save the result of `default_fn` so that
@@ -396,17 +360,17 @@ void KillConflictingProcesses(Status &status) {
   }
 }
 
-void SetupDNSOverrides() {
+// DHCP clients add their own names as they get their leases.
+void SetupLocalZone() {
   for (auto &[ip, aliases] : etc::hosts) {
     if (ip.bytes[0] == 127) {
       continue;
     }
     for (auto &alias : aliases) {
-      string domain = alias + "." + kLocalDomain;
-      dns::Override(domain, ip);
+      dns::AddStaticHost(alias, ip);
     }
   }
-  dns::Override(etc::hostname + "." + kLocalDomain, lan_ip);
+  dns::AddStaticHost(etc::hostname, lan_ip);
 }
 
 int main(int argc, char *argv[]) {
@@ -419,6 +383,7 @@ int main(int argc, char *argv[]) {
 
   LOG << "Gatekeeper " << kVersionNote.desc << " starting up.";
 
+  stop_services = StopServices;
   HookSignals(status);
   if (!status.Ok()) {
     ERROR << status;
@@ -531,7 +496,7 @@ int main(int argc, char *argv[]) {
     ERROR << status;
     return 1;
   }
-  SetupDNSOverrides();
+  SetupLocalZone();
 
   dns::StartServer(status);
   if (!OK(status)) {
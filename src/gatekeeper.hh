@@ -1,12 +0,0 @@
-#pragma once
-
-#include "status.hh"
-
-namespace gatekeeper {
-
-void HookSignals(maf::Status &status);
-void UnhookSignals();
-
-extern const char *kKnownEnvironmentVariables[];
-
-} // namespace gatekeeper
\ No newline at end of file
@@ -7,7 +7,7 @@
 #include "dns_client.hh"
 #include "dns_server.hh"
 #include "firewall.hh"
-#include "gatekeeper.hh"
+#include "shutdown.hh"
 #include "status.hh"
 #include "systemd.hh"
 #include "update.hh"
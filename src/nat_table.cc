@@ -0,0 +1,145 @@
+#include "nat_table.hh"
+
+using namespace maf;
+
+namespace gatekeeper::firewall {
+
+static bool Empty(const NATTable::Entry &entry) {
+  return entry.expiration == 0;
+}
+
+static bool Expired(const NATTable::Entry &entry, NATTable::Tick now) {
+  return entry.expiration < now;
+}
+
+Size NATTable::Index(const Key &key) const {
+  // Finalizer from MurmurHash3. The Fibonacci hashing used to pick the NAT
+  // shards takes the top bits of the key hash so a different function must be
+  // used here.
+  U64 h = key.Hash();
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h & (capacity - 1);
+}
+
+NATTable::Entry *NATTable::Find(const Key &key, Tick now) {
+  if (count == 0) {
+    return nullptr;
+  }
+  for (Size i = Index(key);; i = (i + 1) & (capacity - 1)) {
+    Entry &entry = slots[i];
+    if (Empty(entry)) {
+      return nullptr;
+    }
+    if (entry.key == key) {
+      return Expired(entry, now) ? nullptr : &entry;
+    }
+  }
+}
+
+NATTable::Entry *NATTable::FindOrInsert(const Key &key, IP local_ip,
+                                        Tick now) {
+  // Only inserts need room so lookups don't sweep.
+  Sweep(now);
+  if (capacity) {
+    for (Size i = Index(key);; i = (i + 1) & (capacity - 1)) {
+      Entry &entry = slots[i];
+      if (Empty(entry)) {
+        break;
+      }
+      if (entry.key == key) {
+        if (Expired(entry, now)) {
+          // Not swept yet. Reuse the slot for the new flow.
+          entry.local_ip = local_ip;
+          entry.packets = 0;
+        }
+        return &entry;
+      }
+    }
+  }
+  // Keep the load factor below 3/4.
+  if ((count + 1) * 4 > capacity * 3) {
+    if (capacity < kMaxCapacity) {
+      Rehash(capacity ? capacity * 2 : kMinCapacity, now);
+    } else if (last_full_sweep != now) {
+      // Full sweeps are limited to one per tick so that a full table doesn't
+      // turn every insert into a rehash.
+      last_full_sweep = now;
+      Rehash(capacity, now);
+    }
+    if ((count + 1) * 4 > capacity * 3) {
+      ++rejected;
+      return nullptr;
+    }
+  }
+  Size i = Index(key);
+  while (!Empty(slots[i])) {
+    i = (i + 1) & (capacity - 1);
+  }
+  ++count;
+  slots[i] = Entry{.key = key, .local_ip = local_ip};
+  return &slots[i];
+}
+
+void NATTable::Sweep(Tick now) {
+  if (count == 0) {
+    return;
+  }
+  for (int step = 0; step < kSweepStep; ++step) {
+    if (sweep_cursor >= capacity) {
+      sweep_cursor = 0;
+    }
+    Entry &entry = slots[sweep_cursor];
+    if (!Empty(entry) && Expired(entry, now)) {
+      // Erasing may shift another entry into this slot so the cursor stays in
+      // place.
+      EraseAt(sweep_cursor);
+    } else {
+      ++sweep_cursor;
+    }
+  }
+}
+
+// Backward shift deletion. Entries that follow the erased slot are moved back
+// if that brings them closer to their home slot. This keeps the probe
+// sequences intact without tombstones.
+void NATTable::EraseAt(Size i) {
+  Size mask = capacity - 1;
+  for (Size j = (i + 1) & mask; !Empty(slots[j]); j = (j + 1) & mask) {
+    Size home = Index(slots[j].key);
+    // The entry can be moved to `i` if `i` lies on its probe sequence (between
+    // `home` & `j`).
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+  slots[i] = Entry{};
+  --count;
+}
+
+void NATTable::Rehash(Size new_capacity, Tick now) {
+  std::unique_ptr<Entry[]> old_slots(new Entry[new_capacity]);
+  std::swap(slots, old_slots);
+  Size old_capacity = capacity;
+  capacity = new_capacity;
+  count = 0;
+  sweep_cursor = 0;
+  for (Size j = 0; j < old_capacity; ++j) {
+    Entry &entry = old_slots[j];
+    if (Empty(entry) || Expired(entry, now)) {
+      continue;
+    }
+    Size i = Index(entry.key);
+    while (!Empty(slots[i])) {
+      i = (i + 1) & (capacity - 1);
+    }
+    slots[i] = entry;
+    ++count;
+  }
+}
+
+} // namespace gatekeeper::firewall
@@ -0,0 +1,80 @@
+#pragma once
+
+// Flow table used by the Symmetric NAT of the firewall.
+
+#include <memory>
+
+#include "int.hh"
+#include "ip.hh"
+
+namespace gatekeeper::firewall {
+
+// Open-addressing hash table with linear probing.
+//
+// Entries are stored inline, in fixed-size slots, so a lookup usually touches a
+// single cache line & inserts don't allocate. Each entry carries its own
+// expiration tick. Expired entries are removed incrementally - every insert
+// inspects a couple of slots at the sweep cursor.
+//
+// The table grows up to `kMaxCapacity` slots. Once it's full (and nothing can
+// be swept), new entries are rejected.
+//
+// Not thread-safe.
+struct NATTable {
+  // Coarse (1 second) timestamp. Tick 0 marks empty slots.
+  using Tick = maf::U32;
+
+  struct Key {
+    maf::IP remote_ip;
+    maf::U16 remote_port;
+    maf::U16 local_port;
+
+    bool operator==(const Key &other) const {
+      return remote_ip == other.remote_ip && remote_port == other.remote_port &&
+             local_port == other.local_port;
+    }
+
+    maf::Size Hash() const { return *reinterpret_cast<const size_t *>(this); }
+  };
+
+  struct Entry {
+    Key key;
+    maf::IP local_ip;
+    // The entry is valid until (and including) this tick.
+    Tick expiration = 0;
+    // Number of packets that went through this entry. Used to decide when to
+    // offload the flow to the kernel.
+    maf::U32 packets = 0;
+  };
+
+  static constexpr maf::Size kMinCapacity = 64;
+  // 160 KiB of slots (6144 entries) at most.
+  static constexpr maf::Size kMaxCapacity = 8192;
+  // Number of slots inspected by the sweeper on every insert.
+  static constexpr int kSweepStep = 2;
+
+  std::unique_ptr<Entry[]> slots;
+  maf::Size capacity = 0; // always a power of two (or 0)
+  maf::Size count = 0;
+  maf::Size sweep_cursor = 0;
+  Tick last_full_sweep = 0;
+  // Number of entries that couldn't be inserted because the table was full.
+  maf::U64 rejected = 0;
+
+  // Returns the live entry for `key` or nullptr.
+  Entry *Find(const Key &key, Tick now);
+
+  // Returns the live entry for `key`, creating a new one if necessary. New
+  // entries must have their `expiration` set by the caller.
+  //
+  // Returns nullptr if the table is full.
+  Entry *FindOrInsert(const Key &key, maf::IP local_ip, Tick now);
+
+private:
+  maf::Size Index(const Key &key) const;
+  void Sweep(Tick now);
+  void EraseAt(maf::Size i);
+  void Rehash(maf::Size new_capacity, Tick now);
+};
+
+} // namespace gatekeeper::firewall
@@ -0,0 +1,170 @@
+// Microbenchmark of the Symmetric NAT flow table.
+//
+// Compares `NATTable` against the node-based `std::unordered_set` that it
+// replaced. Build in release mode & run with `./run nat_table_bench`.
+
+#pragma maf main
+
+#include <chrono>
+#include <unordered_set>
+
+#include "format.hh"
+#include "log.hh"
+#include "nat_table.hh"
+#include "vec.hh"
+
+using namespace maf;
+using namespace gatekeeper::firewall;
+
+using Key = NATTable::Key;
+using Entry = NATTable::Entry;
+
+// Same layout as the firewall - flows are spread across 64 shards.
+static constexpr int kShardBits = 6;
+static constexpr Size kShards = 1 << kShardBits;
+// Each shard holds at most 6144 entries.
+static constexpr Size kFlows = 256 * 1024;
+static constexpr int kRounds = 10;
+
+static Size ShardFor(const Key &key) {
+  return (key.Hash() * 0x9E3779B97F4A7C15ull) >> (64 - kShardBits);
+}
+
+// The old Symmetric NAT table.
+struct NodeTable {
+  struct Hash {
+    using is_transparent = std::true_type;
+    Size operator()(const Entry *e) const { return e->key.Hash(); }
+    Size operator()(const Key &key) const { return key.Hash(); }
+  };
+  struct Equal {
+    using is_transparent = std::true_type;
+    bool operator()(const Entry *a, const Entry *b) const {
+      return a->key == b->key;
+    }
+    bool operator()(const Key &a, const Entry *b) const { return a == b->key; }
+  };
+  std::unordered_set<Entry *, Hash, Equal> table;
+
+  Entry *Find(const Key &key) {
+    auto it = table.find<Key>(key);
+    return it == table.end() ? nullptr : *it;
+  }
+
+  Entry *FindOrInsert(const Key &key, IP local_ip) {
+    auto it = table.find<Key>(key);
+    if (it == table.end()) {
+      it = table.insert(new Entry{.key = key, .local_ip = local_ip}).first;
+    }
+    return *it;
+  }
+
+  ~NodeTable() {
+    for (auto *entry : table) {
+      delete entry;
+    }
+  }
+};
+
+static Vec<Key> RandomKeys(Size n, U64 seed) {
+  Vec<Key> keys;
+  keys.reserve(n);
+  for (Size i = 0; i < n; ++i) {
+    // xorshift64
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    keys.push_back(Key{.remote_ip = IP((U32)seed),
+                       .remote_port = (U16)(seed >> 32),
+                       .local_port = (U16)(seed >> 48)});
+  }
+  return keys;
+}
+
+template <typename Fn> static double MillionOpsPerSecond(Size ops, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return ops / elapsed.count() / 1e6;
+}
+
+int main() {
+  Vec<Key> keys = RandomKeys(kFlows, 0x9E3779B97F4A7C15ull);
+  Vec<Key> misses = RandomKeys(kFlows, 0x2545F4914F6CDD1Dull);
+  NATTable::Tick tick = 1;
+  IP local_ip(192, 168, 1, 2);
+  U64 sink = 0;
+
+  auto Report = [](const char *name, double insert, double hit, double miss) {
+    LOG << f("%-14s insert: %6.1f M/s   hit: %6.1f M/s   miss: %6.1f M/s", name,
+             insert, hit, miss);
+  };
+
+  {
+    double insert = MillionOpsPerSecond(kFlows * kRounds, [&] {
+      for (int r = 0; r < kRounds; ++r) {
+        NodeTable shards[kShards];
+        for (auto &key : keys) {
+          sink += shards[ShardFor(key)].FindOrInsert(key, local_ip)->packets;
+        }
+      }
+    });
+    NodeTable shards[kShards];
+    for (auto &key : keys) {
+      shards[ShardFor(key)].FindOrInsert(key, local_ip);
+    }
+    double hit = MillionOpsPerSecond(kFlows * kRounds, [&] {
+      for (int r = 0; r < kRounds; ++r) {
+        for (auto &key : keys) {
+          sink += shards[ShardFor(key)].Find(key)->packets++;
+        }
+      }
+    });
+    double miss = MillionOpsPerSecond(kFlows * kRounds, [&] {
+      for (int r = 0; r < kRounds; ++r) {
+        for (auto &key : misses) {
+          sink += shards[ShardFor(key)].Find(key) != nullptr;
+        }
+      }
+    });
+    Report("unordered_set", insert, hit, miss);
+  }
+
+  {
+    double insert = MillionOpsPerSecond(kFlows * kRounds, [&] {
+      for (int r = 0; r < kRounds; ++r) {
+        NATTable shards[kShards];
+        for (auto &key : keys) {
+          NATTable &shard = shards[ShardFor(key)];
+          Entry *entry = shard.FindOrInsert(key, local_ip, tick);
+          entry->expiration = tick + 1800;
+          sink += entry->packets;
+        }
+      }
+    });
+    NATTable shards[kShards];
+    for (auto &key : keys) {
+      shards[ShardFor(key)].FindOrInsert(key, local_ip, tick)->expiration =
+          tick + 1800;
+    }
+    double hit = MillionOpsPerSecond(kFlows * kRounds, [&] {
+      for (int r = 0; r < kRounds; ++r) {
+        for (auto &key : keys) {
+          sink += shards[ShardFor(key)].Find(key, tick)->packets++;
+        }
+      }
+    });
+    double miss = MillionOpsPerSecond(kFlows * kRounds, [&] {
+      for (int r = 0; r < kRounds; ++r) {
+        for (auto &key : misses) {
+          sink += shards[ShardFor(key)].Find(key, tick) != nullptr;
+        }
+      }
+    });
+    Report("NATTable", insert, hit, miss);
+  }
+
+  LOG << "(checksum " << sink << ")";
+  return 0;
+}
@@ -2,6 +2,7 @@
 #include "optional.hh"
 
 #include <cstring>
+#include <string>
 #include <endian.h>
 #include <linux/netfilter/nf_tables.h>
 #include <linux/netfilter/nfnetlink.h>
@@ -41,6 +42,79 @@ struct BatchEnd : nlmsghdr {
 
 using namespace messages;
 
+// Builds netlink messages with nested attributes in a growing buffer.
+//
+// Used for messages whose structure depends on their contents (like lists of
+// set elements), where calculating the buffer size upfront would be tedious.
+struct MessageBuilder {
+  std::string buf;
+
+  template <typename T> void Put(const T &t) {
+    buf.append((const char *)&t, sizeof(t));
+  }
+
+  Size BeginMessage(Netlink &netlink, U16 type, U16 flags, Family family) {
+    Size start = buf.size();
+    Put(nlmsghdr{
+        .nlmsg_len = 0,
+        .nlmsg_type = (U16)((NFNL_SUBSYS_NFTABLES << 8) | type),
+        .nlmsg_flags = (U16)(NLM_F_REQUEST | flags),
+        .nlmsg_seq = netlink.seq++,
+    });
+    Put(nfgenmsg{.nfgen_family = (U8)family, .version = NFNETLINK_V0});
+    return start;
+  }
+
+  void EndMessage(Size start) {
+    ((nlmsghdr *)(buf.data() + start))->nlmsg_len = buf.size() - start;
+  }
+
+  void Attr(U16 type, const void *data, Size len) {
+    Put(nlattr{.nla_len = (U16)(sizeof(nlattr) + len), .nla_type = type});
+    buf.append((const char *)data, len);
+    buf.append(NLA_ALIGN(len) - len, '\0');
+  }
+
+  void Attr(U16 type, const char *str) { Attr(type, str, strlen(str) + 1); }
+
+  void AttrBE32(U16 type, U32 value) {
+    value = htobe32(value);
+    Attr(type, &value, sizeof(value));
+  }
+
+  Size BeginNested(U16 type) {
+    Size start = buf.size();
+    Put(nlattr{.nla_len = 0, .nla_type = (U16)(type | NLA_F_NESTED)});
+    return start;
+  }
+
+  void EndNested(Size start) {
+    ((nlattr *)(buf.data() + start))->nla_len = buf.size() - start;
+  }
+
+  // Wraps `data` in NFTA_DATA_VALUE, nested in an attribute of given `type`.
+  void DataValue(U16 type, Span<const char> data) {
+    Size nested = BeginNested(type);
+    Attr(NFTA_DATA_VALUE, data.data(), data.size());
+    EndNested(nested);
+  }
+};
+
+// Sends the messages from the `builder` as an nftables batch & waits for the
+// acknowledgement.
+static void SendBatch(Netlink &netlink, MessageBuilder &builder,
+                      Status &status) {
+  MessageBuilder batch;
+  batch.Put(BatchBegin());
+  batch.buf += builder.buf;
+  batch.Put(BatchEnd());
+  netlink.SendRaw(std::string_view(batch.buf), status);
+  if (!status.Ok()) {
+    return;
+  }
+  netlink.ReceiveAck(status);
+}
+
 void NewTable(Netlink &netlink, Family family, const char *name,
               Status &status) {
   {
@@ -424,4 +498,191 @@ err:
               std::string(chain_name) + "\"";
 }
 
+void NewMap(Netlink &netlink, Family family, const char *table_name,
+            const char *map_name, U32 key_len, U32 data_len, bool counters,
+            U32 max_elements, Status &status) {
+  MessageBuilder builder;
+  Size msg =
+      builder.BeginMessage(netlink, NFT_MSG_NEWSET, NLM_F_ACK | NLM_F_CREATE,
+                           family);
+  builder.Attr(NFTA_SET_TABLE, table_name);
+  builder.Attr(NFTA_SET_NAME, map_name);
+  builder.AttrBE32(NFTA_SET_FLAGS,
+                   NFT_SET_MAP | (counters ? NFT_SET_EXPR : 0));
+  builder.AttrBE32(NFTA_SET_KEY_LEN, key_len);
+  // Data type is only used by the `nft` command to display the values. Use
+  // the "ipv4_addr" type because our maps translate addresses.
+  builder.AttrBE32(NFTA_SET_DATA_TYPE, 7);
+  builder.AttrBE32(NFTA_SET_DATA_LEN, data_len);
+  builder.AttrBE32(NFTA_SET_ID, 1);
+  if (max_elements) {
+    Size desc = builder.BeginNested(NFTA_SET_DESC);
+    builder.AttrBE32(NFTA_SET_DESC_SIZE, max_elements);
+    builder.EndNested(desc);
+  }
+  if (counters) {
+    Size expr = builder.BeginNested(NFTA_SET_EXPR);
+    builder.Attr(NFTA_EXPR_NAME, "counter");
+    builder.EndNested(builder.BeginNested(NFTA_EXPR_DATA));
+    builder.EndNested(expr);
+  }
+  builder.EndMessage(msg);
+  SendBatch(netlink, builder, status);
+  if (!status.Ok()) {
+    status() += "Couldn't create map \"" + std::string(map_name) +
+                "\" in table \"" + std::string(table_name) + "\"";
+  }
+}
+
+// Appends a message that adds or removes the `elements` of a single map.
+static void PutMapElements(MessageBuilder &builder, Netlink &netlink,
+                           U16 message_type, U16 flags, Family family,
+                           const char *table_name, const char *map_name,
+                           Span<const MapElement> elements) {
+  if (message_type == NFT_MSG_NEWSETELEM) {
+    flags |= NLM_F_CREATE;
+  }
+  Size msg = builder.BeginMessage(netlink, message_type, flags, family);
+  builder.Attr(NFTA_SET_ELEM_LIST_TABLE, table_name);
+  builder.Attr(NFTA_SET_ELEM_LIST_SET, map_name);
+  Size list = builder.BeginNested(NFTA_SET_ELEM_LIST_ELEMENTS);
+  for (auto &element : elements) {
+    Size elem = builder.BeginNested(NFTA_LIST_ELEM);
+    builder.DataValue(NFTA_SET_ELEM_KEY, element.key);
+    if (!element.data.empty()) {
+      builder.DataValue(NFTA_SET_ELEM_DATA, element.data);
+    }
+    builder.EndNested(elem);
+  }
+  builder.EndNested(list);
+  builder.EndMessage(msg);
+}
+
+// Shared implementation of `NewMapElements` & `DelMapElements`.
+static void ChangeMapElements(Netlink &netlink, U16 message_type,
+                              Family family, const char *table_name,
+                              const char *map_name,
+                              Span<const MapElement> elements,
+                              Status &status) {
+  MessageBuilder builder;
+  PutMapElements(builder, netlink, message_type, NLM_F_ACK, family, table_name,
+                 map_name, elements);
+  SendBatch(netlink, builder, status);
+}
+
+void NewMapElements(Netlink &netlink, Family family, const char *table_name,
+                    const char *map_name, Span<const MapElement> elements,
+                    Status &status) {
+  ChangeMapElements(netlink, NFT_MSG_NEWSETELEM, family, table_name, map_name,
+                    elements, status);
+  if (!status.Ok()) {
+    status() += "Couldn't add elements to map \"" + std::string(map_name) +
+                "\"";
+  }
+}
+
+void NewMapElements(Netlink &netlink, Family family, const char *table_name,
+                    Span<const MapElements> maps, Status &status) {
+  if (maps.empty()) {
+    return;
+  }
+  MessageBuilder builder;
+  for (Size i = 0; i < maps.size(); ++i) {
+    // Successful messages are only acknowledged when they ask for it. Asking
+    // only in the last one makes a successful batch send a single reply.
+    U16 flags = i == maps.size() - 1 ? NLM_F_ACK : 0;
+    PutMapElements(builder, netlink, NFT_MSG_NEWSETELEM, flags, family,
+                   table_name, maps[i].map_name, maps[i].elements);
+  }
+  SendBatch(netlink, builder, status);
+  if (!status.Ok()) {
+    status() += "Couldn't add elements to maps in table \"" +
+                std::string(table_name) + "\"";
+  }
+}
+
+void DelMapElements(Netlink &netlink, Family family, const char *table_name,
+                    const char *map_name, Span<const Span<const char>> keys,
+                    Status &status) {
+  MapElement elements[keys.size()];
+  for (Size i = 0; i < keys.size(); ++i) {
+    elements[i] = {.key = keys[i]};
+  }
+  ChangeMapElements(netlink, NFT_MSG_DELSETELEM, family, table_name, map_name,
+                    Span<const MapElement>(elements, keys.size()), status);
+  if (!status.Ok()) {
+    status() += "Couldn't remove elements from map \"" +
+                std::string(map_name) + "\"";
+  }
+}
+
+// Extracts the counter values from an NFTA_SET_ELEM_EXPR attribute.
+static void ParseCounter(Netlink::Attr &expr_attr, U64 &packets, U64 &bytes) {
+  bool is_counter = false;
+  for (auto &attr : expr_attr.Unnest()) {
+    if (attr.type == NFTA_EXPR_NAME) {
+      is_counter = strcmp(attr.payload, "counter") == 0;
+    } else if (attr.type == NFTA_EXPR_DATA && is_counter) {
+      for (auto &counter_attr : attr.Unnest()) {
+        if (counter_attr.type == NFTA_COUNTER_PACKETS) {
+          packets = be64toh(*(U64 *)counter_attr.payload);
+        } else if (counter_attr.type == NFTA_COUNTER_BYTES) {
+          bytes = be64toh(*(U64 *)counter_attr.payload);
+        }
+      }
+    }
+  }
+}
+
+void GetMapElements(Netlink &netlink, Family family, const char *table_name,
+                    const char *map_name, MapElementCallback callback,
+                    Status &status) {
+  MessageBuilder builder;
+  Size msg = builder.BeginMessage(netlink, NFT_MSG_GETSETELEM, NLM_F_DUMP,
+                                  family);
+  builder.Attr(NFTA_SET_ELEM_LIST_TABLE, table_name);
+  builder.Attr(NFTA_SET_ELEM_LIST_SET, map_name);
+  builder.EndMessage(msg);
+  netlink.SendRaw(std::string_view(builder.buf), status);
+  if (!status.Ok()) {
+    goto err;
+  }
+  netlink.Receive(
+      [&](Netlink::MessageType type, Netlink::Attrs attrs) {
+        attrs.RemovePrefixHeader<nfgenmsg>(status);
+        RETURN_ON_ERROR(status);
+        for (auto &list : attrs) {
+          if (list.type != NFTA_SET_ELEM_LIST_ELEMENTS) {
+            continue;
+          }
+          for (auto &elem : list.Unnest()) {
+            Span<> key, data;
+            U64 packets = 0, bytes = 0;
+            for (auto &attr : elem.Unnest()) {
+              if (attr.type == NFTA_SET_ELEM_KEY) {
+                key = attr.Unnest().begin().attr->Span();
+              } else if (attr.type == NFTA_SET_ELEM_DATA) {
+                data = attr.Unnest().begin().attr->Span();
+              } else if (attr.type == NFTA_SET_ELEM_EXPR) {
+                ParseCounter(attr, packets, bytes);
+              } else if (attr.type == NFTA_SET_ELEM_EXPRESSIONS) {
+                for (auto &expr : attr.Unnest()) {
+                  ParseCounter(expr, packets, bytes);
+                }
+              }
+            }
+            callback(key, data, packets, bytes);
+          }
+        }
+      },
+      status);
+  if (!status.Ok()) {
+    goto err;
+  }
+  return;
+err:
+  status() += "Couldn't list elements of map \"" + std::string(map_name) +
+              "\"";
+}
+
 } // namespace maf::netfilter
@@ -1,7 +1,9 @@
 #pragma once
 
+#include "fn.hh"
 #include "netlink.hh"
 #include "optional.hh"
+#include "span.hh"
 #include "status.hh"
 
 // Utilities for interacting with the Linux Netfilter framework.
@@ -58,4 +60,58 @@ void FlushChain(Netlink &, Family, const char *table_name,
 void NewRule(Netlink &, Family, const char *table_name, const char *chain_name,
              std::string_view rule, Status &status);
 
+// Create a new nftables map.
+//
+// Keys & values are opaque byte strings of fixed length (`key_len` and
+// `data_len`). Keys that are built by concatenating multiple fields must have
+// each field padded to 4 bytes.
+//
+// When `counters` is set, each element of the map counts the packets & bytes
+// that were matched against it. See `GetMapElements`.
+//
+// When `max_elements` is non-zero, the kernel refuses to add elements to a
+// full map.
+void NewMap(Netlink &, Family, const char *table_name, const char *map_name,
+            U32 key_len, U32 data_len, bool counters, U32 max_elements,
+            Status &status);
+
+struct MapElement {
+  Span<const char> key;
+  Span<const char> data;
+};
+
+// Add elements to an existing nftables map.
+void NewMapElements(Netlink &, Family, const char *table_name,
+                    const char *map_name, Span<const MapElement> elements,
+                    Status &status);
+
+// Elements added to a single map by the multi-map `NewMapElements`.
+struct MapElements {
+  const char *map_name;
+  Span<const MapElement> elements;
+};
+
+// Add elements to several maps in a single nftables transaction. Either all of
+// the elements are added or none of them.
+//
+// After a failure the kernel may still send replies for some of the maps, so
+// the netlink socket shouldn't be reused.
+void NewMapElements(Netlink &, Family, const char *table_name,
+                    Span<const MapElements> maps, Status &status);
+
+// Remove elements (identified by their keys) from an nftables map.
+void DelMapElements(Netlink &, Family, const char *table_name,
+                    const char *map_name, Span<const Span<const char>> keys,
+                    Status &status);
+
+// Called once for each element of the map. Counters are 0 when the map was
+// created without them.
+using MapElementCallback =
+    Fn<void(Span<> key, Span<> data, U64 packets, U64 bytes)>;
+
+// List the elements of an nftables map.
+void GetMapElements(Netlink &, Family, const char *table_name,
+                    const char *map_name, MapElementCallback callback,
+                    Status &status);
+
 } // namespace maf::netfilter
\ No newline at end of file
@@ -18,21 +18,26 @@ static constexpr sockaddr_nl kKernelSockaddr{
     .nl_groups = 0,
 };
 
-Netlink::Netlink(int protocol, Status &status) : protocol(protocol) {
+// Returns the size of the struct that follows the netlink header in the
+// messages of the given protocol. Returns 0 for unknown protocols.
+static U32 FixedMessageSize(int protocol) {
   switch (protocol) {
   case NETLINK_ROUTE:
-    fixed_message_size = sizeof(rtmsg);
-    break;
+    return sizeof(rtmsg);
   case NETLINK_NETFILTER:
-    fixed_message_size = sizeof(nfgenmsg);
-    break;
+    return sizeof(nfgenmsg);
   case NETLINK_SOCK_DIAG:
-    fixed_message_size = sizeof(inet_diag_msg);
-    break;
+    return sizeof(inet_diag_msg);
   case NETLINK_GENERIC:
-    fixed_message_size = sizeof(genlmsghdr);
-    break;
+    return sizeof(genlmsghdr);
   default:
+    return 0;
+  }
+}
+
+Netlink::Netlink(int protocol, Status &status)
+    : protocol(protocol), fixed_message_size(FixedMessageSize(protocol)) {
+  if (fixed_message_size == 0) {
     status() += "Unknown netlink protocol " + ToStr(protocol);
     return;
   }
@@ -80,6 +85,14 @@ Netlink::Netlink(int protocol, Status &status) : protocol(protocol) {
   }
 }
 
+Netlink::Netlink(FD fd, int protocol, Status &status)
+    : epoll::Listener(std::move(fd)), protocol(protocol),
+      fixed_message_size(FixedMessageSize(protocol)) {
+  if (fixed_message_size == 0) {
+    status() += "Unknown netlink protocol " + ToStr(protocol);
+  }
+}
+
 const char *Netlink::Name() const {
   switch (protocol) {
   case NETLINK_ROUTE:
@@ -141,6 +154,20 @@ void Netlink::SendRaw(std::string_view raw, Status &status) {
   }
 }
 
+void Netlink::SendRaw(Span<const iovec> iov, Status &status) {
+  msghdr msg{
+      .msg_name = (void *)&kKernelSockaddr,
+      .msg_namelen = sizeof(kKernelSockaddr),
+      .msg_iov = (iovec *)iov.data(),
+      .msg_iovlen = iov.size(),
+  };
+  ssize_t len = sendmsg(fd, &msg, 0);
+  if (len < 0) {
+    status() += "sendmsg(AF_NETLINK)";
+    return;
+  }
+}
+
 void Netlink::ReceiveAck(Status &status) {
   Receive(
       [&](MessageType message_type, Attrs attrs) {
@@ -152,122 +179,172 @@ void Netlink::ReceiveAck(Status &status) {
       status);
 }
 
-void Netlink::Receive(ReceiveCallback callback, Status &status) {
+// Parses the netlink messages from a single netlink packet & passes them to
+// the `callback`.
+//
+// Returns true if the packet was a part of a multipart message and more packets
+// should follow.
+static bool ParseMessages(char *buf, SSize len,
+                          Netlink::ReceiveCallback &callback, Status &status) {
   bool expect_more_messages = true;
-  while (expect_more_messages) {
-    ssize_t peek_len = recv(fd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
-    if (peek_len < 0) {
-      status() += "recv(AF_NETLINK, MSG_PEEK)";
-      return;
-    }
-    char buf[peek_len];
-    ssize_t len = recv(fd, buf, sizeof(buf), 0);
-    if (len < 0) {
-      status() += "recv(AF_NETLINK)";
-      return;
-    }
+  char *buf_iter = buf;
+  char *buf_end = buf + len;
 
-    char *buf_iter = buf;
-    char *buf_end = buf + len;
+  while (buf_iter < buf_end - sizeof(nlmsghdr)) {
+    buf_iter = (char *)(((uintptr_t)buf_iter + 3) & ~3); // align to 4 bytes
 
-    while (buf_iter < buf_end - sizeof(nlmsghdr)) {
-      buf_iter = (char *)(((uintptr_t)buf_iter + 3) & ~3); // align to 4 bytes
+    nlmsghdr *hdr = (nlmsghdr *)(buf_iter);
+    char *msg_end = buf_iter + hdr->nlmsg_len;
+    if (msg_end > buf_end) {
+      status() +=
+          "Truncated Netlink message, msg_len=" + ToStr(hdr->nlmsg_len) +
+          ", buf_size=" + ToStr(len);
+      return false;
+    }
+    buf_iter += sizeof(nlmsghdr);
 
-      nlmsghdr *hdr = (nlmsghdr *)(buf_iter);
-      char *msg_end = buf_iter + hdr->nlmsg_len;
-      if (msg_end > buf_end) {
-        status() +=
-            "Truncated Netlink message, msg_len=" + ToStr(hdr->nlmsg_len) +
-            ", buf_size=" + ToStr(len);
-        return;
+    if (hdr->nlmsg_type == NLMSG_ERROR) {
+      char *end = (char *)(hdr) + hdr->nlmsg_len;
+      int err = *(int *)(buf_iter);
+      buf_iter += sizeof(int);
+      std::string msg;
+      if (err == 0) {
+        return false; // This was a regular ACK - ignore it
       }
-      buf_iter += sizeof(nlmsghdr);
-
-      if (hdr->nlmsg_type == NLMSG_ERROR) {
-        char *end = (char *)(hdr) + hdr->nlmsg_len;
-        int err = *(int *)(buf_iter);
-        buf_iter += sizeof(int);
-        std::string msg;
-        if (err == 0) {
-          return; // This was a regular ACK - ignore it
-        }
-        nlmsghdr *myhdr = (nlmsghdr *)(buf_iter);
-        if (hdr->nlmsg_flags & NLM_F_CAPPED) { // payload was truncated
-          buf_iter += sizeof(nlmsghdr);
-        } else {
-          buf_iter += myhdr->nlmsg_len;
-        }
-        msg += "Netlink error";
-        msg += "\nError header:\n";
-        msg += dump_struct(*hdr);
-        msg += "\nOriginal request:\n";
-        msg += dump_struct(*myhdr);
+      nlmsghdr *myhdr = (nlmsghdr *)(buf_iter);
+      if (hdr->nlmsg_flags & NLM_F_CAPPED) { // payload was truncated
+        buf_iter += sizeof(nlmsghdr);
+      } else {
+        buf_iter += myhdr->nlmsg_len;
+      }
+      msg += "Netlink error";
+      msg += "\nError header:\n";
+      msg += dump_struct(*hdr);
+      msg += "\nOriginal request:\n";
+      msg += dump_struct(*myhdr);
 
-        if (hdr->nlmsg_flags & NLM_F_ACK_TLVS) {
-          nlattr *err_attrs[NLMSGERR_ATTR_MAX + 1] = {};
-          while (buf_iter < end - sizeof(nlattr)) {
-            buf_iter = (char *)(((uintptr_t)buf_iter + 3) & ~3);
-            nlattr *a = (nlattr *)(buf_iter);
-            if (a->nla_type != NLMSGERR_ATTR_MSG &&
-                a->nla_type != NLMSGERR_ATTR_OFFS) {
-              msg += dump_struct(*a);
-            }
-            if (a->nla_type <= NLMSGERR_ATTR_MAX) {
-              err_attrs[a->nla_type] = a;
-            }
-            buf_iter += (a->nla_len + 3) & ~3;
-          }
-          if (err_attrs[NLMSGERR_ATTR_MSG]) {
-            msg += " error message: \"";
-            msg += (char *)(err_attrs[NLMSGERR_ATTR_MSG] + 1);
-            msg += "\"";
+      if (hdr->nlmsg_flags & NLM_F_ACK_TLVS) {
+        nlattr *err_attrs[NLMSGERR_ATTR_MAX + 1] = {};
+        while (buf_iter < end - sizeof(nlattr)) {
+          buf_iter = (char *)(((uintptr_t)buf_iter + 3) & ~3);
+          nlattr *a = (nlattr *)(buf_iter);
+          if (a->nla_type != NLMSGERR_ATTR_MSG &&
+              a->nla_type != NLMSGERR_ATTR_OFFS) {
+            msg += dump_struct(*a);
           }
-          if (err_attrs[NLMSGERR_ATTR_OFFS]) {
-            msg += " error offset: ";
-            msg += ToStr(*(U32 *)(err_attrs[NLMSGERR_ATTR_OFFS] + 1));
+          if (a->nla_type <= NLMSGERR_ATTR_MAX) {
+            err_attrs[a->nla_type] = a;
           }
+          buf_iter += (a->nla_len + 3) & ~3;
         }
-
-        if (buf_iter != end) {
-          status() += "Netlink error had " + ToStr(end - buf_iter) +
-                      " extra bytes at the end (header says " +
-                      ToStr(hdr->nlmsg_len) +
-                      "B, flags=" + f("%x", hdr->nlmsg_flags) + ")";
+        if (err_attrs[NLMSGERR_ATTR_MSG]) {
+          msg += " error message: \"";
+          msg += (char *)(err_attrs[NLMSGERR_ATTR_MSG] + 1);
+          msg += "\"";
         }
-
-        errno = -err;
-        status() += msg;
-
-        return;
-      } else if (hdr->nlmsg_type == NLMSG_DONE) {
-        return;
-      } else {
-        if ((hdr->nlmsg_flags & NLM_F_MULTI) == 0) {
-          expect_more_messages = false;
+        if (err_attrs[NLMSGERR_ATTR_OFFS]) {
+          msg += " error offset: ";
+          msg += ToStr(*(U32 *)(err_attrs[NLMSGERR_ATTR_OFFS] + 1));
         }
+      }
 
-        Attrs attrs{
-            .ptr = buf_iter,
-            .size = static_cast<Size>(msg_end - buf_iter),
-        };
-        buf_iter = msg_end;
-
-        callback(hdr->nlmsg_type, attrs);
+      if (buf_iter != end) {
+        status() += "Netlink error had " + ToStr(end - buf_iter) +
+                    " extra bytes at the end (header says " +
+                    ToStr(hdr->nlmsg_len) +
+                    "B, flags=" + f("%x", hdr->nlmsg_flags) + ")";
       }
-    } // while (buf_iter < buf_end - sizeof(nlmsghdr))
 
-    if (buf_iter != buf_end) {
-      if (buf_iter < buf_end) {
-        status() +=
-            "Extra data at the end of netlink recv buffer. Message type is " +
-            f("0x%x", ((nlmsghdr *)buf)->nlmsg_type);
-      } else {
-        status() += "Netlink parsing code overshot the end of buffer by " +
-                    ToStr(buf_iter - buf_end) + " bytes";
+      errno = -err;
+      status() += msg;
+
+      return false;
+    } else if (hdr->nlmsg_type == NLMSG_DONE) {
+      return false;
+    } else {
+      if ((hdr->nlmsg_flags & NLM_F_MULTI) == 0) {
+        expect_more_messages = false;
       }
-      return; // Parsing error - don't progress further to avoid more noise
+
+      Netlink::Attrs attrs{
+          .ptr = buf_iter,
+          .size = static_cast<Size>(msg_end - buf_iter),
+      };
+      buf_iter = msg_end;
+
+      callback(hdr->nlmsg_type, attrs);
     }
+  } // while (buf_iter < buf_end - sizeof(nlmsghdr))
+
+  if (buf_iter != buf_end) {
+    if (buf_iter < buf_end) {
+      status() +=
+          "Extra data at the end of netlink recv buffer. Message type is " +
+          f("0x%x", ((nlmsghdr *)buf)->nlmsg_type);
+    } else {
+      status() += "Netlink parsing code overshot the end of buffer by " +
+                  ToStr(buf_iter - buf_end) + " bytes";
+    }
+    return false; // Parsing error - don't progress further to avoid more noise
+  }
+  return expect_more_messages;
+}
+
+void Netlink::Receive(ReceiveCallback callback, Status &status) {
+  bool expect_more_messages = true;
+  while (expect_more_messages) {
+    ssize_t peek_len = recv(fd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+    if (peek_len < 0) {
+      status() += "recv(AF_NETLINK, MSG_PEEK)";
+      return;
+    }
+    char buf[peek_len];
+    ssize_t len = recv(fd, buf, sizeof(buf), 0);
+    if (len < 0) {
+      status() += "recv(AF_NETLINK)";
+      return;
+    }
+    expect_more_messages = ParseMessages(buf, len, callback, status);
   } // while (expect_more_messages)
 }
 
+int Netlink::ReceiveBatch(ReceiveCallback callback, Status &status) {
+  if (batch_buffer == nullptr) {
+    batch_buffer.reset(new char[kMaxBatch * kBatchPacketSize]);
+  }
+  iovec iov[kMaxBatch];
+  mmsghdr msgs[kMaxBatch];
+  for (int i = 0; i < kMaxBatch; ++i) {
+    iov[i] = {
+        .iov_base = batch_buffer.get() + i * kBatchPacketSize,
+        .iov_len = kBatchPacketSize,
+    };
+    msgs[i] = {
+        .msg_hdr =
+            {
+                .msg_iov = &iov[i],
+                .msg_iovlen = 1,
+            },
+    };
+  }
+  int n = recvmmsg(fd, msgs, kMaxBatch, MSG_WAITFORONE, nullptr);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      errno = 0;
+      return 0;
+    }
+    status() += "recvmmsg(AF_NETLINK)";
+    return 0;
+  }
+  for (int i = 0; i < n; ++i) {
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      status() += "Netlink packet larger than " + ToStr(kBatchPacketSize) +
+                  " bytes was truncated";
+      continue;
+    }
+    ParseMessages((char *)iov[i].iov_base, msgs[i].msg_len, callback, status);
+  }
+  return n;
+}
+
 } // namespace maf
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <cassert>
 #include <linux/netlink.h>
+#include <memory>
+#include <sys/uio.h>
 
 #include "epoll.hh"
 #include "fn.hh"
@@ -105,6 +107,13 @@ struct Netlink : epoll::Listener {
   // explanation of NETLINK_GENERIC protocol.
   Netlink(int protocol, Status &status);
 
+  // Wraps an already connected socket that speaks the given netlink protocol.
+  //
+  // Used to stand in for the kernel in benchmarks - for example with one end
+  // of a SOCK_SEQPACKET socket pair, which ignores the kernel address used by
+  // the `Send*` methods.
+  Netlink(FD fd, int protocol, Status &status);
+
   using ReceiveCallback = Fn<void(MessageType, Attrs)>;
 
   ReceiveCallback epoll_callback;
@@ -146,6 +155,12 @@ struct Netlink : epoll::Listener {
   // object to report errors.
   void SendRaw(std::string_view, Status &status);
 
+  // Scatter-gather variant of `SendRaw`.
+  //
+  // Concatenates the given buffers into a single netlink packet without copying
+  // them. Each netlink message in the packet must start at a 4-byte boundary.
+  void SendRaw(Span<const iovec>, Status &status);
+
   // Receive one or more netlink messages.
   //
   // Each netlink message is composed of a header, a fixed-size struct & a
@@ -163,6 +178,30 @@ struct Netlink : epoll::Listener {
   // Errors will be reported through the `status` argument.
   void Receive(ReceiveCallback, Status &);
 
+  // Maximum number of netlink packets returned by a single `ReceiveBatch`.
+  static constexpr int kMaxBatch = 16;
+
+  // Size of the buffer reserved for each packet of the batch. Large enough for
+  // a 64 KiB packet forwarded by nfqueue, together with its metadata.
+  static constexpr Size kBatchPacketSize = 68 * 1024;
+
+  // Buffer for `ReceiveBatch`. Allocated on first use.
+  std::unique_ptr<char[]> batch_buffer;
+
+  // Receive multiple netlink packets with a single `recvmmsg` call.
+  //
+  // Blocks until at least one packet is available & then returns everything
+  // that is already queued (up to `kMaxBatch` packets). This is meant for
+  // sockets that receive a steady stream of unsolicited messages (like
+  // nfqueue). Use `Receive` to wait for responses to requests.
+  //
+  // The `callback` will be called once for each received message. The messages
+  // (and their attributes) remain valid until the next call to `ReceiveBatch`.
+  //
+  // Returns the number of received netlink packets. Returns 0 if the socket
+  // has a receive timeout (SO_RCVTIMEO) & it expired.
+  int ReceiveBatch(ReceiveCallback, Status &);
+
   void ReceiveAck(Status &);
 
   template <MessageType expected_type, typename T>
@@ -180,6 +219,22 @@ struct Netlink : epoll::Listener {
         },
         status);
   }
+
+  template <MessageType expected_type, typename T>
+  int ReceiveBatchT(Fn<void(T &message, Attrs)> cb, Status &status) {
+    return ReceiveBatch(
+        [&](MessageType message_type, Attrs attrs) {
+          if (message_type != expected_type) {
+            AppendErrorMessage(status) +=
+                "Unexpected message type: 0x" + f("%04hx", message_type);
+            return;
+          }
+          T &message = attrs.RemovePrefixHeader<T>(status);
+          RETURN_ON_ERROR(status);
+          cb(message, attrs);
+        },
+        status);
+  }
 };
 
 } // namespace maf
\ No newline at end of file
@@ -7,7 +7,10 @@
 
 namespace maf::netfilter {
 
-// Number of the nfqueue used to intercept messages.
+// Number of the first nfqueue used to intercept messages.
+//
+// When the traffic is spread across multiple queues, they use consecutive
+// numbers, starting at `kQueueNumber`.
 constexpr Big<U16> kQueueNumber = 1337;
 
 // All netlink structures are manually padded. Any compiler-injected padding
@@ -16,18 +19,19 @@ constexpr Big<U16> kQueueNumber = 1337;
 #pragma GCC diagnostic error "-Wpadded"
 
 // Message that binds this netlink socket to a specific nfqueue
-// (`kQueueNumber`).
+// (`kQueueNumber` by default).
 struct Bind : nlmsghdr {
-  Bind()
+  Bind(Big<U16> queue_number = kQueueNumber)
       : nlmsghdr({
             .nlmsg_len = sizeof(*this),
             .nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_CONFIG,
             .nlmsg_flags = NLM_F_REQUEST,
             .nlmsg_seq = 0,
-        }) {}
-  nfgenmsg msg{.nfgen_family = (U8)Family::UNSPEC,
-               .version = NFNETLINK_V0,
-               .res_id = kQueueNumber.big_endian};
+        }),
+        msg({.nfgen_family = (U8)Family::UNSPEC,
+             .version = NFNETLINK_V0,
+             .res_id = queue_number.big_endian}) {}
+  nfgenmsg msg;
   nlattr cmd_attr{
       .nla_len = sizeof(cmd_attr) + sizeof(cmd),
       .nla_type = NFQA_CFG_CMD,
@@ -37,18 +41,30 @@ struct Bind : nlmsghdr {
   };
 };
 
+// Default length of the kernel queue (same as the kernel default).
+constexpr U32 kDefaultQueueMaxLen = 1024;
+
 // Configure nfqueue to copy the entire packet into userspace.
+//
+// At most `queue_max_len` packets wait in the kernel for their verdicts. When
+// the queue is full (or the packet couldn't be passed to the netlink socket),
+// new packets are dropped. With `fail_open` they're accepted without going
+// through userspace instead.
 struct CopyPacket : nlmsghdr {
-  CopyPacket()
+  CopyPacket(Big<U16> queue_number = kQueueNumber,
+             U32 queue_max_len = kDefaultQueueMaxLen, bool fail_open = false)
       : nlmsghdr({
             .nlmsg_len = sizeof(*this),
             .nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_CONFIG,
             .nlmsg_flags = NLM_F_REQUEST,
             .nlmsg_seq = 0,
-        }) {}
-  nfgenmsg msg{.nfgen_family = AF_UNSPEC,
-               .version = NFNETLINK_V0,
-               .res_id = kQueueNumber.big_endian};
+        }),
+        msg({.nfgen_family = AF_UNSPEC,
+             .version = NFNETLINK_V0,
+             .res_id = queue_number.big_endian}),
+        flags(NFQA_CFG_F_GSO | (fail_open ? NFQA_CFG_F_FAIL_OPEN : 0)),
+        queue_max_len(queue_max_len) {}
+  nfgenmsg msg;
   nlattr params_attr{
       .nla_len = sizeof(params_attr) + sizeof(params),
       .nla_type = NFQA_CFG_PARAMS,
@@ -66,31 +82,38 @@ public:
       .nla_len = sizeof(flags_attr) + sizeof(flags),
       .nla_type = NFQA_CFG_FLAGS,
   };
-  Big<U32> flags = NFQA_CFG_F_GSO;
+  Big<U32> flags;
   nlattr mask_attr{
       .nla_len = sizeof(mask_attr) + sizeof(mask),
       .nla_type = NFQA_CFG_MASK,
   };
-  Big<U32> mask = NFQA_CFG_F_GSO;
+  Big<U32> mask = NFQA_CFG_F_GSO | NFQA_CFG_F_FAIL_OPEN;
+  nlattr queue_max_len_attr{
+      .nla_len = sizeof(queue_max_len_attr) + sizeof(queue_max_len),
+      .nla_type = NFQA_CFG_QUEUE_MAXLEN,
+  };
+  Big<U32> queue_max_len;
 };
 
 struct Verdict : nlmsghdr {
   static constexpr U32 NF_ACCEPT = 1;
   static constexpr U32 NF_DROP = 0;
-  Verdict(U32 packet_id_be32, bool accept)
+  Verdict(U32 packet_id_be32, bool accept,
+          Big<U16> queue_number = kQueueNumber)
       : nlmsghdr({
             .nlmsg_len = sizeof(*this),
             .nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_VERDICT,
             .nlmsg_flags = NLM_F_REQUEST,
             .nlmsg_seq = 0,
         }),
+        msg({.nfgen_family = AF_UNSPEC,
+             .version = NFNETLINK_V0,
+             .res_id = queue_number.big_endian}),
         verdict({
             .verdict = Big<U32>(accept ? NF_ACCEPT : NF_DROP).big_endian,
             .id = packet_id_be32,
         }) {}
-  nfgenmsg msg{.nfgen_family = AF_UNSPEC,
-               .version = NFNETLINK_V0,
-               .res_id = kQueueNumber.big_endian};
+  nfgenmsg msg;
   nlattr verdict_attr{
       .nla_len = sizeof(verdict_attr) + sizeof(verdict),
       .nla_type = NFQA_VERDICT_HDR,
@@ -101,6 +124,16 @@ struct Verdict : nlmsghdr {
   };
 };
 
+// Sets the verdict of all queued packets with IDs up to (and including)
+// `packet_id_be32`.
+struct VerdictBatch : Verdict {
+  VerdictBatch(U32 packet_id_be32, bool accept,
+               Big<U16> queue_number = kQueueNumber)
+      : Verdict(packet_id_be32, accept, queue_number) {
+    nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_VERDICT_BATCH;
+  }
+};
+
 #pragma GCC diagnostic pop
 
 } // namespace maf::netfilter
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "shutdown.hh"
+
+#include <csignal>
+
+#include "log.hh"
+#include "optional.hh"
+#include "signal.hh"
+
+using namespace maf;
+
+namespace gatekeeper {
+
+Fn<void()> stop_services;
+
+Optional<SignalHandler> sigabrt; // systemd watchdog
+Optional<SignalHandler> sigterm; // systemctl stop & systemd timeout
+Optional<SignalHandler> sigint;  // Ctrl+C
+
+static void StopSignal(const char *signal) {
+  LOG << "Received " << signal << ". Stopping Gatekeeper.";
+  if (stop_services) {
+    stop_services();
+  }
+  // Signal handlers must be stopped so that epoll::Loop would terminate.
+  UnhookSignals();
+}
+
+void HookSignals(Status &status) {
+  sigterm.emplace(SIGTERM, status);
+  sigterm->handler = [](Status &) { StopSignal("SIGTERM"); };
+  if (!OK(status)) {
+    return;
+  }
+  sigint.emplace(SIGINT, status);
+  sigint->handler = [](Status &) { StopSignal("SIGINT"); };
+  if (!OK(status)) {
+    return;
+  }
+  sigabrt.emplace(SIGABRT, status);
+  sigabrt->handler = [](Status &) { StopSignal("SIGABRT"); };
+  if (!OK(status)) {
+    return;
+  }
+}
+
+void UnhookSignals() {
+  sigabrt.reset();
+  sigterm.reset();
+  sigint.reset();
+}
+
+} // namespace gatekeeper
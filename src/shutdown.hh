@@ -0,0 +1,15 @@
+#pragma once
+
+#include "fn.hh"
+#include "status.hh"
+
+// Graceful shutdown of Gatekeeper on SIGTERM, SIGINT & SIGABRT.
+namespace gatekeeper {
+
+// Stops all of the services so that `epoll::Loop` can return. Set by `main`.
+extern maf::Fn<void()> stop_services;
+
+void HookSignals(maf::Status &status);
+void UnhookSignals();
+
+} // namespace gatekeeper
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+
+#include "int.hh"
+
+namespace maf {
+
+// Lock-free ring buffer that passes values from one thread to another.
+//
+// Only one thread may `Push` and only one thread may `Pop`.
+//
+// `Push` tells the producer when the ring went from empty to non-empty. This
+// allows the consumer to sleep (for example in epoll) while the ring is empty &
+// the producer to wake it up only when necessary.
+template <typename T, Size N> struct SPSCRing {
+  static_assert((N & (N - 1)) == 0, "Capacity must be a power of two");
+
+  // Each index is written by a single thread. Separate cache lines prevent
+  // false sharing.
+  alignas(64) std::atomic<Size> write_index = 0;
+  alignas(64) std::atomic<Size> read_index = 0;
+  alignas(64) T items[N];
+
+  // Returns false if the ring is full.
+  //
+  // Sets `was_empty` when the consumer may have already seen the ring empty &
+  // should be woken up.
+  bool Push(const T &item, bool &was_empty) {
+    Size w = write_index.load(std::memory_order_relaxed);
+    if (w - read_index.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    items[w & (N - 1)] = item;
+    write_index.store(w + 1, std::memory_order_release);
+    // Pairs with the fence in `Pop`. Either the consumer sees the new item or
+    // the producer sees that the consumer caught up.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    was_empty = read_index.load(std::memory_order_relaxed) == w;
+    return true;
+  }
+
+  // Moves up to `max` items to `out`. Returns the number of items moved.
+  //
+  // The consumer should call `Pop` until it returns 0 before going to sleep.
+  Size Pop(T *out, Size max) {
+    Size r = read_index.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Size n = std::min(write_index.load(std::memory_order_acquire) - r, max);
+    for (Size i = 0; i < n; ++i) {
+      out[i] = items[(r + i) & (N - 1)];
+    }
+    read_index.store(r + n, std::memory_order_release);
+    return n;
+  }
+};
+
+} // namespace maf
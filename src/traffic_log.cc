@@ -1,5 +1,6 @@
 #include "traffic_log.hh"
 
+#include <algorithm>
 #include <chrono>
 #include <set>
 
@@ -63,13 +64,22 @@ void TrafficLog::Init() {
   });
 }
 
+chrono::system_clock::time_point
+TrafficLogTick(chrono::system_clock::time_point time) {
+  return time - chrono::duration_cast<chrono::system_clock::duration>(
+                    time.time_since_epoch()) %
+                    kTrafficLogResolution;
+}
+
 void RecordTraffic(MAC local_host, maf::IP remote_ip, maf::U32 up,
                    maf::U32 down) {
-  auto now = chrono::system_clock::now();
+  RecordTraffic(chrono::system_clock::now(), local_host, remote_ip, up, down);
+}
+
+void RecordTraffic(chrono::system_clock::time_point time, MAC local_host,
+                   maf::IP remote_ip, maf::U32 up, maf::U32 down) {
   // Limit resolution of traffic logs to 0.1 second
-  now -= chrono::duration_cast<chrono::system_clock::duration>(
-             now.time_since_epoch()) %
-         100ms;
+  auto now = TrafficLogTick(time);
   webui::RecordTraffic(now, local_host, remote_ip, up, down);
   auto it = traffic_logs.find<TrafficEndpoints>({local_host, remote_ip});
   if (it == traffic_logs.end()) {
@@ -77,12 +87,23 @@ void RecordTraffic(MAC local_host, maf::IP remote_ip, maf::U32 up,
     traffic_logs.insert(log);
     traffic_log_expiration_queue.insert(log);
   } else {
-    auto &e = (*it)->entries[now];
-    e.up += up;
-    e.down += down;
+    TrafficLog *log = *it;
+    if (now < log->entries.begin()->first) {
+      // Ticks from the flow workers arrive late. An entry older than the
+      // oldest one changes the position of the log in the expiration queue,
+      // so it must be taken out of the queue while it changes.
+      auto [first, last] = traffic_log_expiration_queue.equal_range(log);
+      traffic_log_expiration_queue.erase(find(first, last, log));
+      log->entries[now] = {up, down};
+      traffic_log_expiration_queue.insert(log);
+    } else {
+      auto &e = log->entries[now];
+      e.up += up;
+      e.down += down;
+    }
   }
-  // Expire old logs.
-  auto expiration = now - 24h;
+  // Expire old logs. Back-dated ticks shouldn't delay the expiration.
+  auto expiration = TrafficLogTick(chrono::system_clock::now()) - 24h;
   while (!traffic_log_expiration_queue.empty()) {
     // Grab the oldest TrafficLog.
     auto it = traffic_log_expiration_queue.begin();
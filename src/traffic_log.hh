@@ -21,9 +21,21 @@ struct TrafficLog {
   static void Init();
 };
 
+// Traffic logs are kept with this resolution.
+constexpr std::chrono::milliseconds kTrafficLogResolution{100};
+
+// Rounds the `time` down to `kTrafficLogResolution`.
+std::chrono::system_clock::time_point
+TrafficLogTick(std::chrono::system_clock::time_point time);
+
 void RecordTraffic(maf::MAC local_host, maf::IP remote_ip, maf::U32 up,
                    maf::U32 down);
 
+// Records traffic that was observed at the given `time`.
+void RecordTraffic(std::chrono::system_clock::time_point time,
+                   maf::MAC local_host, maf::IP remote_ip, maf::U32 up,
+                   maf::U32 down);
+
 void QueryTraffic(maf::Fn<void(const TrafficLog &)> callback);
 
 } // namespace gatekeeper
\ No newline at end of file
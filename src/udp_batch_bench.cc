@@ -0,0 +1,128 @@
+// Benchmark of the UDP socket path of the DNS server.
+//
+// Sends bursts of DNS queries (like `tests/dnsblast.linux.amd64`) to a
+// listener on the loopback interface, which echoes them back. Compares the
+// batched `UDPListener` (`recvmmsg` & `sendmmsg`) against receiving & sending
+// one datagram per syscall. Run with `./run udp_batch_bench`.
+
+#pragma maf main
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstring>
+
+#include "dns_utils.hh"
+#include "epoll_udp.hh"
+#include "format.hh"
+#include "log.hh"
+#include "random.hh"
+#include "vec.hh"
+
+using namespace maf;
+using namespace maf::dns;
+
+static constexpr Size kQueries = 200'000;
+static constexpr Size kBurstSizes[] = {1, 8, 64};
+
+// Receives & sends one datagram per syscall, like `UDPListener` used to.
+struct UnbatchedEcho : epoll::Listener {
+  epoll::UDPListener::Stats stats;
+  U8 recvbuf[65536];
+
+  void NotifyRead(Status &status) override {
+    while (true) {
+      sockaddr_in clientaddr;
+      socklen_t clilen = sizeof(clientaddr);
+      ++stats.recv_calls;
+      SSize len = recvfrom(fd, recvbuf, sizeof(recvbuf), 0,
+                           (struct sockaddr *)&clientaddr, &clilen);
+      if (len < 0) {
+        errno = 0;
+        break;
+      }
+      ++stats.received;
+      Str err;
+      ++stats.send_calls;
+      fd.SendTo(IP(clientaddr.sin_addr.s_addr),
+                Big<U16>(clientaddr.sin_port).big_endian,
+                StrView((char *)recvbuf, len), err);
+      ++stats.sent;
+    }
+  }
+
+  const char *Name() const override { return "unbatched"; }
+};
+
+struct BatchedEcho : epoll::UDPListener {
+  void HandleRequest(StrView buf, IP source_ip, U16 source_port) override {
+    Reply(source_ip, source_port, buf);
+  }
+
+  const char *Name() const override { return "batched"; }
+};
+
+static U16 BindLoopback(FD &fd, Status &status) {
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  fd.Bind(IP(127, 0, 0, 1), 0, status);
+  sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  getsockname(fd, (struct sockaddr *)&addr, &addr_len);
+  return Big<U16>(addr.sin_port).big_endian;
+}
+
+template <typename Echo>
+static void Run(const Vec<Str> &queries, Size burst, Status &status) {
+  Echo echo;
+  U16 port = BindLoopback(echo.fd, status);
+  FD client;
+  BindLoopback(client, status);
+  if (!OK(status)) {
+    return;
+  }
+  char reply[512];
+  Size replies = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (Size i = 0; i < kQueries; i += burst) {
+    for (Size j = 0; j < burst; ++j) {
+      Str err;
+      client.SendTo(IP(127, 0, 0, 1), port, queries[(i + j) % queries.size()],
+                    err);
+    }
+    echo.NotifyRead(status);
+    while (recv(client, reply, sizeof(reply), 0) > 0) {
+      ++replies;
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  errno = 0;
+  auto &stats = echo.stats;
+  LOG << f("%-9s burst %2zu: %5.3f recv + %5.3f send syscalls/query, %6.0f "
+           "ns/query (%zu replies)",
+           echo.Name(), burst, (double)stats.recv_calls / stats.received,
+           (double)stats.send_calls / stats.sent, elapsed.count() / kQueries,
+           replies);
+}
+
+int main() {
+  Vec<Str> queries;
+  for (Size i = 0; i < 1024; ++i) {
+    Str query;
+    Header{.id = (U16)i, .recursion_desired = true, .question_count = 1}
+        .write_to(query);
+    Question{.domain_name = f("%08x.example.com", random<U32>())}.write_to(
+        query);
+    queries.push_back(query);
+  }
+  Status status;
+  for (Size burst : kBurstSizes) {
+    Run<UnbatchedEcho>(queries, burst, status);
+    Run<BatchedEcho>(queries, burst, status);
+  }
+  if (!OK(status)) {
+    ERROR << status;
+    return 1;
+  }
+  return 0;
+}
@@ -15,6 +15,7 @@
 #include "dns_client.hh"
 #include "dns_table.hh"
 #include "etc.hh"
+#include "firewall.hh"
 #include "format.hh"
 #include "http.hh"
 #include "install.hh"
@@ -361,9 +362,8 @@ struct ClientAliases {
 };
 
 Str RemoteAlias(IP ip) {
-  auto name = dns::LocalReverseLookup(ip);
-  if (name != nullptr) {
-    return *name; // copy
+  if (auto name = dns::LocalReverseLookup(ip)) {
+    return *name;
   }
   return ToStr(ip);
 }
@@ -534,15 +534,27 @@ struct ConfigTable : Table {
     case 4:
       out = etc::hostname;
       break;
-    case 5:
-      for (auto &ip : etc::resolv) {
+    case 5: {
+      auto now = chrono::steady_clock::now();
+      for (auto &upstream : dns::Upstreams()) {
         if (!out.empty()) {
           out += " ";
         }
-        out += ToStr(ip);
+        out += ToStr(upstream.ip);
+        if (upstream.answers) {
+          auto ms = [](chrono::steady_clock::duration d) {
+            return chrono::duration<double, milli>(d).count();
+          };
+          out += f(" (%.0f ms, p95 %.0f ms, %.1f%% lost%s)",
+                   ms(upstream.srtt), ms(upstream.P95()), upstream.loss * 100,
+                   upstream.Healthy(now) ? "" : ", not responding");
+        } else if (upstream.timeouts) {
+          out += " (not responding)";
+        }
       }
       break;
     }
+    }
   }
 
   std::string RowID(int row) const override { return "config-onlyrow"; }
@@ -842,6 +854,8 @@ void RenderMainPage(Response &response, Request &request) {
   TrafficGraph::RenderCANVAS(html, traffic_opts);
   devices_table.RenderTABLE(html, opts);
   dns::table.RenderTABLE(html, opts);
+  firewall::table.RenderTABLE(html, opts);
+  firewall::queue_table.RenderTABLE(html, opts);
   html += "</main></body></html>";
   response.Write(html);
 }